@@ -11,6 +11,9 @@
 #include "visualize/ogre_vis/ogre_vis.hpp"
 #include "fractals.hpp"
 
+#include <thread>
+#include <algorithm>
+
 int main()
 {
     using pixel_t = unsigned char;
@@ -24,7 +27,11 @@ int main()
     const float rotate_magnitude = 0.20f;
     const float pan_magnitude = 10.0f;
     auto fractal_viewer = new fractal_frontend_t (rotate_magnitude, pan_magnitude);
-    fractal_t fractal_maker (fgenerator, fractal_viewer);
+
+    //the CPU backend is single-threaded per request, so run one worker per core
+    fractals_config config;
+    config.num_workers = std::max(1u, std::thread::hardware_concurrency());
+    fractal_t fractal_maker (fgenerator, fractal_viewer, config);
 
     //async call
     fractal_maker.start_fractals();
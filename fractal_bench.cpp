@@ -0,0 +1,490 @@
+/* fractal_bench.cpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "fractal_gen/fractal_generator.hpp"
+#include "fractal_gen/fractal_async.hpp"
+#include "fractal_gen/cpu_fractals/cpufractal_generator.hpp"
+#include "fractal_gen/cpu_fractals/deepzoom2d.hpp"
+#include "fractal_gen/ocl_fractals/oclfractal_generator.hpp"
+#include "fractal_gen/ocl_fractals/fractalgen2d.hpp"
+#include "fractal_gen/hybrid_fractals/hybridfractal_generator.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Headless benchmark: generates a batch of fractals (one per size) without any frontend, and writes
+ * the timings + kernel statistics of every run to a JSON file.
+ *
+ *   fractal_bench [cpu|ocl|hybrid|async|preview|deepzoom|slice] [--slices=N] [--buffers=N] [--devices=POLICY] [--compact=0|1] [--double] [--fast-math] [--autotune=0|1] [--cpu-workers=N] [--symmetry] [--bricks=N] [--zoom=WIDTH] [--iters=N] [size...]
+ *
+ * (default: cpu 64 128)
+ *
+ * For the OpenCL backend, --slices sets how many slices are generated per kernel launch (default:
+ * picked by size), --buffers how many device buffers the batches rotate through (1 --> no overlap
+ * between the kernels and the read-back) and --devices which devices to split the slices over
+ * (prefer_gpu, all_gpus, all_cpus or all_devices; default prefer_gpu). --compact=0 brings the whole
+ * stack back and extracts the points on the host, rather than compacting them on the device, and
+ * --double / --fast-math pick the precision of the kernel variants. --autotune=0 launches the kernels
+ * at the driver's (or their fixed) work-group size rather than the tuned one
+ *
+ * cpu generates on --cpu-workers threads (default 1; 0 --> one per hardware thread), in units cut by
+ * the cost model's pre-pass, and with --symmetry generates only the part of each slice its mirror
+ * symmetries don't cover (see cpuFractals::set_use_symmetry). --bricks=N classifies N^3 bricks by
+ * interval arithmetic first and skips the voxels of the ones proven interior or exterior
+ * (see cpuFractals::set_brick_dim). The runs split up by the cost model (cpu on more than one thread, ocl on
+ * more than one device, and hybrid) come with its predicted vs actual unit times
+ *
+ * async submits all the sizes at once to an async_fractal_generator of --cpu-workers cpu backends
+ * (default 2; 0 --> one per hardware thread), each on one thread, and records when each request's
+ * first slice came in through its slice callback, how many slices it reported, and when it finished
+ *
+ * hybrid generates on the OpenCL devices and --cpu-workers CPU threads together (default: one per
+ * hardware thread not driving a device), with the same device + kernel settings as ocl
+ *
+ * preview renders 2D thumbnails on the OpenCL preview engine instead: an 8x8 grid of size x size tiles
+ * over the whole mandelbrot set per size, all in one render
+ *
+ * deepzoom renders a size x size view --zoom wide (default 1e-20) of a spiral, by
+ * perturbation on the CPU and on OpenCL (in double with --double), with --iters iterations (default
+ * 2000), and counts the pixels where the two disagree
+ *
+ * slice generates a cross-section of the mandelbulb, size wide at 16:9 (e.g. 3840 for 4K), through
+ * the centre of the set at an angle to the stack axes, on the CPU and on OpenCL
+ */
+
+namespace
+{
+
+fractal_params make_bench_params(const int fractal_size)
+{
+    fractal_params params;
+    params.imheight = fractal_size;
+    params.imwidth = fractal_size;
+    params.imdepth = fractal_size;
+    params.MIN_LIMIT = -1.2f;
+    params.MAX_LIMIT = 1.2f;
+    params.BOUNDARY_VAL = 2.0f;
+    params.fractal_name = "mandelbrot";
+    params.collect_stats = true;
+    return params;
+}
+
+template <typename fractal_backend_t>
+void run_bench(fractal_backend_t& fgenerator, const std::string& backend_name, const std::string& backend_settings, const std::vector<int>& fractal_sizes, 
+               std::ostream& bench_out)
+{
+    bench_out << "{\"backend\":\"" << backend_name << "\",\"settings\":{" << backend_settings << "},\"runs\":[";
+    for (size_t run_idx = 0; run_idx < fractal_sizes.size(); ++run_idx)
+    {
+        auto params = make_bench_params(fractal_sizes[run_idx]);
+
+        //a backend that makes the points itself does the extraction as part of the generation
+        auto generate_start = std::chrono::high_resolution_clock::now();
+        std::shared_ptr<const fractal_stats> run_stats;
+        std::shared_ptr<const fractal_types::pointcloud<typename fractal_backend_t::point_type, typename fractal_backend_t::pixel_type>> point_cloud;
+        std::shared_ptr<std::vector<typename fractal_backend_t::pixel_type>> h_image_stack;
+        if(fgenerator.makes_points()) {
+            point_cloud = fgenerator.generate_points(params, run_stats);
+        }
+        else {
+            h_image_stack = fgenerator.generate_stack(params, run_stats);
+        }
+        auto generate_end = std::chrono::high_resolution_clock::now();
+        if(h_image_stack) {
+            point_cloud = fractal_backend_t::extract_points(*h_image_stack, params);
+        }
+        auto extract_end = std::chrono::high_resolution_clock::now();
+
+        const double generate_ms = std::chrono::duration<double, std::milli>(generate_end - generate_start).count();
+        //nothing comes back if the backend failed (see generation_token::fail)
+        if(!point_cloud)
+        {
+            std::cout << backend_name << " " << params.imheight << "^3: failed after " << generate_ms << " ms" << std::endl;
+            bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << params.imheight << "," << params.imwidth << "," << params.imdepth
+                      << "],\"status\":\"failed\",\"generate_ms\":" << generate_ms << "}";
+            continue;
+        }
+        const double extract_ms = std::chrono::duration<double, std::milli>(extract_end - generate_end).count();
+        const double voxels_per_s = (generate_ms > 0) ? 1000.0 * params.imheight * params.imwidth * params.imdepth / generate_ms : 0;
+        std::cout << backend_name << " " << params.imheight << "^3: generated in " << generate_ms << " ms (" << voxels_per_s << " voxels/s), " 
+                  << point_cloud->cloud.size() << " points extracted in " << extract_ms << " ms" << std::endl;
+        if(run_stats) {
+            run_stats->print_stats();
+        }
+
+        bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << params.imheight << "," << params.imwidth << "," << params.imdepth
+                  << "],\"status\":\"done\",\"generate_ms\":" << generate_ms << ",\"voxels_per_s\":" << voxels_per_s << ",\"extract_ms\":" << extract_ms << ",\"num_points\":" << point_cloud->cloud.size() << ",\"stats\":";
+        if(run_stats) {
+            run_stats->write_json(bench_out);
+        }
+        else {
+            bench_out << "null";
+        }
+        //empty unless the run was split up by the cost model (see util/cost_model.hpp)
+        bench_out << ",\"cost_model\":";
+        fgenerator.get_backend().get_cost_report().write_json(bench_out);
+        bench_out << "}";
+    }
+    bench_out << "\n]}\n";
+}
+
+//the slice callbacks run on the workers, so all of this is atomic
+struct async_run_progress
+{
+    async_run_progress()
+      : slices_reported(0), first_slice_us(-1)
+    {}
+
+    std::atomic<int> slices_reported;
+    std::atomic<long long> first_slice_us;
+};
+
+template <typename async_generator_t>
+void run_async_bench(async_generator_t& async_generator, const std::vector<int>& fractal_sizes, std::ostream& bench_out)
+{
+    typedef typename async_generator_t::future_type future_type;
+    bench_out << "{\"backend\":\"async\",\"settings\":{\"workers\":" << async_generator.num_workers() << "},\"runs\":[";
+
+    std::vector<std::unique_ptr<async_run_progress>> run_progress;
+    std::vector<future_type> run_futures;
+    auto submit_start = std::chrono::high_resolution_clock::now();
+    for (size_t run_idx = 0; run_idx < fractal_sizes.size(); ++run_idx)
+    {
+        run_progress.emplace_back(new async_run_progress());
+        async_run_progress* progress = run_progress.back().get();
+        run_futures.push_back(async_generator.submit(make_bench_params(fractal_sizes[run_idx]), 
+            [progress, submit_start](const int z_begin, const int z_end, const typename async_generator_t::generator_type::pixel_type*)
+            {
+                long long unset_us = -1;
+                const long long slice_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - submit_start).count();
+                progress->first_slice_us.compare_exchange_strong(unset_us, slice_us);
+                progress->slices_reported += z_end - z_begin;
+            }));
+    }
+
+    //wait in the order they were submitted; the ones that finish first just get waited on sooner
+    for (size_t run_idx = 0; run_idx < run_futures.size(); ++run_idx)
+    {
+        run_futures[run_idx].wait();
+        auto done_end = std::chrono::high_resolution_clock::now();
+
+        const double done_ms = std::chrono::duration<double, std::milli>(done_end - submit_start).count();
+        const double first_slice_ms = run_progress[run_idx]->first_slice_us.load() / 1000.0;
+        //get() would throw, there's no result
+        if(run_futures[run_idx].get_status() == fractal_request_status::failed)
+        {
+            std::cout << "async " << fractal_sizes[run_idx] << "^3 (request " << run_futures[run_idx].get_request_id() << "): failed at " << done_ms << " ms" << std::endl;
+            bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << fractal_sizes[run_idx] << "," << fractal_sizes[run_idx] << "," << fractal_sizes[run_idx]
+                      << "],\"request_id\":" << run_futures[run_idx].get_request_id() << ",\"status\":\"failed\",\"done_ms\":" << done_ms << "}";
+            continue;
+        }
+        const auto fdata = run_futures[run_idx].get();
+        const size_t num_points = fdata.point_cloud ? fdata.point_cloud->cloud.size() : 0;
+        const char* status_name = fdata.cancelled ? "cancelled" : "done";
+        std::cout << "async " << fdata.params.imheight << "^3 (request " << fdata.request_id << "): first slice at " << first_slice_ms << " ms, "
+                  << run_progress[run_idx]->slices_reported.load() << " slices reported, " << status_name << " at " << done_ms << " ms, progress " 
+                  << run_futures[run_idx].get_progress() << ", " << num_points << " points" << std::endl;
+
+        bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << fdata.params.imheight << "," << fdata.params.imwidth << "," << fdata.params.imdepth
+                  << "],\"request_id\":" << fdata.request_id << ",\"status\":\"" << status_name << "\",\"first_slice_ms\":" << first_slice_ms 
+                  << ",\"slices_reported\":" << run_progress[run_idx]->slices_reported.load() << ",\"done_ms\":" << done_ms 
+                  << ",\"progress\":" << run_futures[run_idx].get_progress() << ",\"num_points\":" << num_points << ",\"stats\":";
+        if(fdata.stats) {
+            fdata.stats->write_json(bench_out);
+        }
+        else {
+            bench_out << "null";
+        }
+        bench_out << "}";
+    }
+    bench_out << "\n]}\n";
+}
+
+void run_preview_bench(ocl_preview_engine& preview_engine, const std::vector<int>& tile_sizes, std::ostream& bench_out)
+{
+    const int grid_dim = 8;
+    bench_out << "{\"backend\":\"preview\",\"settings\":{\"grid\":" << grid_dim << "},\"runs\":[";
+    for (size_t run_idx = 0; run_idx < tile_sizes.size(); ++run_idx)
+    {
+        auto tiles = make_preview_grid(preview_tile(), grid_dim, grid_dim, tile_sizes[run_idx], tile_sizes[run_idx]);
+
+        auto render_start = std::chrono::high_resolution_clock::now();
+        const bool rendered = preview_engine.render(tiles);
+        auto render_end = std::chrono::high_resolution_clock::now();
+
+        const double render_ms = std::chrono::duration<double, std::milli>(render_end - render_start).count();
+        const double tiles_per_s = (render_ms > 0) ? 1000.0 * tiles.size() / render_ms : 0;
+        std::cout << "preview " << tiles.size() << " x " << tile_sizes[run_idx] << "^2: rendered in " << render_ms << " ms (" << tiles_per_s << " tiles/s)" << std::endl;
+
+        bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << tile_sizes[run_idx] << "," << tile_sizes[run_idx] << "],\"num_tiles\":" << tiles.size()
+                  << ",\"rendered\":" << (rendered ? "true" : "false") << ",\"render_ms\":" << render_ms << ",\"tiles_per_s\":" << tiles_per_s << "}";
+    }
+    bench_out << "\n]}\n";
+}
+
+void run_deep_zoom_bench(ocl_preview_engine& preview_engine, const double view_width, const int max_iter, const bool use_double, 
+                         const std::vector<int>& view_sizes, std::ostream& bench_out)
+{
+    bench_out << "{\"backend\":\"deepzoom\",\"settings\":{\"view_width\":" << view_width << ",\"max_iter\":" << max_iter 
+              << ",\"precision\":\"" << (use_double ? "double" : "float") << "\"},\"runs\":[";
+    for (size_t run_idx = 0; run_idx < view_sizes.size(); ++run_idx)
+    {
+        deep_zoom::zoom_view view;
+        view.center_real = "0.3602404434376143632361252444495453084826";
+        view.center_imag = "-0.6413130610648031748603750151793020665794";
+        view.view_width = view_width;
+        view.width = view_sizes[run_idx];
+        view.height = view_sizes[run_idx];
+        view.max_iter = max_iter;
+
+        auto reference_start = std::chrono::high_resolution_clock::now();
+        const auto reference = deep_zoom::make_reference_orbit(view);
+        const auto series = deep_zoom::make_series_approximation(view, reference);
+        auto reference_end = std::chrono::high_resolution_clock::now();
+
+        std::vector<uint32_t> cpu_iterations;
+        uint64_t num_rebases = 0;
+        cpu_fractals::run_deep_zoom(view, reference, series, cpu_iterations, &num_rebases);
+        auto cpu_end = std::chrono::high_resolution_clock::now();
+
+        std::vector<cl_uint> ocl_iterations;
+        const bool rendered = preview_engine.render_deep_zoom(view, reference, series, ocl_iterations, use_double);
+        auto ocl_end = std::chrono::high_resolution_clock::now();
+
+        size_t num_mismatches = 0;
+        for (size_t pixel_idx = 0; rendered && pixel_idx < cpu_iterations.size(); ++pixel_idx) {
+            num_mismatches += (cpu_iterations[pixel_idx] != ocl_iterations[pixel_idx]) ? 1 : 0;
+        }
+
+        const double reference_ms = std::chrono::duration<double, std::milli>(reference_end - reference_start).count();
+        const double cpu_ms = std::chrono::duration<double, std::milli>(cpu_end - reference_end).count();
+        const double ocl_ms = std::chrono::duration<double, std::milli>(ocl_end - cpu_end).count();
+        std::cout << "deepzoom " << view.width << "^2 @" << view_width << ": reference " << reference_ms << " ms (" << reference.size() << " iterations, " 
+                  << series.skip_iter << " skipped), cpu " << cpu_ms << " ms, ocl " << ocl_ms << " ms, " << num_mismatches << " pixels differ" << std::endl;
+
+        bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << view.width << "," << view.height << "],\"reference_ms\":" << reference_ms 
+                  << ",\"reference_iterations\":" << reference.size() << ",\"skipped_iterations\":" << series.skip_iter << ",\"cpu_ms\":" << cpu_ms
+                  << ",\"rebases\":" << num_rebases << ",\"rendered\":" << (rendered ? "true" : "false") << ",\"ocl_ms\":" << ocl_ms 
+                  << ",\"mismatches\":" << num_mismatches << "}";
+    }
+    bench_out << "\n]}\n";
+}
+
+//the plane through the centre of the set, tilted 30 degrees about the y axis, width x width*9/16
+slice_plane make_bench_plane(const int plane_width)
+{
+    const float tilt = 30.0f * 3.14159265f / 180.0f;
+    const float extent = 2.4f;
+    const int plane_height = std::max(1, plane_width * 9 / 16);
+    const float plane_u [3] = {extent * std::cos(tilt), 0, extent * std::sin(tilt)};
+    const float plane_v [3] = {0, extent * plane_height / plane_width, 0};
+    const float plane_origin [3] = {-0.5f * (plane_u[0] + plane_v[0]), -0.5f * (plane_u[1] + plane_v[1]), -0.5f * (plane_u[2] + plane_v[2])};
+    return slice_plane(plane_origin, plane_u, plane_v, plane_width, plane_height);
+}
+
+template <typename cpu_generator_t, typename ocl_generator_t>
+void run_slice_bench(cpu_generator_t& cpu_generator, ocl_generator_t& ocl_generator, const std::vector<int>& plane_widths, std::ostream& bench_out)
+{
+    bench_out << "{\"backend\":\"slice\",\"settings\":{\"precision\":\"" << ocl_generator.get_backend().precision_name() << "\"},\"runs\":[";
+    for (size_t run_idx = 0; run_idx < plane_widths.size(); ++run_idx)
+    {
+        const auto params = make_bench_params(plane_widths[run_idx]);
+        const auto plane = make_bench_plane(plane_widths[run_idx]);
+
+        auto cpu_start = std::chrono::high_resolution_clock::now();
+        auto cpu_image = cpu_generator.generate_slice(params, plane);
+        auto cpu_end = std::chrono::high_resolution_clock::now();
+        auto ocl_image = ocl_generator.generate_slice(params, plane);
+        auto ocl_end = std::chrono::high_resolution_clock::now();
+
+        const size_t interior_val = fractal_params::MAX_ITER - 1;
+        auto count_interior = [interior_val](const std::shared_ptr<std::vector<unsigned char>>& image)
+        {
+            return image ? static_cast<size_t>(std::count(image->begin(), image->end(), interior_val)) : 0;
+        };
+        const double cpu_ms = std::chrono::duration<double, std::milli>(cpu_end - cpu_start).count();
+        const double ocl_ms = std::chrono::duration<double, std::milli>(ocl_end - cpu_end).count();
+        std::cout << "slice " << plane.width << "x" << plane.height << ": cpu " << cpu_ms << " ms (" << count_interior(cpu_image) << " interior), ocl " 
+                  << ocl_ms << " ms (" << count_interior(ocl_image) << " interior)" << std::endl;
+
+        bench_out << ((run_idx > 0) ? "," : "") << "\n{\"size\":[" << plane.width << "," << plane.height << "],\"cpu_ms\":" << cpu_ms 
+                  << ",\"cpu_interior\":" << count_interior(cpu_image) << ",\"rendered\":" << (ocl_image ? "true" : "false") 
+                  << ",\"ocl_ms\":" << ocl_ms << ",\"ocl_interior\":" << count_interior(ocl_image) << "}";
+    }
+    bench_out << "\n]}\n";
+}
+
+} //anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    using pixel_t = unsigned char;
+    using fpoint_t = fractal_types::point_type;
+
+    const std::string backend_name = (argc > 1) ? argv[1] : "cpu";
+    std::vector<int> fractal_sizes;
+    ocl_launch_config launch_config;
+    ocl_helpers::ocl_device_selection device_selection;
+    std::string device_policy = "prefer_gpu";
+    double zoom_width = 1e-20;
+    int zoom_iters = 2000;
+    int cpu_workers = -1;
+    bool use_symmetry = false;
+    int brick_dim = 0;
+    for (int arg_idx = 2; arg_idx < argc; ++arg_idx)
+    {
+        const std::string bench_arg = argv[arg_idx];
+        const std::string slices_flag = "--slices=";
+        const std::string buffers_flag = "--buffers=";
+        const std::string devices_flag = "--devices=";
+        const std::string compact_flag = "--compact=";
+        const std::string autotune_flag = "--autotune=";
+        const std::string zoom_flag = "--zoom=";
+        const std::string iters_flag = "--iters=";
+        const std::string workers_flag = "--cpu-workers=";
+        const std::string bricks_flag = "--bricks=";
+        if(bench_arg.compare(0, slices_flag.size(), slices_flag) == 0) {
+            launch_config.slices_per_launch = std::stoi(bench_arg.substr(slices_flag.size()));
+        }
+        else if(bench_arg.compare(0, buffers_flag.size(), buffers_flag) == 0) {
+            launch_config.num_buffers = std::stoi(bench_arg.substr(buffers_flag.size()));
+        }
+        else if(bench_arg == "--double") {
+            launch_config.use_double = true;
+        }
+        else if(bench_arg == "--fast-math") {
+            launch_config.fast_math = true;
+        }
+        else if(bench_arg == "--symmetry") {
+            use_symmetry = true;
+        }
+        else if(bench_arg.compare(0, compact_flag.size(), compact_flag) == 0) {
+            launch_config.compact_points = std::stoi(bench_arg.substr(compact_flag.size())) != 0;
+        }
+        else if(bench_arg.compare(0, zoom_flag.size(), zoom_flag) == 0) {
+            zoom_width = std::stod(bench_arg.substr(zoom_flag.size()));
+        }
+        else if(bench_arg.compare(0, iters_flag.size(), iters_flag) == 0) {
+            zoom_iters = std::stoi(bench_arg.substr(iters_flag.size()));
+        }
+        else if(bench_arg.compare(0, workers_flag.size(), workers_flag) == 0) {
+            cpu_workers = std::stoi(bench_arg.substr(workers_flag.size()));
+        }
+        else if(bench_arg.compare(0, bricks_flag.size(), bricks_flag) == 0) {
+            brick_dim = std::stoi(bench_arg.substr(bricks_flag.size()));
+        }
+        else if(bench_arg.compare(0, autotune_flag.size(), autotune_flag) == 0) {
+            launch_config.autotune = std::stoi(bench_arg.substr(autotune_flag.size())) != 0;
+        }
+        else if(bench_arg.compare(0, devices_flag.size(), devices_flag) == 0) 
+        {
+            device_policy = bench_arg.substr(devices_flag.size());
+            if(!ocl_helpers::ocl_device_selection::parse_policy(device_policy, device_selection.policy)) {
+                std::cout << "Unknown device policy " << device_policy << std::endl;
+                return 1;
+            }
+        }
+        else {
+            fractal_sizes.push_back(std::stoi(bench_arg));
+        }
+    }
+    if(fractal_sizes.empty()) {
+        fractal_sizes = {64, 128};
+    }
+
+    const std::string bench_fname = "fractal_bench_" + backend_name + ".json";
+    std::ofstream bench_file(bench_fname);
+    if(!bench_file) {
+        std::cout << "ERROR: couldn't write the results to " << bench_fname << std::endl;
+        return 1;
+    }
+
+    if(backend_name == "cpu")
+    {
+        fractal_generator<cpuFractals, fpoint_t, pixel_t> fgenerator;
+        fgenerator.get_backend().set_num_threads((cpu_workers >= 0) ? cpu_workers : 1);
+        fgenerator.get_backend().set_use_symmetry(use_symmetry);
+        fgenerator.get_backend().set_brick_dim(brick_dim);
+        run_bench(fgenerator, backend_name, "\"threads\":" + std::to_string(fgenerator.get_backend().get_num_threads()) + ",\"symmetry\":" + (use_symmetry ? "true" : "false") +
+                  ",\"brick_dim\":" + std::to_string(fgenerator.get_backend().get_brick_dim()), fractal_sizes, bench_file);
+    }
+    else if(backend_name == "async")
+    {
+        const int num_workers = (cpu_workers > 0) ? cpu_workers : ((cpu_workers == 0) ? static_cast<int>(std::thread::hardware_concurrency()) : 2);
+        async_fractal_generator<cpuFractals, fpoint_t, pixel_t> async_generator (num_workers);
+        for (size_t worker_idx = 0; worker_idx < async_generator.num_workers(); ++worker_idx)
+        {
+            async_generator.get_backend(worker_idx).set_num_threads(1);
+            async_generator.get_backend(worker_idx).set_use_symmetry(use_symmetry);
+            async_generator.get_backend(worker_idx).set_brick_dim(brick_dim);
+        }
+        run_async_bench(async_generator, fractal_sizes, bench_file);
+    }
+    else if(backend_name == "ocl" || backend_name == "hybrid")
+    {
+        std::string backend_settings = "\"slices_per_launch\":" + std::to_string(launch_config.slices_per_launch) + 
+                                       ",\"num_buffers\":" + std::to_string(launch_config.num_buffers) + 
+                                       ",\"compact_points\":" + (launch_config.compact_points ? "true" : "false") + 
+                                       ",\"precision\":\"" + launch_config.get_precision_name() + "\"" + 
+                                       ",\"autotune\":" + (launch_config.autotune ? "true" : "false") + ",\"devices\":\"" + device_policy + "\"";
+        if(backend_name == "ocl")
+        {
+            fractal_generator<oclFractals, fpoint_t, pixel_t> fgenerator;
+            fgenerator.get_backend().set_launch_config(launch_config);
+            if(device_policy != "prefer_gpu") {
+                fgenerator.get_backend().set_devices(device_selection);
+            }
+            run_bench(fgenerator, backend_name, backend_settings, fractal_sizes, bench_file);
+        }
+        else
+        {
+            fractal_generator<hybridFractals, fpoint_t, pixel_t> fgenerator;
+            fgenerator.get_backend().set_launch_config(launch_config);
+            if(device_policy != "prefer_gpu") {
+                fgenerator.get_backend().set_devices(device_selection);
+            }
+            fgenerator.get_backend().set_cpu_workers(cpu_workers);
+            backend_settings += ",\"cpu_workers\":" + std::to_string(fgenerator.get_backend().num_cpu_workers());
+            run_bench(fgenerator, backend_name, backend_settings, fractal_sizes, bench_file);
+        }
+    }
+    else if(backend_name == "preview")
+    {
+        ocl_preview_engine preview_engine (device_selection);
+        run_preview_bench(preview_engine, fractal_sizes, bench_file);
+    }
+    else if(backend_name == "deepzoom")
+    {
+        ocl_preview_engine preview_engine (device_selection);
+        run_deep_zoom_bench(preview_engine, zoom_width, zoom_iters, launch_config.use_double, fractal_sizes, bench_file);
+    }
+    else if(backend_name == "slice")
+    {
+        fractal_generator<cpuFractals, fpoint_t, pixel_t> cpu_generator;
+        fractal_generator<oclFractals, fpoint_t, pixel_t> ocl_generator;
+        ocl_generator.get_backend().set_launch_config(launch_config);
+        if(device_policy != "prefer_gpu") {
+            ocl_generator.get_backend().set_devices(device_selection);
+        }
+        run_slice_bench(cpu_generator, ocl_generator, fractal_sizes, bench_file);
+    }
+    else {
+        std::cout << "Unknown backend " << backend_name << " -- usage: fractal_bench [cpu|ocl|hybrid|async|preview|deepzoom|slice] [--slices=N] [--buffers=N] [--devices=POLICY] [--compact=0|1] [--double] [--fast-math] [--autotune=0|1] [--cpu-workers=N] [--symmetry] [--bricks=N] [--zoom=WIDTH] [--iters=N] [size...]" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote the results to " << bench_fname << std::endl;
+    return 0;
+}
@@ -13,29 +13,115 @@
 
 #include <iostream>
 #include <algorithm>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include "util/fractal_helpers.hpp"
+#include "util/cost_model.hpp"
+#include "util/trace.hpp"
 #include "fractalgen3d.hpp"
 
+/* With more than one thread, each request starts with a coarse pre-pass (see make_cpu_cost_map), and
+ * the stack is cut into units_per_thread units per thread of about the same predicted cost -- rather
+ * than the same number of slices, as a slice through the middle of the set takes many times longer
+ * than one near the edge. The threads take the units in z order as they free up, and the spare units
+ * soak up whatever the pre-pass got wrong. How the predictions held up is in get_cost_report.
+ *
+ * With set_use_symmetry, only the part of each slice that the grid's symmetry (see
+ * cpu_fractals::stack_symmetry) doesn't cover gets generated, and the rest is mirrored from it -- half of
+ * each slice for the default limits. A spot check (cpu_fractals::check_symmetry) goes first, and if more
+ * than max_symmetry_mismatch of the sampled voxels differ from their mirror image, the whole stack gets
+ * generated as usual. NOTE: the mirrored voxels can differ from the ones the whole stack would have right
+ * on the surface, as the grid itself is only symmetric to within rounding (see check_symmetry).
+ *
+ * With set_brick_dim, the stack is split into bricks that get classified by interval arithmetic first
+ * (see cpu_fractals::classify_brick), and only the voxels of the bricks that can't be proven all
+ * interior or all exterior get evaluated. Unlike the symmetry, that doesn't change the stack (or the
+ * statistics) at all.
+ */
 template <typename point_t, typename data_t>
 class cpuFractals
 {
 public:
-  cpuFractals()
-  {}
+  //num_threads = 0 --> one per hardware thread
+  explicit cpuFractals(const int num_threads = 1)
+    : use_symmetry(false), brick_dim(0)
+  {
+    set_num_threads(num_threads);
+  }
+
+  inline void set_use_symmetry(const bool symmetry_on)
+  {
+    use_symmetry = symmetry_on;
+  }
+
+  //0 --> evaluate every voxel
+  inline void set_brick_dim(const int brick_size)
+  {
+    brick_dim = std::max(0, brick_size);
+  }
+
+  inline int get_brick_dim() const
+  {
+    return brick_dim;
+  }
+
+  inline void set_num_threads(const int num_threads)
+  {
+    generator_threads = (num_threads > 0) ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  inline int get_num_threads() const
+  {
+    return generator_threads;
+  }
+
+  //of the last request generated on more than one thread
+  inline const cost_report& get_cost_report() const
+  {
+    return last_report;
+  }
 
   virtual ~cpuFractals()
   {}
 
-  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params)
+  static std::string backend_name()
+  {
+    return "cpu";
+  }
+
+  //the precision the fractal is iterated at. The symmetry mode can change the odd surface voxel (see
+  //above), so it's part of it too -- that way the caches don't hand out mirrored stacks for exact requests
+  std::string precision_name() const
+  {
+    return use_symmetry ? "float_symmetry" : "float";
+  }
+
+  //run_stats is only given if the request asked for statistics
+  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params, fractal_stats* run_stats = nullptr)
   {
     //NOTE: need to dynamically allocate, as the memory requirements become prohibitive very fast (e.g. 512 x 512 x 512 of ints --> 4*2^27 bytes)
 
-    std::cout << "Making fractal... " << std::endl;
 
-	cpu_fractals::run_cpu_fractal<data_t>(h_image_stack, fractalgen_params);
+    cpu_fractals::cpu_slice_options options;
+    options.symmetry = get_symmetry(fractalgen_params);
+    options.brick_dim = brick_dim;
+    cpu_fractals::brick_tally bricks;
+    if(generator_threads > 1) {
+      make_fractal_threaded(h_image_stack, fractalgen_params, run_stats, options, bricks);
+    }
+    else {
+	  cpu_fractals::run_cpu_fractal<data_t>(h_image_stack, fractalgen_params, run_stats, options, &bricks);
+    }
+    if(brick_dim > 0) {
+      bricks.print_tally();
+    }
 
-    std::cout << "Making Point Cloud... " << std::endl;
 
 //	auto fracstack_sum = std::accumulate(h_image_stack.begin(), h_image_stack.end(), 0);
 //    std::cout << "NOTE: stack sum is " << fracstack_sum << std::endl;
@@ -64,6 +150,145 @@ public:
 
     //return fdata;
   }
+
+  //the plane's cross-section of the fractal (see cpu_fractals::run_cpu_slice) into image
+  virtual bool make_slice(std::vector<data_t>& image, const fractal_params& fractalgen_params, const slice_plane& plane)
+  {
+    cpu_fractals::run_cpu_slice<data_t>(image, fractalgen_params, plane);
+    return true;
+  }
+
+private:
+  enum { units_per_thread = 4, symmetry_samples = 4096 };
+  //the share of the spot check's samples that can differ from their mirror image, for rounding
+  static constexpr double max_symmetry_mismatch = 0.01;
+
+  //the symmetries to generate the request with, if they pass the spot check
+  cpu_fractals::stack_symmetry get_symmetry(const fractal_params& fractalgen_params) const
+  {
+    if(!use_symmetry) {
+      return cpu_fractals::stack_symmetry();
+    }
+    const auto symmetry = cpu_fractals::stack_symmetry::for_request(fractalgen_params);
+    if(!symmetry.any()) {
+      return symmetry;
+    }
+    const size_t num_mismatches = cpu_fractals::check_symmetry(fractalgen_params, symmetry, symmetry_samples);
+    if(num_mismatches > max_symmetry_mismatch * symmetry_samples)
+    {
+      std::cout << "NOTE: " << num_mismatches << " of " << static_cast<int>(symmetry_samples) << " voxels of the symmetry spot check differ from their mirror image -- generating the whole stack" << std::endl;
+      return cpu_fractals::stack_symmetry();
+    }
+    std::cout << "Generating " << 100 * symmetry.get_generated_fraction(fractalgen_params) << "% of each slice, the rest is mirrored (" 
+              << num_mismatches << " of " << static_cast<int>(symmetry_samples) << " spot checks differ)" << std::endl;
+    return symmetry;
+  }
+
+  void make_fractal_threaded(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params, fractal_stats* run_stats, const cpu_fractals::cpu_slice_options& options,
+                             cpu_fractals::brick_tally& bricks)
+  {
+    FRACTAL_TRACE_SCOPE("cpu_generate");
+    auto run_start = std::chrono::high_resolution_clock::now();
+    const int z_begin = fractalgen_params.cancel_token.get_resume_slice();
+    const int z_end = fractalgen_params.imdepth;
+    const cost_map slice_costs = cpu_fractals::make_cpu_cost_map(fractalgen_params);
+    const std::vector<int> z_splits = slice_costs.split_even(z_begin, z_end, generator_threads * units_per_thread);
+    const size_t num_units = z_splits.size() - 1;
+    //the pre-pass ran the same formula on one thread, so its rate is what a thread should manage --
+    //as long as there's a hardware thread for each
+    const double hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    const double cost_per_ms = slice_costs.get_prepass_rate() * std::min(1.0, hardware_threads / generator_threads);
+    //the mirrored voxels are next to free
+    const double generated_fraction = options.symmetry.get_generated_fraction(fractalgen_params);
+
+    std::vector<std::string> thread_names;
+    for (int thread_idx = 0; thread_idx < generator_threads; ++thread_idx) {
+      thread_names.push_back("CPU thread " + std::to_string(thread_idx));
+    }
+    last_report = cost_report(thread_names, slice_costs.prepass_ms);
+
+    std::mutex report_mutex;
+    std::atomic<size_t> next_unit (0);
+    std::vector<char> slice_done (fractalgen_params.imdepth, 0);
+    //every unit gets its own statistics (so nothing is shared between the threads), as which of them
+    //count isn't known until the request has stopped
+    std::vector<std::unique_ptr<fractal_stats>> unit_stats (num_units);
+    std::vector<cpu_fractals::brick_tally> thread_bricks (generator_threads);
+
+    auto run_thread = [&](const size_t thread_idx)
+    {
+      while(!fractalgen_params.cancel_token.should_stop())
+      {
+        const size_t unit_idx = next_unit++;
+        if(unit_idx >= num_units) {
+          break;
+        }
+        const int unit_begin = z_splits[unit_idx];
+        const int unit_end = z_splits[unit_idx+1];
+        if(unit_begin == unit_end) {
+          continue;
+        }
+
+        if(run_stats) {
+          unit_stats[unit_idx].reset(new fractal_stats(fractalgen_params.imdepth));
+        }
+        auto unit_start = std::chrono::high_resolution_clock::now();
+        const int unit_stop = cpu_fractals::run_cpu_slices<data_t>(h_image_stack, fractalgen_params, unit_begin, unit_end, unit_stats[unit_idx].get(), options, &thread_bricks[thread_idx]);
+        auto unit_finish = std::chrono::high_resolution_clock::now();
+
+        std::lock_guard<std::mutex> report_lock (report_mutex);
+        std::fill(slice_done.begin() + unit_begin, slice_done.begin() + unit_stop, 1);
+        if(unit_stop < unit_end) {
+          break;
+        }
+        const double unit_cost = generated_fraction * slice_costs.get_cost(unit_begin, unit_end);
+        last_report.add_unit(thread_idx, unit_begin, unit_end, unit_cost, (cost_per_ms > 0) ? unit_cost / cost_per_ms : 0,
+                             std::chrono::duration<double, std::milli>(unit_finish - unit_start).count(),
+                             std::chrono::duration<double, std::milli>(unit_finish - run_start).count());
+      }
+    };
+
+    //the first thread is this one. The units don't overlap, so the threads can all write to the stack
+    std::vector<std::thread> worker_threads;
+    for (int thread_idx = 1; thread_idx < generator_threads; ++thread_idx)
+    {
+      worker_threads.emplace_back([&run_thread, thread_idx]()
+        {
+          FRACTAL_TRACE_THREAD_NAME("cpu_thread_" + std::to_string(thread_idx));
+          run_thread(thread_idx);
+        });
+    }
+    run_thread(0);
+    for (auto& worker_thread : worker_threads) {
+      worker_thread.join();
+    }
+
+    //the progress of a stopped request has to be a single slice to resume from, so it's the first
+    //unfinished one that counts -- anything the threads did past it gets generated again
+    const int first_missing = static_cast<int>(std::find(slice_done.begin() + z_begin, slice_done.end(), 0) - slice_done.begin());
+    if(first_missing < z_end) {
+      fractalgen_params.cancel_token.stop_at(first_missing);
+    }
+
+    //the units past the first unfinished slice are generated again on the resume, so only the ones
+    //before it count towards the statistics. A unit can't straddle it, as one that starts before it
+    //stopped there at the latest
+    for (size_t unit_idx = 0; unit_idx < num_units && z_splits[unit_idx] < first_missing; ++unit_idx)
+    {
+      if(unit_stats[unit_idx]) {
+        run_stats->merge(*unit_stats[unit_idx]);
+      }
+    }
+    for (const auto& tally : thread_bricks) {
+      bricks.merge(tally);
+    }
+    last_report.print_report();
+  }
+
+  int generator_threads;
+  bool use_symmetry;
+  int brick_dim;
+  cost_report last_report;
 };
 
 #endif
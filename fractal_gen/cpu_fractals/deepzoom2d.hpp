@@ -0,0 +1,118 @@
+/* deepzoom2d.hpp -- part of the CPU fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef CPU_FRACTALS_DEEPZOOM_2D_HPP
+#define CPU_FRACTALS_DEEPZOOM_2D_HPP
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <complex>
+#include <iostream>
+#include <algorithm>
+
+#include "util/deep_zoom.hpp"
+#include "util/trace.hpp"
+
+namespace cpu_fractals
+{
+
+//Renders the view by perturbation off the reference orbit (see util/deep_zoom.hpp), in double. iterations
+//gets the escape iteration of every pixel (the first n with |z[n]| > 2), row-major, or max_iter for the
+//interior. num_rebases (if given) gets how many times the pixels had to rebase.
+//
+//The pixels are iterated a block of num_lanes at a time, with the state of the block in arrays of its
+//own (one element per pixel), and a block runs until all of its pixels are done. NOTE: the lane loop is
+//scalar -- the lanes index the reference orbit at their own iterations, and the escape + glitch checks
+//branch, so the compiler doesn't vectorize it (not even at -O3 -march=haswell)
+inline void run_deep_zoom(const deep_zoom::zoom_view& view, const deep_zoom::reference_orbit& reference, const deep_zoom::series_approximation& series,
+                          std::vector<uint32_t>& iterations, uint64_t* num_rebases = nullptr)
+{
+    FRACTAL_TRACE_SCOPE("cpu_deep_zoom");
+    enum { num_lanes = 8 };
+    const size_t num_pixels = static_cast<size_t>(view.width) * view.height;
+    iterations.assign(num_pixels, view.max_iter);
+    if(reference.size() < 2) {
+        return;
+    }
+
+    const double* orbit_real = reference.orbit_real.data();
+    const double* orbit_imag = reference.orbit_imag.data();
+    const int last_ref = reference.size() - 1;
+    uint64_t total_rebases = 0;
+
+    for (size_t first_pixel = 0; first_pixel < num_pixels; first_pixel += num_lanes)
+    {
+        double dc_real [num_lanes], dc_imag [num_lanes];
+        double delta_real [num_lanes], delta_imag [num_lanes];
+        int ref_idx [num_lanes], iter_num [num_lanes];
+        bool active [num_lanes];
+        for (int lane = 0; lane < num_lanes; ++lane)
+        {
+            const size_t pixel_idx = std::min(first_pixel + lane, num_pixels - 1);
+            const std::complex<double> dc = view.get_pixel_offset(static_cast<int>(pixel_idx / view.width), static_cast<int>(pixel_idx % view.width));
+            const std::complex<double> delta = series.get_delta(dc);
+            dc_real[lane] = dc.real();
+            dc_imag[lane] = dc.imag();
+            delta_real[lane] = delta.real();
+            delta_imag[lane] = delta.imag();
+            ref_idx[lane] = series.skip_iter;
+            iter_num[lane] = series.skip_iter;
+            active[lane] = (first_pixel + lane < num_pixels);
+        }
+
+        int num_active = std::min<int>(num_lanes, static_cast<int>(num_pixels - first_pixel));
+        while(num_active > 0)
+        {
+            num_active = 0;
+            for (int lane = 0; lane < num_lanes; ++lane)
+            {
+                const double z_real = orbit_real[ref_idx[lane]] + delta_real[lane];
+                const double z_imag = orbit_imag[ref_idx[lane]] + delta_imag[lane];
+                const double z_mag = z_real * z_real + z_imag * z_imag;
+                const double delta_mag = delta_real[lane] * delta_real[lane] + delta_imag[lane] * delta_imag[lane];
+                active[lane] = active[lane] && z_mag <= 4 && iter_num[lane] < view.max_iter;
+
+                //glitch (or the end of the reference): carry on from the start of the orbit, with the
+                //pixel's full value as its delta
+                const bool rebase = active[lane] && (z_mag < delta_mag || ref_idx[lane] == last_ref);
+                total_rebases += rebase ? 1 : 0;
+                const double base_real = rebase ? z_real : delta_real[lane];
+                const double base_imag = rebase ? z_imag : delta_imag[lane];
+                const int base_idx = rebase ? 0 : ref_idx[lane];
+
+                const double ref_real = orbit_real[base_idx];
+                const double ref_imag = orbit_imag[base_idx];
+                //d = 2 Z d + d^2 + dc = (2 Z + d) d + dc
+                const double factor_real = 2 * ref_real + base_real;
+                const double factor_imag = 2 * ref_imag + base_imag;
+                const double next_real = factor_real * base_real - factor_imag * base_imag + dc_real[lane];
+                const double next_imag = factor_real * base_imag + factor_imag * base_real + dc_imag[lane];
+
+                delta_real[lane] = active[lane] ? next_real : delta_real[lane];
+                delta_imag[lane] = active[lane] ? next_imag : delta_imag[lane];
+                ref_idx[lane] = active[lane] ? base_idx + 1 : ref_idx[lane];
+                iter_num[lane] += active[lane] ? 1 : 0;
+                num_active += active[lane] ? 1 : 0;
+            }
+        }
+
+        for (int lane = 0; lane < num_lanes && first_pixel + lane < num_pixels; ++lane) {
+            iterations[first_pixel + lane] = static_cast<uint32_t>(iter_num[lane]);
+        }
+    }
+
+    if(num_rebases) {
+        *num_rebases = total_rebases;
+    }
+}
+
+}
+
+#endif
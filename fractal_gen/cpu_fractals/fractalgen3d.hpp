@@ -12,8 +12,17 @@
 #include <opencv2/opencv.hpp>
 
 #include <tuple>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <random>
 
 #include "util/fractal_helpers.hpp"
+#include "util/cost_model.hpp"
+#include "util/trace.hpp"
+#include "interval_bricks.hpp"
 
 namespace cpu_fractals
 {
@@ -56,6 +65,13 @@ struct FractalLimits
 };
 
 
+//the grid the CPU generator samples the stack on. NOTE: that's always the default limits --
+//params.MIN_LIMIT/MAX_LIMIT aren't used here -- so anything that depends on the grid has to go by these
+inline FractalLimits<float> get_stack_limits(const fractal_params& params)
+{
+    return FractalLimits<float>(PixelPoint<float>(params.imheight, params.imwidth, params.imdepth));
+}
+
 template <typename pixel_t, typename data_t>
 std::tuple<bool, pixel_t> mandel_point(const PixelPoint<data_t> px_idx, const int order, const size_t num_iter) 
 {
@@ -94,44 +110,279 @@ std::tuple<bool, pixel_t> mandel_quaternion_point(const PixelPoint<data_t> px_id
     
 }
 
-template <typename pixel_t>
-void run_cpu_fractal(std::vector<pixel_t>& h_image_stack, const fractal_params& params)
+/* The mirror symmetry of mandel_point that lines up with the stack's grid, so that part of each slice
+ * can be copied from the rest rather than generated. phi = atan2(row, col) just flips sign with the row,
+ * so with row limits symmetric about 0, row i of the grid is the mirror image of row height - i (row 0
+ * has no partner, so it's generated). The columns don't mirror, as that turns phi into pi - phi, which
+ * only comes back out as a mirror image for an odd ORDER; the bulb's (ORDER-1)-fold symmetry about the
+ * depth axis doesn't line up with the grid either. The depth isn't mirrored, as the slices are dealt out
+ * to the threads + devices separately.
+ */
+struct stack_symmetry
+{
+    stack_symmetry()
+        : mirror_rows(false)
+    {}
+
+    //the symmetry the grid allows -- the grid the stack is actually sampled on (see get_stack_limits)
+    static stack_symmetry for_request(const fractal_params& params)
+    {
+        const auto limits = get_stack_limits(params);
+        stack_symmetry symmetry;
+        symmetry.mirror_rows = (limits.MIN_LIMIT == -limits.MAX_LIMIT);
+        return symmetry;
+    }
+
+    inline bool any() const
+    {
+        return mirror_rows;
+    }
+
+    //the rows [0, get_num_rows) are generated, the rest are copies
+    inline int get_num_rows(const int imheight) const
+    {
+        return mirror_rows ? std::min(imheight, imheight / 2 + 1) : imheight;
+    }
+
+    //the generated row that row y is a copy of (or y itself)
+    inline int get_source_row(const int y, const int imheight) const
+    {
+        return (y < get_num_rows(imheight)) ? y : imheight - y;
+    }
+
+    //the share of each slice that gets generated
+    inline double get_generated_fraction(const fractal_params& params) const
+    {
+        return (params.imheight > 0) ? static_cast<double>(get_num_rows(params.imheight)) / params.imheight : 1;
+    }
+
+    bool mirror_rows;
+};
+
+//Evaluates num_samples of the voxels that would be copies (spread over the whole stack, the same ones
+//every time) along with the voxels they'd be copied from, and returns how many of them differ in what
+//goes in the stack (interior or not). The symmetry is exact in the formula, but the float grid
+//coordinates of a row and its mirror image can be an ulp apart, which flips the odd voxel right on the
+//surface (a few in 10000 for the default limits) -- anything much past that, the symmetry doesn't hold
+inline size_t check_symmetry(const fractal_params& params, const stack_symmetry& symmetry, const int num_samples = 4096)
 {
+    FRACTAL_TRACE_SCOPE("cpu_symmetry_check");
     using fpixel_t = float;
-    FractalLimits<fpixel_t> limits(PixelPoint<fpixel_t>(params.imheight, params.imwidth, params.imdepth)); 
+    const int num_rows = symmetry.get_num_rows(params.imheight);
+    if(params.imdepth <= 0 || params.imwidth <= 0 || num_rows == params.imheight) {
+        return 0;
+    }
 
-    cv::namedWindow("cpuslice", CV_WINDOW_AUTOSIZE);
+    auto limits = get_stack_limits(params);
+    const int order = params.ORDER;
+    const size_t max_iter = params.MAX_ITER;
+    auto evaluate = [&](const int y, const int x, const int z)
+    {
+        return mandel_point<size_t, fpixel_t>(PixelPoint<fpixel_t>(limits.offset_Y(y), limits.offset_X(x), limits.offset_Z(z)), order, max_iter);
+    };
 
-    for (size_t z = 0; z < params.imdepth; ++z)
+    std::minstd_rand sample_rng;
+    size_t num_mismatches = 0;
+    for (int sample_idx = 0; sample_idx < num_samples; ++sample_idx)
     {
+        //any voxel past the generated rows is a copy
+        const int z = sample_rng() % params.imdepth;
+        const int y = num_rows + sample_rng() % (params.imheight - num_rows);
+        const int x = sample_rng() % params.imwidth;
+        if(std::get<0>(evaluate(y, x, z)) != std::get<0>(evaluate(symmetry.get_source_row(y, params.imheight), x, z))) {
+            ++num_mismatches;
+        }
+    }
+    return num_mismatches;
+}
+
+//how run_cpu_slices goes about the slices, past evaluating every voxel
+struct cpu_slice_options
+{
+    cpu_slice_options()
+        : brick_dim(0)
+    {}
+
+    //only the rows the symmetry doesn't cover get generated, and the rest of each slice is copied from them
+    stack_symmetry symmetry;
+    //> 0 --> the stack is split into bricks of brick_dim^3 voxels, and only the voxels of the bricks that
+    //classify_brick can't prove interior or exterior get evaluated. The others are filled in as proven
+    int brick_dim;
+};
+
+//Generates the slices [z_begin, z_end) of the stack, and returns the first slice it didn't generate (i.e.
+//z_end, unless the request was stopped). run_stats (if given) gets the statistics of the generated
+//slices added to it, and bricks (if given) what the bricks came out as. The stack has to start out as 0
+//outside of the interior, as only the interior voxels get written
+template <typename pixel_t>
+int run_cpu_slices(std::vector<pixel_t>& h_image_stack, const fractal_params& params, const int z_begin, const int z_end, fractal_stats* run_stats = nullptr,
+                   const cpu_slice_options& options = cpu_slice_options(), brick_tally* bricks = nullptr)
+{
+    using fpixel_t = float;
+    auto limits = get_stack_limits(params);
+    const stack_symmetry& symmetry = options.symmetry;
+    const int num_rows = symmetry.get_num_rows(params.imheight);
+    const int num_cols = params.imwidth;
+    const int max_iter = static_cast<int>(params.MAX_ITER);
+    const int order = params.ORDER;
+    //the copies need the iteration counts of their sources for the statistics
+    std::vector<int> slice_iterations ((run_stats && symmetry.any()) ? params.imheight * params.imwidth : 0);
+
+    //the bricks of the layer the current slice is in (row-major), classified as the slices get to it
+    const int brick_dim = options.brick_dim;
+    const int num_brick_rows = (brick_dim > 0) ? (num_rows + brick_dim - 1) / brick_dim : 0;
+    const int num_brick_cols = (brick_dim > 0) ? (num_cols + brick_dim - 1) / brick_dim : 0;
+    std::vector<brick_bounds> layer_bricks (num_brick_rows * num_brick_cols);
+    int brick_layer = -1;
+    auto classify_layer = [&](const int layer_idx)
+    {
+        FRACTAL_TRACE_SCOPE_ARG("cpu_classify_bricks", layer_idx);
+        const int layer_end = std::min(params.imdepth, (layer_idx + 1) * brick_dim) - 1;
+        for (int brick_row = 0; brick_row < num_brick_rows; ++brick_row)
+        {
+            const int row_end = std::min(num_rows, (brick_row + 1) * brick_dim) - 1;
+            for (int brick_col = 0; brick_col < num_brick_cols; ++brick_col)
+            {
+                const int col_end = std::min(num_cols, (brick_col + 1) * brick_dim) - 1;
+                //{x, y, z} -- only the magnitudes matter
+                const float box_min [3] = {limits.offset_X(brick_col * brick_dim), limits.offset_Y(brick_row * brick_dim), limits.offset_Z(layer_idx * brick_dim)};
+                const float box_max [3] = {limits.offset_X(col_end), limits.offset_Y(row_end), limits.offset_Z(layer_end)};
+                layer_bricks[brick_row * num_brick_cols + brick_col] = classify_brick(box_min, box_max, order, max_iter);
+                if(bricks) {
+                    bricks->add_brick(layer_bricks[brick_row * num_brick_cols + brick_col]);
+                }
+            }
+        }
+        brick_layer = layer_idx;
+    };
+
+    for (int z = z_begin; z < z_end; ++z)
+    {
+        //bail out between slices if the request was cancelled, superseded or pre-empted
+        if(params.cancel_token.should_stop()) {
+            return z;
+        }
+        FRACTAL_TRACE_SCOPE_ARG("cpu_slice", z);
+        auto slice_start = std::chrono::high_resolution_clock::now();
+
         auto z_point = limits.offset_Z(z);
         const int slice_offset = params.imheight * params.imwidth * z;
         cv::Mat_<pixel_t> image = cv::Mat_<pixel_t>(params.imheight, params.imwidth, &h_image_stack[slice_offset]);
         //image = cv::Mat_<pixel_t>::zeros(params.imheight, params.imwidth);
         //std::fill(image.begin(), image.end(), 0);
-        for (size_t y = 0; y < params.imheight; ++y)
+        auto evaluate_voxels = [&](const int row_begin, const int row_end, const int col_begin, const int col_end)
         {
-            auto y_point = limits.offset_Y(y);
-            for (size_t x = 0; x < params.imwidth; ++x)
+            for (int y = row_begin; y < row_end; ++y)
             {
-                auto x_point = limits.offset_X(x);
-
-                bool is_valid;
-                size_t iter_num;
-                std::tie(is_valid, iter_num) = mandel_point<pixel_t, fpixel_t>
-                    (PixelPoint<fpixel_t>(y_point,x_point,z_point), params.ORDER, params.MAX_ITER);   
-
-                if(is_valid)
+                auto y_point = limits.offset_Y(y);
+                for (int x = col_begin; x < col_end; ++x)
                 {
-                    image(y,x) = params.MAX_ITER-1; 
-                    //cloud_indices.emplace_back(x, y, z);
+                    auto x_point = limits.offset_X(x);
+
+                    bool is_valid;
+                    size_t iter_num;
+                    std::tie(is_valid, iter_num) = mandel_point<pixel_t, fpixel_t>
+                        (PixelPoint<fpixel_t>(y_point,x_point,z_point), order, max_iter);   
+
+                    if(is_valid)
+                    {
+                        image(y,x) = max_iter-1; 
+                        //cloud_indices.emplace_back(x, y, z);
+                    }
+
+                    if(run_stats)
+                    {
+                        //NOTE: mandel_point reports the index of the escaping iteration, so it's one more than that
+                        const int num_iterations = static_cast<int>(is_valid ? iter_num : iter_num + 1);
+                        run_stats->add_voxel(x, y, z, num_iterations, is_valid);
+                        if(!slice_iterations.empty()) {
+                            slice_iterations[y * params.imwidth + x] = num_iterations;
+                        }
+                    }
+                }   
+            }
+            if(bricks) {
+                bricks->voxels_evaluated += static_cast<uint64_t>(row_end - row_begin) * (col_end - col_begin);
+            }
+        };
+
+        //the voxels of a proven brick, which all take num_iterations
+        auto fill_voxels = [&](const int row_begin, const int row_end, const int col_begin, const int col_end, const bool is_interior, const int num_iterations)
+        {
+            for (int y = row_begin; y < row_end && (is_interior || run_stats); ++y)
+            {
+                for (int x = col_begin; x < col_end; ++x)
+                {
+                    if(is_interior) {
+                        image(y,x) = max_iter-1;
+                    }
+                    if(run_stats)
+                    {
+                        run_stats->add_voxel(x, y, z, num_iterations, is_interior);
+                        if(!slice_iterations.empty()) {
+                            slice_iterations[y * params.imwidth + x] = num_iterations;
+                        }
+                    }
                 }
-            }   
+            }
+            if(bricks) {
+                bricks->voxels_skipped += static_cast<uint64_t>(row_end - row_begin) * (col_end - col_begin);
+            }
+        };
+
+        if(brick_dim <= 0) {
+            evaluate_voxels(0, num_rows, 0, num_cols);
+        }
+        else
+        {
+            if(z / brick_dim != brick_layer) {
+                classify_layer(z / brick_dim);
+            }
+            for (int brick_row = 0; brick_row < num_brick_rows; ++brick_row)
+            {
+                const int row_begin = brick_row * brick_dim;
+                const int row_end = std::min(num_rows, row_begin + brick_dim);
+                for (int brick_col = 0; brick_col < num_brick_cols; ++brick_col)
+                {
+                    const int col_begin = brick_col * brick_dim;
+                    const int col_end = std::min(num_cols, col_begin + brick_dim);
+                    const brick_bounds& bounds = layer_bricks[brick_row * num_brick_cols + brick_col];
+                    if(bounds.type == brick_class::interior) {
+                        fill_voxels(row_begin, row_end, col_begin, col_end, true, max_iter);
+                    }
+                    //the statistics need the iteration counts, so the exterior bricks only get skipped if they all escape together
+                    else if(bounds.type == brick_class::exterior && (bounds.escape_iter >= 0 || !run_stats)) {
+                        fill_voxels(row_begin, row_end, col_begin, col_end, false, bounds.escape_iter + 1);
+                    }
+                    else {
+                        evaluate_voxels(row_begin, row_end, col_begin, col_end);
+                    }
+                }
+            }
         }
 
+        for (int y = num_rows; y < params.imheight; ++y)
+        {
+            const int source_y = symmetry.get_source_row(y, params.imheight);
+            for (int x = 0; x < params.imwidth; ++x)
+            {
+                image(y,x) = image(source_y,x);
+                if(run_stats) {
+                    run_stats->add_voxel(x, y, z, slice_iterations[source_y * params.imwidth + x], image(y,x) == max_iter-1);
+                }
+            }
+        }
+
+        if(run_stats) {
+            run_stats->slice_ms[z] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - slice_start).count();
+        }
+        params.cancel_token.report_slices(z, z + 1, &h_image_stack[slice_offset]);
+
         bool debug_mode = false;
         if(debug_mode)
         {
+            //NOTE: only do this in debug mode, the highgui calls aren't safe with several generator threads
+            cv::namedWindow("cpuslice", CV_WINDOW_AUTOSIZE);
             auto px_sum = cv::sum(cv::sum(image)) / static_cast<float>(params.MAX_ITER-1);
             std::cout << "Image " << z << " Generated... has " << ((px_sum[0] > 0) ? std::to_string(px_sum[0]):"NO") << " non-zero elements" << std::endl;
 
@@ -143,6 +394,92 @@ void run_cpu_fractal(std::vector<pixel_t>& h_image_stack, const fractal_params&
             cv::waitKey(10);
         }
     }
+    return z_end;
+}
+
+//run_stats (if given) gets the statistics of the generated slices added to it
+template <typename pixel_t>
+void run_cpu_fractal(std::vector<pixel_t>& h_image_stack, const fractal_params& params, fractal_stats* run_stats = nullptr, 
+                     const cpu_slice_options& options = cpu_slice_options(), brick_tally* bricks = nullptr)
+{
+    FRACTAL_TRACE_SCOPE("cpu_generate");
+    const int z_stop = run_cpu_slices<pixel_t>(h_image_stack, params, params.cancel_token.get_resume_slice(), params.imdepth, run_stats, options, bricks);
+    if(z_stop < params.imdepth) {
+        params.cancel_token.stop_at(z_stop);
+    }
+}
+
+//the predicted cost of the request's slices (see util/cost_model.hpp), from mandel_point on a coarse grid
+inline cost_map make_cpu_cost_map(const fractal_params& params)
+{
+    using fpixel_t = float;
+    auto limits = get_stack_limits(params);
+    const int order = params.ORDER;
+    const size_t max_iter = params.MAX_ITER;
+    return make_cost_map(params, [&](const int row, const int col, const int depth)
+        {
+            bool is_valid;
+            size_t iter_num;
+            std::tie(is_valid, iter_num) = mandel_point<size_t, fpixel_t>
+                (PixelPoint<fpixel_t>(limits.offset_Y(row), limits.offset_X(col), limits.offset_Z(depth)), order, max_iter);
+            return static_cast<int>(is_valid ? iter_num : iter_num + 1);
+        });
+}
+
+
+//Evaluates the plane's grid of points (see slice_plane) into image, row-major. Unlike the stack, where
+//only the interior is marked, the pixels are the iteration counts as fractal3d writes them (the escape
+//iteration, MAX_ITER-1 for the interior), so there's something to look at either side of the surface.
+//The rows are split into bands over the hardware threads, as there's no batching to hide behind
+template <typename pixel_t>
+void run_cpu_slice(std::vector<pixel_t>& image, const fractal_params& params, const slice_plane& plane)
+{
+    FRACTAL_TRACE_SCOPE("cpu_slice_plane");
+    using fpixel_t = float;
+    image.assign(plane.num_pixels(), 0);
+    if(plane.num_pixels() == 0) {
+        return;
+    }
+
+    const int max_iter = static_cast<int>(params.MAX_ITER);
+    const int order = params.ORDER;
+    fpixel_t u_step [3], v_step [3];
+    for (int axis_idx = 0; axis_idx < 3; ++axis_idx)
+    {
+        u_step[axis_idx] = plane.u_axis[axis_idx] / plane.width;
+        v_step[axis_idx] = plane.v_axis[axis_idx] / plane.height;
+    }
+
+    auto run_rows = [&](const int row_begin, const int row_end)
+    {
+        for (int y = row_begin; y < row_end; ++y)
+        {
+            for (int x = 0; x < plane.width; ++x)
+            {
+                const fpixel_t x_point = plane.origin[0] + x * u_step[0] + y * v_step[0];
+                const fpixel_t y_point = plane.origin[1] + x * u_step[1] + y * v_step[1];
+                const fpixel_t z_point = plane.origin[2] + x * u_step[2] + y * v_step[2];
+
+                bool is_valid;
+                size_t iter_num;
+                std::tie(is_valid, iter_num) = mandel_point<pixel_t, fpixel_t>
+                    (PixelPoint<fpixel_t>(y_point,x_point,z_point), order, max_iter);
+                //NOTE: a point escaping on the last iteration would otherwise read as the interior
+                image[static_cast<size_t>(y) * plane.width + x] = static_cast<pixel_t>(is_valid ? max_iter-1 : std::min<size_t>(iter_num, max_iter-2));
+            }
+        }
+    };
+
+    const int num_threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), plane.height));
+    const int band_rows = (plane.height + num_threads - 1) / num_threads;
+    std::vector<std::thread> band_threads;
+    for (int row_begin = band_rows; row_begin < plane.height; row_begin += band_rows) {
+        band_threads.emplace_back(run_rows, row_begin, std::min(plane.height, row_begin + band_rows));
+    }
+    run_rows(0, std::min(plane.height, band_rows));
+    for (auto& band_thread : band_threads) {
+        band_thread.join();
+    }
 }
 
 
@@ -0,0 +1,168 @@
+/* interval_bricks.hpp -- part of the CPU fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef CPU_FRACTALS_INTERVAL_BRICKS_HPP
+#define CPU_FRACTALS_INTERVAL_BRICKS_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+
+namespace cpu_fractals
+{
+
+enum class brick_class
+{
+    //some of the brick's voxels might escape and some might not
+    mixed,
+    //none of the voxels escape within the iterations
+    interior,
+    //every voxel escapes within the iterations
+    exterior
+};
+
+struct brick_bounds
+{
+    brick_bounds()
+        : type(brick_class::mixed), escape_iter(-1), num_steps(0)
+    {}
+
+    brick_class type;
+    //for an exterior brick: the iteration (as mandel_point counts them) that every voxel escapes at,
+    //or -1 if they don't all escape at the same one
+    int escape_iter;
+    //the interval iterations it took
+    int num_steps;
+};
+
+/* Proves what the iterations of every point in an axis-aligned box do, without evaluating any of them.
+ * The triplex power map keeps the magnitude exact, |p^n| = |p|^n (as does the quaternion one), so
+ * rather than the components it's the interval [L, U] of |p| that gets iterated: with |c| in
+ * [Cmin, Cmax] over the box, |p^n + c| is within
+ *
+ *     L' = max(0, L^n - Cmax, Cmin - U^n)     and     U' = U^n + Cmax
+ *
+ * whatever the angles. Once L > 2, every point has escaped; U staying <= 2 for all the iterations means
+ * none of them do. As U' only grows with U, a step where U doesn't grow means it never will, so an
+ * interior proof doesn't have to go through all of the iterations either.
+ *
+ * Every step is widened by rounding_margin (relative to |p^n| + |c|) to cover what mandel_point's
+ * float evaluation can be off by (mostly the angles, which are up to 8 pi), so the classification holds
+ * for the voxels as the generator computes them, not just for the exact orbits.
+ */
+inline brick_bounds classify_brick(const float box_min[3], const float box_max[3], const int order, const int max_iter, const double escape_val = 2.0)
+{
+    const double rounding_margin = 1e-4;
+
+    double c_min_sq = 0, c_max_sq = 0;
+    for (int axis_idx = 0; axis_idx < 3; ++axis_idx)
+    {
+        const double lower = std::min(box_min[axis_idx], box_max[axis_idx]);
+        const double upper = std::max(box_min[axis_idx], box_max[axis_idx]);
+        const double nearest = (lower <= 0 && upper >= 0) ? 0 : std::min(std::abs(lower), std::abs(upper));
+        const double farthest = std::max(std::abs(lower), std::abs(upper));
+        c_min_sq += nearest * nearest;
+        c_max_sq += farthest * farthest;
+    }
+    const double c_min = std::sqrt(c_min_sq);
+    const double c_max = std::sqrt(c_max_sq);
+    const double escape_lower = escape_val * (1 + rounding_margin);
+    const double escape_upper = escape_val * (1 - rounding_margin);
+
+    brick_bounds bounds;
+    //the first iteration takes p from 0 to c
+    double lower_mag = c_min * (1 - rounding_margin);
+    double upper_mag = c_max * (1 + rounding_margin);
+    bool bounded_so_far = true;
+    for (int iter_num = 0; iter_num < max_iter; ++iter_num)
+    {
+        bounds.num_steps = iter_num + 1;
+        if(lower_mag > escape_lower)
+        {
+            bounds.type = brick_class::exterior;
+            bounds.escape_iter = bounded_so_far ? iter_num : -1;
+            return bounds;
+        }
+        if(upper_mag > escape_upper)
+        {
+            bounded_so_far = false;
+            //the lower bound is stuck at 0 from here on
+            if(lower_mag <= 0) {
+                return bounds;
+            }
+        }
+
+        const double lower_pow = std::pow(lower_mag, order);
+        const double upper_pow = std::pow(upper_mag, order);
+        const double next_lower = std::max(0.0, std::max(lower_pow * (1 - rounding_margin) - c_max * (1 + rounding_margin),
+                                                         c_min * (1 - rounding_margin) - upper_pow * (1 + rounding_margin)));
+        const double next_upper = (upper_pow + c_max) * (1 + rounding_margin);
+        if(bounded_so_far && next_upper <= upper_mag)
+        {
+            bounds.type = brick_class::interior;
+            return bounds;
+        }
+        lower_mag = next_lower;
+        upper_mag = next_upper;
+    }
+
+    //(the bounds are one iteration past the last one mandel_point checks by now)
+    if(bounded_so_far) {
+        bounds.type = brick_class::interior;
+    }
+    return bounds;
+}
+
+//what the bricks of a run came out as
+struct brick_tally
+{
+    brick_tally()
+        : num_interior(0), num_exterior(0), num_mixed(0), num_steps(0), voxels_skipped(0), voxels_evaluated(0)
+    {}
+
+    inline void add_brick(const brick_bounds& bounds)
+    {
+        num_interior += (bounds.type == brick_class::interior) ? 1 : 0;
+        num_exterior += (bounds.type == brick_class::exterior) ? 1 : 0;
+        num_mixed += (bounds.type == brick_class::mixed) ? 1 : 0;
+        num_steps += bounds.num_steps;
+    }
+
+    void merge(const brick_tally& other)
+    {
+        num_interior += other.num_interior;
+        num_exterior += other.num_exterior;
+        num_mixed += other.num_mixed;
+        num_steps += other.num_steps;
+        voxels_skipped += other.voxels_skipped;
+        voxels_evaluated += other.voxels_evaluated;
+    }
+
+    void print_tally() const
+    {
+        const uint64_t num_bricks = num_interior + num_exterior + num_mixed;
+        const uint64_t num_voxels = voxels_skipped + voxels_evaluated;
+        std::cout << "Bricks: " << num_interior << " interior, " << num_exterior << " exterior, " << num_mixed << " mixed ("
+                  << ((num_bricks > 0) ? static_cast<double>(num_steps) / num_bricks : 0) << " interval steps each) -- evaluated "
+                  << voxels_evaluated << " of " << num_voxels << " voxels (" << ((num_voxels > 0) ? 100.0 * voxels_evaluated / num_voxels : 0) << "%)" << std::endl;
+    }
+
+    //the brick layers get classified afresh by each run of slices, so these can count a layer more than once
+    uint64_t num_interior;
+    uint64_t num_exterior;
+    uint64_t num_mixed;
+    uint64_t num_steps;
+    uint64_t voxels_skipped;
+    uint64_t voxels_evaluated;
+};
+
+} //namespace cpu_fractals
+
+#endif
@@ -30,14 +30,24 @@ public:
   virtual ~cudaFractals()
   {}
 
-  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params)
+  static std::string backend_name()
+  {
+    return "cuda";
+  }
+
+  //the precision the fractal is iterated at
+  static std::string precision_name()
+  {
+    return "float";
+  }
+
+  //NOTE: no statistics from the CUDA kernel yet, run_stats is left as is
+  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params, fractal_stats* run_stats = nullptr)
   {
     //NOTE: need to dynamically allocate, as the memory requirements become prohibitive very fast (e.g. 512 x 512 x 512 of ints --> 4*2^27 bytes)
 
-    std::cout << "Making fractal... " << std::endl;
     run_cuda_fractal<data_t>(h_image_stack, fractalgen_params);
 		//cpu_fractals::run_cpu_fractal<data_t>(h_image_stack, fractalgen_params);
-    std::cout << "Making Point Cloud... " << std::endl;
 
 //		auto fracstack_sum = std::accumulate(h_image_stack.begin(), h_image_stack.end(), 0);
 //	std::cout << "NOTE: stack sum is " << fracstack_sum << std::endl;
@@ -29,6 +29,7 @@
 //#include "../cpu_fractal.hpp"
 //#include "util/ocl_helpers.hpp"
 #include "fractal3d.h"
+#include "util/trace.hpp"
 
 namespace fractal_helpers
 {
@@ -83,21 +84,27 @@ inline void cuda_error_check(cudaError_t err_id)
 template <typename data_t>
 void run_cuda_fractal(std::vector<data_t>& h_image_stack, const fractal_params& params)
 {
+  FRACTAL_TRACE_SCOPE("cuda_generate");
   std::cout << "Using CUDA" << std::endl;
 
   const size_t imageslice_sz = params.imheight * params.imwidth * sizeof(data_t);
   data_t* dev_image;
   cudaError_t cu_error_id = cudaMalloc((void**)&dev_image, imageslice_sz);
   cuda_error_check (cu_error_id);
- 
-  auto start = std::chrono::high_resolution_clock::now();
 
   const int2 constants = {static_cast<int>(params.MAX_ITER), params.ORDER};
   const int4 dimensions = {params.imheight, params.imwidth, params.imdepth, 0};
   const float4 flt_constants = {params.MIN_LIMIT, params.MAX_LIMIT, params.BOUNDARY_VAL, 0.0f};
 
-  for (int depth_idx = 0; depth_idx < params.imdepth; ++depth_idx)
+  for (int depth_idx = params.cancel_token.get_resume_slice(); depth_idx < params.imdepth; ++depth_idx)
   {
+    //stop launching slices if the request was cancelled, superseded or pre-empted (still need to clean up below)
+    if(params.cancel_token.should_stop()) {
+      params.cancel_token.stop_at(depth_idx);
+      break;
+    }
+    FRACTAL_TRACE_SCOPE_ARG("cuda_slice", depth_idx);
+
     cu_error_id = cudaMemset(dev_image, 0, imageslice_sz);
     cuda_error_check (cu_error_id);
 
@@ -115,6 +122,7 @@ void run_cuda_fractal(std::vector<data_t>& h_image_stack, const fractal_params&
     auto host_slice_image = &h_image_stack[h_image_stack_offset];
     cu_error_id = cudaMemcpy(host_slice_image, dev_image, imageslice_sz, cudaMemcpyDeviceToHost); 
     cuda_error_check (cu_error_id);
+    params.cancel_token.report_slices(depth_idx, depth_idx + 1, host_slice_image);
   
     bool verbose_run = false;
     if(verbose_run)
@@ -146,10 +154,6 @@ void run_cuda_fractal(std::vector<data_t>& h_image_stack, const fractal_params&
         std::cout << "ERROR @ PROGRAM BUILD -- " << ocl_error_num << std::endl;
 */
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration<double, std::milli>(end - start);
-    std::cout << "Fractal Generation Time: " << duration.count() << " ms" << std::endl;
-
 }
 
 #endif
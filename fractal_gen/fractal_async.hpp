@@ -0,0 +1,332 @@
+/* fractal_async.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+
+#ifndef FRACTAL_GEN_FRACTALASYNC_HPP
+#define FRACTAL_GEN_FRACTALASYNC_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/fractal_helpers.hpp"
+#include "util/trace.hpp"
+#include "fractal_gen/fractal_generator.hpp"
+
+enum class fractal_request_status
+{
+  queued,
+  running,
+  done,
+  cancelled,
+  //the generation threw, or the backend couldn't generate it (fractal_data::failed); either way
+  //fractal_future::get throws
+  failed
+};
+
+//what the pool and the handles of one request share
+template <typename point_t, typename pixel_t>
+struct async_request_state
+{
+  async_request_state()
+    : request_id(0), status(static_cast<int>(fractal_request_status::queued))
+  {}
+
+  //once the result is set it decides the status, so a handle that got() the result never still sees
+  //the request as running
+  fractal_request_status get_status() const
+  {
+    if(result.valid() && result.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready)
+    {
+      try {
+        return result.get().cancelled ? fractal_request_status::cancelled : fractal_request_status::done;
+      }
+      catch(...) {
+        return fractal_request_status::failed;
+      }
+    }
+    return static_cast<fractal_request_status>(status.load());
+  }
+
+  inline void set_status(const fractal_request_status new_status)
+  {
+    status.store(static_cast<int>(new_status));
+  }
+
+  //resolves the request as cancelled, without anything generated. The status only changes once the
+  //result is set, so a handle that sees a finished status never blocks in get()
+  void resolve_cancelled()
+  {
+    fractal_data<point_t, pixel_t> fdata;
+    fdata.params = params;
+    fdata.request_id = request_id;
+    fdata.cancelled = true;
+    result_promise.set_value(fdata);
+    set_status(fractal_request_status::cancelled);
+  }
+
+  fractal_params params;
+  uint64_t request_id;
+  std::atomic<int> status;
+  std::promise<fractal_data<point_t, pixel_t>> result_promise;
+  std::shared_future<fractal_data<point_t, pixel_t>> result;
+};
+
+/* The handle of a request submitted to an async_fractal_generator. Copies all refer to the same
+ * request, and can be used from any thread.
+ */
+template <typename point_t, typename pixel_t>
+class fractal_future
+{
+public:
+  fractal_future()
+  {}
+
+  explicit fractal_future(std::shared_ptr<async_request_state<point_t, pixel_t>> state)
+    : request_state(std::move(state))
+  {}
+
+  inline bool valid() const
+  {
+    return static_cast<bool>(request_state);
+  }
+
+  inline uint64_t get_request_id() const
+  {
+    return request_state->request_id;
+  }
+
+  inline fractal_request_status get_status() const
+  {
+    return request_state->get_status();
+  }
+
+  //the slices generated so far (see generation_token::report_slices)
+  inline int get_slices_done() const
+  {
+    return request_state->params.cancel_token.get_slices_done();
+  }
+
+  //0 --> 1 over the slices of the stack; only gets to 1 once the whole request (points and all) is done
+  float get_progress() const
+  {
+    if(get_status() == fractal_request_status::done) {
+      return 1.0f;
+    }
+    const int num_slices = std::max(1, request_state->params.imdepth);
+    return std::min(0.99f, static_cast<float>(get_slices_done()) / num_slices);
+  }
+
+  //a queued request never starts, a running one stops at the next slice. Either way it finishes as
+  //fractal_request_status::cancelled, with fractal_data::cancelled set
+  inline void cancel()
+  {
+    request_state->params.cancel_token.cancel();
+  }
+
+  inline void wait() const
+  {
+    request_state->result.wait();
+  }
+
+  //false if the request still isn't finished after the timeout
+  inline bool wait_for(const std::chrono::milliseconds timeout) const
+  {
+    return request_state->result.wait_for(timeout) == std::future_status::ready;
+  }
+
+  //blocks until the request is finished. Rethrows whatever the generation threw
+  inline fractal_data<point_t, pixel_t> get() const
+  {
+    return request_state->result.get();
+  }
+
+private:
+  std::shared_ptr<async_request_state<point_t, pixel_t>> request_state;
+};
+
+/* Runs fractal_generator::make_fractal asynchronously, on a pool of worker threads with a backend
+ * instance each, so several requests can be generated at once. submit() hands back a fractal_future
+ * right away, and the requests start in the order they were submitted as workers free up.
+ *
+ * The optional slice callback of a request gets the slices as they land (on the backend's threads,
+ * see generation_token::slice_callback), so e.g. a slice can be exported or shown before the rest of
+ * the stack is done. The slice pointer is nullptr for backends that make the points without a stack.
+ */
+template <template <class, class> class generator_t, typename point_t, typename pixel_t>
+class async_fractal_generator
+{
+public:
+  typedef fractal_generator<generator_t, point_t, pixel_t> generator_type;
+  typedef fractal_future<point_t, pixel_t> future_type;
+  //the slices [z_begin, z_end) of the stack are done, starting at slices
+  typedef std::function<void(int z_begin, int z_end, const pixel_t* slices)> slice_fn;
+
+  explicit async_fractal_generator(const int num_workers = 1)
+    : is_running(true), next_request_id(1)
+  {
+    for (int worker_idx = 0; worker_idx < std::max(1, num_workers); ++worker_idx) {
+      fractal_generators.emplace_back(new generator_type());
+    }
+    for (size_t worker_idx = 0; worker_idx < fractal_generators.size(); ++worker_idx) {
+      worker_threads.emplace_back(&async_fractal_generator::worker_loop, this, worker_idx);
+    }
+  }
+
+  //cancels everything that isn't finished yet, and waits for the workers
+  ~async_fractal_generator()
+  {
+    {
+      std::lock_guard<std::mutex> queue_lock (queue_mutex);
+      is_running = false;
+      for (auto& pending_request : pending_requests) {
+        pending_request->params.cancel_token.cancel();
+      }
+      for (auto& active_request : active_requests) {
+        active_request->params.cancel_token.cancel();
+      }
+    }
+    queue_cv.notify_all();
+    for (auto& worker_thread : worker_threads) {
+      worker_thread.join();
+    }
+    for (auto& pending_request : pending_requests) {
+      pending_request->resolve_cancelled();
+    }
+  }
+
+  inline size_t num_workers() const
+  {
+    return fractal_generators.size();
+  }
+
+  //for the backend-specific settings. NOTE: the workers use their backends without any locking, so
+  //only change the settings while there's nothing submitted
+  inline generator_t<point_t, pixel_t>& get_backend(const size_t worker_idx)
+  {
+    return fractal_generators[worker_idx]->get_backend();
+  }
+
+  future_type submit(const fractal_params& params, slice_fn on_slices = slice_fn())
+  {
+    auto request_state = std::make_shared<async_request_state<point_t, pixel_t>>();
+    request_state->params = params;
+    request_state->params.cancel_token = generation_token::make_token();
+    if(on_slices)
+    {
+      request_state->params.cancel_token.set_slice_callback([on_slices](const int z_begin, const int z_end, const void* slice_data)
+        {
+          on_slices(z_begin, z_end, static_cast<const pixel_t*>(slice_data));
+        });
+    }
+    request_state->result = request_state->result_promise.get_future().share();
+
+    {
+      std::lock_guard<std::mutex> queue_lock (queue_mutex);
+      request_state->request_id = next_request_id++;
+      if(!is_running) {
+        request_state->resolve_cancelled();
+        return future_type(request_state);
+      }
+      pending_requests.push_back(request_state);
+    }
+    queue_cv.notify_one();
+    return future_type(request_state);
+  }
+
+  //the requests that haven't started yet
+  size_t num_pending() const
+  {
+    std::lock_guard<std::mutex> queue_lock (queue_mutex);
+    return pending_requests.size();
+  }
+
+private:
+  typedef std::shared_ptr<async_request_state<point_t, pixel_t>> request_ptr;
+
+  void worker_loop(const size_t worker_idx)
+  {
+    FRACTAL_TRACE_THREAD_NAME("async_worker_" + std::to_string(worker_idx));
+    while(true)
+    {
+      request_ptr request_state;
+      {
+        std::unique_lock<std::mutex> queue_lock (queue_mutex);
+        queue_cv.wait(queue_lock, [this]() { return !is_running || !pending_requests.empty(); });
+        if(!is_running) {
+          return;
+        }
+        request_state = pending_requests.front();
+        pending_requests.pop_front();
+        active_requests.push_back(request_state);
+      }
+
+      run_request(worker_idx, *request_state);
+
+      std::lock_guard<std::mutex> queue_lock (queue_mutex);
+      active_requests.erase(std::find(active_requests.begin(), active_requests.end(), request_state));
+    }
+  }
+
+  void run_request(const size_t worker_idx, async_request_state<point_t, pixel_t>& request_state)
+  {
+    if(request_state.params.cancel_token.is_cancelled())
+    {
+      request_state.resolve_cancelled();
+      return;
+    }
+
+    FRACTAL_TRACE_SCOPE_ARG("async_request", request_state.request_id);
+    request_state.set_status(fractal_request_status::running);
+    try
+    {
+      auto fractalgen_params = request_state.params;
+      auto fdata = fractal_generators[worker_idx]->make_fractal(std::move(fractalgen_params));
+      fdata.request_id = request_state.request_id;
+      if(fdata.failed) {
+        throw std::runtime_error("the " + fractal_generators[worker_idx]->backend_id() + " backend couldn't generate the request");
+      }
+      const bool was_cancelled = fdata.cancelled;
+      request_state.result_promise.set_value(std::move(fdata));
+      request_state.set_status(was_cancelled ? fractal_request_status::cancelled : fractal_request_status::done);
+    }
+    catch(...)
+    {
+      std::cout << "ERROR @ ASYNC REQUEST -- request " << request_state.request_id << " failed" << std::endl;
+      request_state.result_promise.set_exception(std::current_exception());
+      request_state.set_status(fractal_request_status::failed);
+    }
+  }
+
+  //one per worker
+  std::vector<std::unique_ptr<generator_type>> fractal_generators;
+  std::vector<std::thread> worker_threads;
+
+  mutable std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::deque<request_ptr> pending_requests;
+  //so the destructor can stop them
+  std::vector<request_ptr> active_requests;
+  bool is_running;
+  uint64_t next_request_id;
+};
+
+#endif
@@ -0,0 +1,327 @@
+/* fractal_cache.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef FRACTAL_GEN_FRACTALCACHE_HPP
+#define FRACTAL_GEN_FRACTALCACHE_HPP
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+#include "util/fractal_helpers.hpp"
+#include "util/vertex_packing.hpp"
+
+namespace fractal_cache_helpers
+{
+
+//64-bit FNV-1a
+struct param_hasher
+{
+    param_hasher()
+      : hash_val(14695981039346656037ULL)
+    {}
+
+    void add_bytes(const void* data, const size_t num_bytes)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < num_bytes; ++i)
+        {
+            hash_val ^= bytes[i];
+            hash_val *= 1099511628211ULL;
+        }
+    }
+
+    template <typename T>
+    void add(const T& val)
+    {
+        add_bytes(&val, sizeof(T));
+    }
+
+    void add(const std::string& val)
+    {
+        //include the length so that adjacent strings can't alias each other
+        add(val.size());
+        add_bytes(val.data(), val.size());
+    }
+
+    uint64_t hash_val;
+};
+
+//the key has to cover everything that changes the generated output, including which backend (and
+//at what precision) made it, since the backends don't produce bit-identical stacks
+inline uint64_t hash_params(const fractal_params& params, const std::string& backend_id)
+{
+    param_hasher hasher;
+    hasher.add(backend_id);
+    hasher.add(params.imheight);
+    hasher.add(params.imwidth);
+    hasher.add(params.imdepth);
+    //NOTE: copies, so the static constexpr members aren't odr-used
+    const size_t max_iter = fractal_params::MAX_ITER;
+    const int order = fractal_params::ORDER;
+    hasher.add(max_iter);
+    hasher.add(order);
+    hasher.add(params.MIN_LIMIT);
+    hasher.add(params.MAX_LIMIT);
+    hasher.add(params.BOUNDARY_VAL);
+    hasher.add(params.fractal_name);
+    return hasher.hash_val;
+}
+
+inline std::string key_to_string(const uint64_t key)
+{
+    std::stringstream key_ss;
+    key_ss << std::hex << std::setw(16) << std::setfill('0') << key;
+    return key_ss.str();
+}
+
+} //namespace fractal_cache_helpers
+
+
+/* Content-addressed cache of finished fractals, keyed by fractal_cache_helpers::hash_params.
+ * The in-memory tier holds the point cloud and packed vertices by shared_ptr (so every hit hands
+ * out the same copy) and evicts least-recently-used entries over the byte budget. If a cache
+ * directory is given, the point clouds are also written to disk, and memory misses fall back to it.
+ */
+template <typename point_t, typename pixel_t>
+class fractal_cache
+{
+public:
+    typedef fractal_data<point_t, pixel_t> fractal_data_t;
+    typedef fractal_types::pointcloud<point_t, pixel_t> pointcloud_t;
+
+    explicit fractal_cache(const size_t memory_budget, const std::string& cache_dir = "")
+      : memory_budget(memory_budget), cache_dir(cache_dir), current_usage(0), num_hits(0), num_misses(0)
+    {}
+
+    //fills in the cloud + vertices (+ stats) of fdata if the key is cached. fdata.params has to be set
+    //already, as it's needed to re-pack the vertices of clouds that come from disk. A request for
+    //statistics only hits entries that have them, which rules out the disk tier
+    bool lookup(const uint64_t key, fractal_data_t& fdata)
+    {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            if(find_entry(key, fdata)) {
+                return true;
+            }
+            if(fdata.params.collect_stats)
+            {
+                ++num_misses;
+                return false;
+            }
+        }
+
+        //NOTE: the disk read and the packing happen without the lock, so the other workers don't wait on them
+        auto disk_cloud = load_from_disk(key);
+        std::shared_ptr<fractal_types::vertex_data> vertices;
+        if(disk_cloud)
+        {
+            vertices = std::make_shared<fractal_types::vertex_data>();
+            vertex_packing::pack_vertices(*disk_cloud, fdata.params, *vertices);
+        }
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if(!disk_cloud)
+        {
+            ++num_misses;
+            return false;
+        }
+        //someone else might have put it in meanwhile; then theirs is the copy everyone shares
+        if(find_entry(key, fdata)) {
+            return true;
+        }
+        fdata.point_cloud = disk_cloud;
+        fdata.vertices = vertices;
+        insert_entry(key, fdata);
+        ++num_hits;
+        return true;
+    }
+
+    void insert(const uint64_t key, const fractal_data_t& fdata)
+    {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto entry_it = cache_lookup.find(key);
+            if(entry_it != cache_lookup.end())
+            {
+                //a re-run for the statistics
+                if(!entry_it->second->stats) {
+                    entry_it->second->stats = fdata.stats;
+                }
+                return;
+            }
+            insert_entry(key, fdata);
+        }
+        save_to_disk(key, *fdata.point_cloud);
+    }
+
+    void print_stats() const
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        const double MiB = 1024.0 * 1024.0;
+        std::cout << "Fractal Cache: " << num_hits << " hits, " << num_misses << " misses -- "
+                  << cache_entries.size() << " entries, " << current_usage / MiB << " MiB" << std::endl;
+    }
+
+private:
+    struct cache_entry
+    {
+        uint64_t key;
+        std::shared_ptr<const pointcloud_t> point_cloud;
+        std::shared_ptr<const fractal_types::vertex_data> vertices;
+        std::shared_ptr<const fractal_stats> stats;
+        size_t num_bytes;
+    };
+    typedef std::list<cache_entry> CacheListType;
+
+    //NOTE: needs the lock. Counts as a hit if it's there
+    bool find_entry(const uint64_t key, fractal_data_t& fdata)
+    {
+        auto entry_it = cache_lookup.find(key);
+        if(entry_it == cache_lookup.end() || (!entry_it->second->stats && fdata.params.collect_stats)) {
+            return false;
+        }
+        cache_entries.splice(cache_entries.begin(), cache_entries, entry_it->second);
+        fdata.point_cloud = entry_it->second->point_cloud;
+        fdata.vertices = entry_it->second->vertices;
+        fdata.stats = entry_it->second->stats;
+        ++num_hits;
+        return true;
+    }
+
+    void insert_entry(const uint64_t key, const fractal_data_t& fdata)
+    {
+        const size_t num_bytes = fdata.point_cloud->cloud.size() * sizeof(typename pointcloud_t::cloud_point_t) +
+                                 fdata.vertices->vertices.size() * sizeof(fractal_types::packed_vertex);
+        cache_entries.push_front(cache_entry{key, fdata.point_cloud, fdata.vertices, fdata.stats, num_bytes});
+        cache_lookup[key] = cache_entries.begin();
+        current_usage += num_bytes;
+
+        //NOTE: evicting only drops the cache's reference, anyone still holding the data keeps it alive
+        while(current_usage > memory_budget && cache_entries.size() > 1)
+        {
+            current_usage -= cache_entries.back().num_bytes;
+            cache_lookup.erase(cache_entries.back().key);
+            cache_entries.pop_back();
+        }
+    }
+
+    inline std::string get_cache_fname(const uint64_t key) const
+    {
+        return cache_dir + "/" + fractal_cache_helpers::key_to_string(key) + ".fcache";
+    }
+
+    //on-disk format: [magic | key | point size | #points | points...]
+    void save_to_disk(const uint64_t key, const pointcloud_t& pt_cloud) const
+    {
+        if(cache_dir.empty()) {
+            return;
+        }
+
+        //written under a name of its own and then renamed, so a lookup never reads a half-written file
+        const std::string cache_fname = get_cache_fname(key);
+        std::stringstream temp_fname;
+        temp_fname << cache_fname << "." << std::this_thread::get_id() << ".tmp";
+        std::ofstream cache_file(temp_fname.str(), std::ios::binary);
+        if(!cache_file) {
+            std::cout << "WARNING: couldn't write the fractal cache file " << cache_fname << std::endl;
+            return;
+        }
+
+        const uint64_t num_points = pt_cloud.cloud.size();
+        const uint32_t point_size = sizeof(typename pointcloud_t::cloud_point_t);
+        cache_file.write(cache_magic, sizeof(cache_magic));
+        cache_file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+        cache_file.write(reinterpret_cast<const char*>(&point_size), sizeof(point_size));
+        cache_file.write(reinterpret_cast<const char*>(&num_points), sizeof(num_points));
+        cache_file.write(reinterpret_cast<const char*>(pt_cloud.cloud.data()), num_points * point_size);
+        cache_file.close();
+        if(!cache_file || std::rename(temp_fname.str().c_str(), cache_fname.c_str()) != 0)
+        {
+            std::cout << "WARNING: couldn't write the fractal cache file " << cache_fname << std::endl;
+            std::remove(temp_fname.str().c_str());
+        }
+    }
+
+    std::shared_ptr<pointcloud_t> load_from_disk(const uint64_t key) const
+    {
+        if(cache_dir.empty()) {
+            return nullptr;
+        }
+
+        std::ifstream cache_file(get_cache_fname(key), std::ios::binary);
+        if(!cache_file) {
+            return nullptr;
+        }
+
+        char file_magic [sizeof(cache_magic)];
+        uint64_t file_key = 0;
+        uint32_t point_size = 0;
+        uint64_t num_points = 0;
+        cache_file.read(file_magic, sizeof(file_magic));
+        cache_file.read(reinterpret_cast<char*>(&file_key), sizeof(file_key));
+        cache_file.read(reinterpret_cast<char*>(&point_size), sizeof(point_size));
+        cache_file.read(reinterpret_cast<char*>(&num_points), sizeof(num_points));
+        if(!cache_file || std::memcmp(file_magic, cache_magic, sizeof(cache_magic)) != 0 || file_key != key ||
+            point_size != sizeof(typename pointcloud_t::cloud_point_t))
+        {
+            std::cout << "WARNING: ignoring stale fractal cache file " << get_cache_fname(key) << std::endl;
+            return nullptr;
+        }
+
+        //the point count comes from the file, so it has to agree with what's actually in there before
+        //anything gets allocated for it
+        const std::streamoff header_end = cache_file.tellg();
+        cache_file.seekg(0, std::ios::end);
+        const std::streamoff file_end = cache_file.tellg();
+        cache_file.seekg(header_end);
+        if(!cache_file || header_end < 0 || file_end < header_end || num_points != static_cast<uint64_t>(file_end - header_end) / point_size ||
+            (file_end - header_end) % point_size != 0)
+        {
+            std::cout << "WARNING: ignoring truncated fractal cache file " << get_cache_fname(key) << std::endl;
+            return nullptr;
+        }
+
+        auto pt_cloud = std::make_shared<pointcloud_t>();
+        pt_cloud->cloud.resize(num_points);
+        cache_file.read(reinterpret_cast<char*>(pt_cloud->cloud.data()), num_points * point_size);
+        if(!cache_file) {
+            return nullptr;
+        }
+        return pt_cloud;
+    }
+
+    static constexpr char cache_magic [4] = {'F', 'R', 'C', '1'};
+
+    const size_t memory_budget;
+    const std::string cache_dir;
+
+    mutable std::mutex cache_mutex;
+    CacheListType cache_entries;
+    std::unordered_map<uint64_t, typename CacheListType::iterator> cache_lookup;
+    size_t current_usage;
+
+    size_t num_hits;
+    size_t num_misses;
+};
+
+template <typename point_t, typename pixel_t>
+constexpr char fractal_cache<point_t, pixel_t>::cache_magic [4];
+
+#endif
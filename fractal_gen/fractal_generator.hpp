@@ -12,18 +12,15 @@
 #define FRACTAL_GEN_FRACTALGENERATOR_HPP
 
 #include "util/fractal_helpers.hpp"
+#include "util/vertex_packing.hpp"
+#include "util/trace.hpp"
 
 //used for comparison/ground truth purposes
 #include "cpu_fractals/fractalgen3d.hpp"
-#include <chrono>
 
 template <template <class, class> class ptcloud_t, typename pt_t, typename pixel_t, int debug_run=0>
 void make_pointcloud(const std::vector<pixel_t>& h_image_stack, const fractal_params& params, ptcloud_t<pt_t, pixel_t>& pt_cloud)
 {
-    auto start = std::chrono::high_resolution_clock::now();
-
-	std::cout << "Making pointcloud..." <<std::endl;
-
 	using cpu_data_t = float;
     cpu_fractals::FractalLimits<cpu_data_t> limits(cpu_fractals::PixelPoint<cpu_data_t>(params.imheight, params.imwidth, params.imdepth));
 
@@ -68,9 +65,6 @@ void make_pointcloud(const std::vector<pixel_t>& h_image_stack, const fractal_pa
      
         if(debug_run)
         {
-            auto px_sum = cv::sum(cv::sum(ocl_slice)) / 255;
-            std::cout << "Image " << k << " Generated... has " << ((px_sum[0] > 0) ? std::to_string(px_sum[0]):"NO") << " non-zero elements" << std::endl;
-
 			auto diff_extrema = std::minmax_element(slice_diff.begin(), slice_diff.end());
             auto min_diff = *diff_extrema.first;
             auto max_diff = *diff_extrema.second;
@@ -92,10 +86,6 @@ void make_pointcloud(const std::vector<pixel_t>& h_image_stack, const fractal_pa
             cv::imwrite(ocl_slice_name, ocl_slice);
         }        
     }
-
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration<double, std::milli>(end - start);
-    std::cout << "Fractal Comparison Time: " << duration.count() << " ms" << std::endl;   
 }
 
 
@@ -103,33 +93,202 @@ template <template <class, class> class generator_t, typename point_t, typename
 class fractal_generator
 {
 public:
+    typedef point_t point_type;
+    typedef pixel_t pixel_type;
+
     fractal_generator()
       : fgenerator()
     {}
 
-    inline fractal_data<point_t, pixel_t> make_fractal(fractal_params&& fractalgen_params)
+    //identifies the backend and its output precision, for keying cached results
+    std::string backend_id() const
     {
-        std::vector<pixel_t> h_image_stack (fractalgen_params.imheight * fractalgen_params.imwidth * fractalgen_params.imdepth);
-        std::fill(h_image_stack.begin(), h_image_stack.end(), 0);
+        return fgenerator.backend_name() + "_" + fgenerator.precision_name() + "_px" + std::to_string(sizeof(pixel_t));
+    }
+
+    //for the backend-specific settings
+    inline generator_t<point_t, pixel_t>& get_backend()
+    {
+        return fgenerator;
+    }
 
-        fgenerator.make_fractal(h_image_stack, fractalgen_params);
-  
+    //the whole thing in one go: generation, extraction and vertex preparation
+    inline fractal_data<point_t, pixel_t> make_fractal(fractal_params&& fractalgen_params)
+    {
         fractal_data<point_t, pixel_t> fdata;
         fdata.params = fractalgen_params;
-//-----------------------------------------------------------------------------------------------------------------------    
-        make_pointcloud<fractal_types::pointcloud, point_t, pixel_t> (h_image_stack, fractalgen_params, fdata.point_cloud);
 
-        long int ptsum = 0;
-        std::for_each(fdata.point_cloud.cloud.begin(), fdata.point_cloud.cloud.end(), 
-            [&ptsum](const fractal_types::fractal_point<point_t, pixel_t>& fpt)
-            {
-                ptsum += fpt.value;
-            });
-		std::cout << "NOTE: stack sum @fractal_generator is " << ptsum << std::endl;
+        auto point_cloud = generate_points(fractalgen_params, fdata.stats);
+        if(!point_cloud) {
+            fdata.cancelled = fractalgen_params.cancel_token.is_cancelled();
+            fdata.failed = !fdata.cancelled && fractalgen_params.cancel_token.has_failed();
+            fdata.preempted = !fdata.cancelled && !fdata.failed;
+            return fdata;
+        }
+
+        //do the vertex preparation here (i.e. on the generation thread) so the frontend only has to upload it
+        auto vertices = std::make_shared<fractal_types::vertex_data>();
+        vertex_packing::pack_vertices(*point_cloud, fractalgen_params, *vertices);
+
+        fdata.point_cloud = point_cloud;
+        fdata.vertices = vertices;
         return fdata; 
     }
 
+    //runs the backend over the whole stack. Returns nullptr if the request was cancelled or failed (the
+    //stack is only partially filled) or pre-empted (the stack is kept with the request's token). A
+    //request without a token gets one, so that a failure can still be told apart from a finished stack
+    inline std::shared_ptr<std::vector<pixel_t>> generate_stack(fractal_params& fractalgen_params)
+    {
+        std::shared_ptr<const fractal_stats> run_stats;
+        return generate_stack(fractalgen_params, run_stats);
+    }
+
+    //same, and if the request asked for them (fractal_params::collect_stats), run_stats gets the
+    //statistics of the finished stack
+    std::shared_ptr<std::vector<pixel_t>> generate_stack(fractal_params& fractalgen_params, std::shared_ptr<const fractal_stats>& run_stats)
+    {
+        FRACTAL_TRACE_SCOPE("generate_stack");
+        if(!fractalgen_params.cancel_token.has_state()) {
+            fractalgen_params.cancel_token = generation_token::make_token();
+        }
+        auto partial_run = take_partial(fractalgen_params);
+        if(!partial_run->image_stack) {
+            partial_run->image_stack = std::make_shared<std::vector<pixel_t>>(fractalgen_params.imheight * fractalgen_params.imwidth * fractalgen_params.imdepth, 0);
+        }
+
+        fgenerator.make_fractal(*partial_run->image_stack, fractalgen_params, partial_run->stats.get());
+        return finish_partial(fractalgen_params, partial_run, run_stats) ? partial_run->image_stack : nullptr;
+    }
+
+    //whether the backend pulls the points out of the fractal itself (e.g. on the device), so that the
+    //stack never has to be put together on the host
+    inline bool makes_points() const
+    {
+        return backend_makes_points(fgenerator, 0);
+    }
+
+    //generation + extraction, by whichever way the backend does it best. Returns nullptr under the same
+    //conditions as generate_stack
+    std::shared_ptr<fractal_types::pointcloud<point_t, pixel_t>> generate_points(fractal_params& fractalgen_params, std::shared_ptr<const fractal_stats>& run_stats)
+    {
+        if(!makes_points())
+        {
+            auto h_image_stack = generate_stack(fractalgen_params, run_stats);
+            return h_image_stack ? extract_points(*h_image_stack, fractalgen_params) : nullptr;
+        }
+
+        FRACTAL_TRACE_SCOPE("generate_points");
+        if(!fractalgen_params.cancel_token.has_state()) {
+            fractalgen_params.cancel_token = generation_token::make_token();
+        }
+        auto partial_run = take_partial(fractalgen_params);
+        if(!partial_run->point_cloud) {
+            partial_run->point_cloud = std::make_shared<fractal_types::pointcloud<point_t, pixel_t>>();
+        }
+
+        backend_make_points(fgenerator, *partial_run->point_cloud, fractalgen_params, partial_run->stats.get(), 0);
+        return finish_partial(fractalgen_params, partial_run, run_stats) ? partial_run->point_cloud : nullptr;
+    }
+
+    //cross-section mode: just the plane's grid of points (see slice_plane) rather than the whole stack,
+    //as a plane.height x plane.width image of iteration counts. Returns nullptr if the backend can't
+    //slice (or the slice failed)
+    std::shared_ptr<std::vector<pixel_t>> generate_slice(const fractal_params& fractalgen_params, const slice_plane& plane)
+    {
+        FRACTAL_TRACE_SCOPE("generate_slice");
+        auto slice_image = std::make_shared<std::vector<pixel_t>>();
+        return backend_make_slice(fgenerator, *slice_image, fractalgen_params, plane, 0) ? slice_image : nullptr;
+    }
+
+    //pulls the points of the fractal out of a finished stack
+    static std::shared_ptr<fractal_types::pointcloud<point_t, pixel_t>> extract_points(const std::vector<pixel_t>& h_image_stack, const fractal_params& fractalgen_params)
+    {
+        FRACTAL_TRACE_SCOPE("extract_points");
+        auto point_cloud = std::make_shared<fractal_types::pointcloud<point_t, pixel_t>>();
+        make_pointcloud<fractal_types::pointcloud, point_t, pixel_t> (h_image_stack, fractalgen_params, *point_cloud);
+        return point_cloud;
+    }
+
 private:
+    //what a pre-empted request leaves with its token: the stack, or the points so far if the backend
+    //makes the points itself
+    struct generation_partial
+    {
+        std::shared_ptr<std::vector<pixel_t>> image_stack;
+        std::shared_ptr<fractal_types::pointcloud<point_t, pixel_t>> point_cloud;
+        std::shared_ptr<fractal_stats> stats;
+    };
+
+    //a pre-empted request picks up where it left off, statistics and all
+    static std::shared_ptr<generation_partial> take_partial(const fractal_params& fractalgen_params)
+    {
+        auto partial_run = fractalgen_params.cancel_token.template take_partial<generation_partial>();
+        if(!partial_run)
+        {
+            partial_run = std::make_shared<generation_partial>();
+            if(fractalgen_params.collect_stats) {
+                partial_run->stats = std::make_shared<fractal_stats>(fractalgen_params.imdepth);
+            }
+        }
+        return partial_run;
+    }
+
+    //false if the run didn't finish; a pre-empted one is kept with the request's token, a cancelled or
+    //failed one is dropped
+    static bool finish_partial(const fractal_params& fractalgen_params, const std::shared_ptr<generation_partial>& partial_run, std::shared_ptr<const fractal_stats>& run_stats)
+    {
+        const auto& gen_token = fractalgen_params.cancel_token;
+        if(gen_token.is_cancelled() || gen_token.has_failed()) {
+            return false;
+        }
+        if(gen_token.stopped_early()) {
+            gen_token.keep_partial(partial_run);
+            return false;
+        }
+
+        run_stats = partial_run->stats;
+        return true;
+    }
+
+    //only the backends with a make_points have a say in it
+    template <typename backend_t>
+    static auto backend_makes_points(const backend_t& backend, int) -> decltype(backend.makes_points())
+    {
+        return backend.makes_points();
+    }
+
+    template <typename backend_t>
+    static bool backend_makes_points(const backend_t&, long)
+    {
+        return false;
+    }
+
+    template <typename backend_t>
+    static auto backend_make_points(backend_t& backend, fractal_types::pointcloud<point_t, pixel_t>& pt_cloud, fractal_params& fractalgen_params, fractal_stats* run_stats, int)
+      -> decltype(backend.make_points(pt_cloud, fractalgen_params, run_stats))
+    {
+        backend.make_points(pt_cloud, fractalgen_params, run_stats);
+    }
+
+    template <typename backend_t>
+    static void backend_make_points(backend_t&, fractal_types::pointcloud<point_t, pixel_t>&, fractal_params&, fractal_stats*, long)
+    {}
+
+    template <typename backend_t>
+    static auto backend_make_slice(backend_t& backend, std::vector<pixel_t>& slice_image, const fractal_params& fractalgen_params, const slice_plane& plane, int)
+      -> decltype(backend.make_slice(slice_image, fractalgen_params, plane))
+    {
+        return backend.make_slice(slice_image, fractalgen_params, plane);
+    }
+
+    template <typename backend_t>
+    static bool backend_make_slice(backend_t& backend, std::vector<pixel_t>&, const fractal_params&, const slice_plane&, long)
+    {
+        std::cout << "ERROR @ SLICE -- the " << backend.backend_name() << " backend can't generate slices" << std::endl;
+        return false;
+    }
+
     generator_t<point_t, pixel_t> fgenerator;
 };
 
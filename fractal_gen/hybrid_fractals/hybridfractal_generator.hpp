@@ -0,0 +1,400 @@
+/* hybridfractal_generator.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+
+#ifndef FRACTAL_3D_FRACTAL_GEN_HYBRID_FRACTALS_GENERATOR_HPP
+#define FRACTAL_3D_FRACTAL_GEN_HYBRID_FRACTALS_GENERATOR_HPP
+
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <chrono>
+#include <cmath>
+
+#include <CL/cl.hpp>
+
+#include "util/fractal_helpers.hpp"
+#include "util/cost_model.hpp"
+#include "util/trace.hpp"
+#include "fractal_gen/ocl_fractals/fractalgen3d.hpp"
+#include "fractal_gen/ocl_fractals/ocl_engine.hpp"
+
+namespace hybrid_fractals
+{
+
+//Generates the slices [z_begin, z_end) of the stack on this thread, the same way fractal3d does (same
+//pixels, same statistics), and returns the first slice it didn't generate
+template <typename real_t, typename data_t>
+int run_cpu_slices(std::vector<data_t>& h_image_stack, const fractal_params& params, const int z_begin, const int z_end, fractal_stats* run_stats = nullptr)
+{
+    const bool is_julia = (fractal_helpers::fractal_options::get_ocl_id(params.fractal_name) == "JULIA");
+    const int max_iter = static_cast<int>(params.MAX_ITER);
+    const int order = params.ORDER;
+    const real_t min_limit = params.MIN_LIMIT;
+    const real_t limit_diff = static_cast<real_t>(params.MAX_LIMIT) - min_limit;
+    const real_t boundary_val = params.BOUNDARY_VAL;
+
+    for (int z = z_begin; z < z_end; ++z)
+    {
+        if(params.cancel_token.should_stop()) {
+            return z;
+        }
+        FRACTAL_TRACE_SCOPE_ARG("hybrid_cpu_slice", z);
+        auto slice_start = std::chrono::high_resolution_clock::now();
+
+        data_t* image = &h_image_stack[static_cast<size_t>(params.imheight) * params.imwidth * z];
+        real_t dim_limits [3];
+        dim_limits[2] = min_limit + z * (limit_diff / params.imdepth);
+        for (int y = 0; y < params.imheight; ++y)
+        {
+            dim_limits[0] = min_limit + y * (limit_diff / params.imheight);
+            for (int x = 0; x < params.imwidth; ++x)
+            {
+                dim_limits[1] = min_limit + x * (limit_diff / params.imwidth);
+                const int iter_num = host_kernel_iterations<real_t>(dim_limits, is_julia, order, max_iter, boundary_val);
+                image[y * params.imwidth + x] = static_cast<data_t>(std::max(0, std::min(iter_num, 255) - 1));
+                if(run_stats) {
+                    run_stats->add_voxel(x, y, z, iter_num, iter_num >= max_iter);
+                }
+            }
+        }
+
+        if(run_stats) {
+            run_stats->slice_ms[z] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - slice_start).count();
+        }
+        params.cancel_token.report_slices(z, z + 1, image);
+    }
+    return z_end;
+}
+
+} //namespace hybrid_fractals
+
+/* Generates every request on the OpenCL devices and the host's cores at once. The stack is dealt out
+ * from a shared queue a work unit (a range of slices) at a time: each worker -- one per device, plus
+ * the CPU workers -- comes back for another unit as soon as it's done with its last one, so the faster
+ * workers end up with more of the stack. The units shrink as the stack runs out (each one is half of
+ * the worker's share of what's left), so the slow workers don't hold up the end of the request with a
+ * big unit of their own. What's left, and the workers' throughputs, go by the predicted cost of the
+ * slices from a coarse pre-pass (see make_ocl_cost_map) rather than by the slice count, as the slices
+ * through the middle of the set take many times longer than those near the edge. A worker that hasn't
+ * been measured yet gets a single slice. The throughputs are kept between requests, and how the
+ * predictions held up is in get_cost_report.
+ *
+ * The CPU workers run the kernel's formula (see host_kernel_iterations) at the launch
+ * config's precision, so the stack comes out the same whichever worker did which slice (save for
+ * -cl-fast-relaxed-math, which the host doesn't emulate).
+ *
+ * A device that fails (its range ends short without the request being stopped) hands the rest of its
+ * unit back to the queue and sits out the rest of the request. Only if no worker is left to finish
+ * the stack does the request fail.
+ */
+template <typename point_t, typename data_t>
+class hybridFractals
+{
+public:
+  //num_cpu_workers < 0 --> one per hardware thread not driving a device, or none if one of the
+  //devices is the host's CPU
+  explicit hybridFractals(const ocl_launch_config& config = ocl_launch_config(), const ocl_helpers::ocl_device_selection& selection = ocl_helpers::ocl_device_selection(),
+                          const int num_cpu_workers = -1)
+    : launch_config(config), cpu_workers(num_cpu_workers)
+  {
+    set_devices(selection);
+  }
+
+  virtual ~hybridFractals()
+  {}
+
+  //replaces the devices (and so everything built + measured on them)
+  void set_devices(const ocl_helpers::ocl_device_selection& selection)
+  {
+    fractal_engines.clear();
+    for (const auto& device_info : ocl_helpers::select_devices(ocl_helpers::get_devices(), selection))
+    {
+      std::unique_ptr<ocl_engine> device_engine (new ocl_engine(device_info));
+      if(!device_engine->is_ready()) {
+        continue;
+      }
+      std::cout << "Generating on " << device_info.get_description() << std::endl;
+      fractal_engines.push_back(std::move(device_engine));
+    }
+    reset_workers();
+  }
+
+  inline void set_launch_config(const ocl_launch_config& config)
+  {
+    launch_config = config;
+  }
+
+  //see the constructor
+  inline void set_cpu_workers(const int num_cpu_workers)
+  {
+    cpu_workers = num_cpu_workers;
+    reset_workers();
+  }
+
+  inline size_t num_cpu_workers() const
+  {
+    return worker_throughput.size() - fractal_engines.size();
+  }
+
+  static std::string backend_name()
+  {
+    return "hybrid";
+  }
+
+  //of the last request
+  inline const cost_report& get_cost_report() const
+  {
+    return last_report;
+  }
+
+  //the precision of the kernel variants (see ocl_kernel_variant), which the CPU workers match
+  std::string precision_name() const
+  {
+    return launch_config.get_precision_name();
+  }
+
+  //run_stats is only given if the request asked for statistics
+  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params, fractal_stats* run_stats = nullptr)
+  {
+    const int z_begin = fractalgen_params.cancel_token.get_resume_slice();
+    const int z_end = fractalgen_params.imdepth;
+    const size_t num_workers = worker_throughput.size();
+    if(num_workers == 0)
+    {
+      std::cout << "ERROR @ HYBRID WORKERS -- no devices or CPU workers to generate on" << std::endl;
+      fractalgen_params.cancel_token.fail();
+      return;
+    }
+    //checked here rather than in the worker threads, where an unknown fractal can't be reported
+    fractal_helpers::fractal_options::get_ocl_id(fractalgen_params.fractal_name);
+    auto run_start = std::chrono::high_resolution_clock::now();
+    const cost_map slice_costs = make_ocl_cost_map(fractalgen_params);
+    last_report = cost_report(get_worker_names(), slice_costs.prepass_ms);
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    int next_slice = z_begin;
+    //what's left of the units of devices that failed, for the other workers to pick up
+    std::vector<std::pair<int, int>> returned_units;
+    //while any are, one might still come back, so the idle workers have to wait for them
+    int units_in_flight = 0;
+    std::vector<char> slice_done (fractalgen_params.imdepth, 0);
+    //every unit gets its own statistics (kept with the worker that ran it, so nothing is shared between
+    //the threads), as which of them count isn't known until the request has stopped
+    struct unit_stats
+    {
+      int z_begin;
+      std::unique_ptr<fractal_stats> stats;
+    };
+    std::vector<std::vector<unit_stats>> worker_stats (num_workers);
+
+    auto run_worker = [&](const size_t worker_idx)
+    {
+      while(!fractalgen_params.cancel_token.should_stop())
+      {
+        int unit_begin, unit_end;
+        double unit_cost, predicted_ms;
+        {
+          std::unique_lock<std::mutex> queue_lock (queue_mutex);
+          queue_cv.wait(queue_lock, [&]() 
+            { 
+              return !returned_units.empty() || next_slice < z_end || units_in_flight == 0 || fractalgen_params.cancel_token.should_stop(); 
+            });
+          if(!returned_units.empty())
+          {
+            unit_begin = returned_units.back().first;
+            unit_end = returned_units.back().second;
+            returned_units.pop_back();
+          }
+          else if(next_slice < z_end)
+          {
+            unit_begin = next_slice;
+            unit_end = get_unit_end(worker_idx, slice_costs, unit_begin, z_end);
+            next_slice = unit_end;
+          }
+          else {
+            break;
+          }
+          ++units_in_flight;
+          unit_cost = slice_costs.get_cost(unit_begin, unit_end);
+          predicted_ms = (worker_throughput[worker_idx] > 0) ? unit_cost / worker_throughput[worker_idx] : 0;
+        }
+
+        fractal_stats* unit_run_stats = nullptr;
+        if(run_stats)
+        {
+          worker_stats[worker_idx].push_back(unit_stats{unit_begin, std::unique_ptr<fractal_stats>(new fractal_stats(fractalgen_params.imdepth))});
+          unit_run_stats = worker_stats[worker_idx].back().stats.get();
+        }
+
+        auto unit_start = std::chrono::high_resolution_clock::now();
+        int unit_stop = unit_begin;
+        if(worker_idx < fractal_engines.size()) {
+          unit_stop = run_ocl_fractal<data_t>(*fractal_engines[worker_idx], launch_config, h_image_stack, fractalgen_params, unit_begin, unit_end, unit_run_stats);
+        }
+        else if(launch_config.use_double) {
+          unit_stop = hybrid_fractals::run_cpu_slices<double>(h_image_stack, fractalgen_params, unit_begin, unit_end, unit_run_stats);
+        }
+        else {
+          unit_stop = hybrid_fractals::run_cpu_slices<float>(h_image_stack, fractalgen_params, unit_begin, unit_end, unit_run_stats);
+        }
+        auto unit_finish = std::chrono::high_resolution_clock::now();
+        const double unit_ms = std::chrono::duration<double, std::milli>(unit_finish - unit_start).count();
+
+        std::lock_guard<std::mutex> queue_lock (queue_mutex);
+        std::fill(slice_done.begin() + unit_begin, slice_done.begin() + unit_stop, 1);
+        --units_in_flight;
+        queue_cv.notify_all();
+        if(unit_stop < unit_end)
+        {
+          //a device that came up short without being told to stop has failed (e.g. its kernels don't build, or
+          //it has no fp64 for --double). It sits out the rest of the request, and the others take over its unit
+          if(!fractalgen_params.cancel_token.should_stop())
+          {
+            std::cout << "ERROR @ HYBRID WORKERS -- " << get_worker_names()[worker_idx] << " failed @depth " << unit_stop << ", retiring it for this request" << std::endl;
+            returned_units.emplace_back(unit_stop, unit_end);
+          }
+          break;
+        }
+        //only whole units say anything about the worker's speed
+        last_report.add_unit(worker_idx, unit_begin, unit_end, unit_cost, predicted_ms, unit_ms, std::chrono::duration<double, std::milli>(unit_finish - run_start).count());
+        if(unit_ms > 0 && unit_cost > 0)
+        {
+          const double cost_per_ms = unit_cost / unit_ms;
+          worker_throughput[worker_idx] = (worker_throughput[worker_idx] > 0) ? 0.5 * (worker_throughput[worker_idx] + cost_per_ms) : cost_per_ms;
+        }
+      }
+    };
+
+    //the first worker runs on this thread. The units don't overlap, so the workers can all write to the stack
+    std::vector<std::thread> worker_threads;
+    for (size_t worker_idx = 1; worker_idx < num_workers; ++worker_idx)
+    {
+      worker_threads.emplace_back([&run_worker, worker_idx, this]()
+        {
+          FRACTAL_TRACE_THREAD_NAME(((worker_idx < fractal_engines.size()) ? "ocl_device_" : "cpu_worker_") + std::to_string(worker_idx));
+          run_worker(worker_idx);
+        });
+    }
+    run_worker(0);
+    for (auto& worker_thread : worker_threads) {
+      worker_thread.join();
+    }
+
+    //the progress of a stopped request has to be a single slice to resume from, so it's the first
+    //unfinished one that counts -- anything the workers did past it gets generated again
+    //(if it wasn't told to stop, every worker that could have generated it failed)
+    const int first_missing = static_cast<int>(std::find(slice_done.begin() + z_begin, slice_done.end(), 0) - slice_done.begin());
+    if(first_missing < z_end)
+    {
+      if(fractalgen_params.cancel_token.should_stop()) {
+        fractalgen_params.cancel_token.stop_at(first_missing);
+      }
+      else 
+      {
+        std::cout << "ERROR @ HYBRID WORKERS -- no worker left to generate slice " << first_missing << " on" << std::endl;
+        fractalgen_params.cancel_token.fail();
+      }
+    }
+
+    //the units past the first unfinished slice are generated again on the resume, so only the ones
+    //before it count towards the statistics. A unit can't straddle it, as one that starts before it
+    //stopped there at the latest
+    for (const auto& unit_list : worker_stats)
+    {
+      for (const auto& unit : unit_list)
+      {
+        if(unit.z_begin < first_missing) {
+          run_stats->merge(*unit.stats);
+        }
+      }
+    }
+    last_report.print_report();
+  }
+
+  //the plane's cross-section of the fractal (see run_ocl_slice) into image, on the first device
+  virtual bool make_slice(std::vector<data_t>& image, const fractal_params& fractalgen_params, const slice_plane& plane)
+  {
+    if(fractal_engines.empty())
+    {
+      std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to generate on" << std::endl;
+      return false;
+    }
+    return run_ocl_slice<data_t>(*fractal_engines.front(), launch_config, image, fractalgen_params, plane);
+  }
+
+private:
+  //one worker per device, and then the CPU workers. Their throughputs start over
+  void reset_workers()
+  {
+    size_t num_cpu = 0;
+    if(cpu_workers >= 0) {
+      num_cpu = cpu_workers;
+    }
+    else
+    {
+      const bool has_cpu_device = std::any_of(fractal_engines.begin(), fractal_engines.end(), [](const std::unique_ptr<ocl_engine>& device_engine)
+        {
+          return device_engine->get_device_info().is_cpu();
+        });
+      const size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+      num_cpu = has_cpu_device ? 0 : ((num_threads > fractal_engines.size()) ? num_threads - fractal_engines.size() : 0);
+    }
+    worker_throughput.assign(fractal_engines.size() + num_cpu, 0);
+  }
+
+  std::vector<std::string> get_worker_names() const
+  {
+    std::vector<std::string> worker_names;
+    for (size_t worker_idx = 0; worker_idx < worker_throughput.size(); ++worker_idx) {
+      worker_names.push_back((worker_idx < fractal_engines.size()) ? fractal_engines[worker_idx]->get_device_info().device_name 
+                                                                   : "CPU worker " + std::to_string(worker_idx - fractal_engines.size()));
+    }
+    return worker_names;
+  }
+
+  //the end of the worker's next unit, with [unit_begin, z_end) left in the queue. Needs the queue lock
+  int get_unit_end(const size_t worker_idx, const cost_map& slice_costs, const int unit_begin, const int z_end) const
+  {
+    if(unit_begin >= z_end) {
+      return z_end;
+    }
+    if(worker_throughput[worker_idx] <= 0) {
+      return unit_begin + 1;
+    }
+    //the workers not measured yet count as the average of the ones that are
+    double measured_throughput = 0;
+    size_t num_measured = 0;
+    for (const double throughput : worker_throughput)
+    {
+      measured_throughput += throughput;
+      num_measured += (throughput > 0) ? 1 : 0;
+    }
+    const double total_throughput = measured_throughput * worker_throughput.size() / num_measured;
+    const double worker_share = worker_throughput[worker_idx] / total_throughput;
+    return std::max(unit_begin + 1, slice_costs.get_range_end(unit_begin, z_end, 0.5 * worker_share * slice_costs.get_cost(unit_begin, z_end)));
+  }
+
+  //set up once, and kept for all the requests this backend instance generates
+  std::vector<std::unique_ptr<ocl_engine>> fractal_engines;
+  //measured predicted cost (see cost_map) per ms of every worker (the devices first); 0 --> not measured yet
+  std::vector<double> worker_throughput;
+  ocl_launch_config launch_config;
+  int cpu_workers;
+  cost_report last_report;
+};
+
+#endif
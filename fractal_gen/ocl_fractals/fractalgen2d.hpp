@@ -1,6 +1,6 @@
-/* fractalgen2d.hpp -- part of the OpenCL fractal3d implementation 
+/* fractalgen2d.hpp -- part of the OpenCL fractal3d implementation
  *
- * Copyright (C) 2015 Alrik Firl 
+ * Copyright (C) 2015 Alrik Firl
  *
  * This software may be modified and distributed under the terms
  * of the MIT license.  See the LICENSE file for details.
@@ -18,150 +18,329 @@
 #include <cstring>
 #include <vector>
 #include <string>
-#include <tuple>
-#include <fstream>
-#include <complex>
-
-#include "ocl_helpers.hpp"
-
-template <typename data_t>
-void run_oclfractal(std::vector<data_t>& h_image_stack, const ocl_helpers::fractal_params& params)
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+
+#include "util/ocl_helpers.hpp"
+#include "util/fractal_helpers.hpp"
+#include "util/deep_zoom.hpp"
+#include "util/trace.hpp"
+#include "ocl_engine.hpp"
+
+//one tile of a 2D preview: a viewport of the complex plane, rendered at width x height. image gets the
+//iteration counts, row-major with the top row at max_imag, in the same convention as the 3D stacks
+//(interior pixels come out at max_iter-1). The viewport is half-open like the stacks' limits: the pixels
+//step (max - min) / width from min_real and down from max_imag, so neither min_imag nor max_real is sampled
+struct preview_tile
 {
-    const std::string target_platform_id {"NVIDIA"};
-    cl_uint ocl_platform;
-    bool platform_present;
-    cl_platform_id ocl_platform_id;
-
-    std::tie(ocl_platform, ocl_platform_id, platform_present) = get_platform_id(target_platform_id);
-
-    if(platform_present)
-        std::cout << target_platform_id << " platform at index " << ocl_platform << std::endl;
-
-    //5 things for every opencl host-side program:
-    //1. cl_device_id
-    //2. cl_command_queue
-    //3. cl_context
-    //4. cl_program
-    //5. cl_kernel
-
-    //get ONE GPU device on the target platform 
-    const int num_gpu = 1;
-    cl_device_id device_id;
-    clGetDeviceIDs(ocl_platform_id, CL_DEVICE_TYPE_GPU, num_gpu, &device_id, nullptr);
+  preview_tile()
+    : min_real(-2.0f), min_imag(-1.2f), max_real(1.0f), max_imag(1.2f), width(0), height(0)
+  {}
+
+  preview_tile(const float min_real, const float min_imag, const float max_real, const float max_imag, const int width, const int height)
+    : min_real(min_real), min_imag(min_imag), max_real(max_real), max_imag(max_imag), width(width), height(height)
+  {}
+
+  inline size_t num_pixels() const
+  {
+    return static_cast<size_t>(std::max(0, width)) * std::max(0, height);
+  }
+
+  float min_real;
+  float min_imag;
+  float max_real;
+  float max_imag;
+  int width;
+  int height;
+
+  std::vector<unsigned char> image;
+};
+
+//splits the viewport into tiles_x x tiles_y tiles of tile_width x tile_height each (e.g. for a big
+//preview that fills in a tile at a time), row by row from the top left. The tiles share their edges, but
+//as they're half-open, no pixel is rendered twice
+inline std::vector<preview_tile> make_preview_grid(const preview_tile& viewport, const int tiles_x, const int tiles_y, const int tile_width, const int tile_height)
+{
+  std::vector<preview_tile> tiles;
+  const float real_step = (viewport.max_real - viewport.min_real) / std::max(1, tiles_x);
+  const float imag_step = (viewport.max_imag - viewport.min_imag) / std::max(1, tiles_y);
+  for (int tile_row = 0; tile_row < tiles_y; ++tile_row)
+  {
+    for (int tile_col = 0; tile_col < tiles_x; ++tile_col)
+    {
+      const float tile_max_imag = viewport.max_imag - tile_row * imag_step;
+      tiles.emplace_back(viewport.min_real + tile_col * real_step, tile_max_imag - imag_step, viewport.min_real + (tile_col + 1) * real_step, tile_max_imag,
+                         tile_width, tile_height);
+    }
+  }
+  return tiles;
+}
 
-    std::cout << "GPU device id: " << device_id << std::endl; 
-    cl_int ocl_error_num;
+/* Renders 2D mandelbrot tiles for thumbnails + previews. It keeps an engine to itself, so the context,
+ * the built kernel and the device buffers are set up once and reused by every render; the buffers only
+ * get reallocated when a batch needs more room than they have.
+ *
+ * The tiles are rendered in batches, one launch + one read-back per batch rather than per tile, as for
+ * thumbnail-sized tiles the per-launch overhead is most of the cost. A launch covers the biggest tile of
+ * its batch, so batches of similar-sized tiles waste the least.
+ *
+ * render_deep_zoom is the same for views past float precision, by perturbation off a reference orbit (see
+ * util/deep_zoom.hpp).
+ */
+class ocl_preview_engine
+{
+public:
+  //on the first device of the selection (by default the fastest GPU)
+  explicit ocl_preview_engine(const ocl_helpers::ocl_device_selection& selection = ocl_helpers::ocl_device_selection())
+    : max_batch_bytes(16 * 1024 * 1024), max_batch_tiles(256)
+  {
+    const auto devices = ocl_helpers::select_devices(ocl_helpers::get_devices(), selection);
+    if(!devices.empty()) {
+      preview_engine.reset(new ocl_engine(devices.front()));
+    }
+    else {
+      std::cout << "ERROR @ OCL DEVICES -- no OpenCL device matches the selection" << std::endl;
+    }
+  }
+
+  explicit ocl_preview_engine(const ocl_helpers::ocl_device_info& device_info)
+    : max_batch_bytes(16 * 1024 * 1024), max_batch_tiles(256), preview_engine(new ocl_engine(device_info))
+  {}
+
+  inline bool is_ready() const
+  {
+    return preview_engine && preview_engine->is_ready();
+  }
+
+  //renders every tile into its image. Returns false if the device couldn't (the tiles are left empty)
+  bool render(std::vector<preview_tile>& tiles, const float boundary_val = 2.0f, const int max_iter = static_cast<int>(fractal_params::MAX_ITER))
+  {
+    FRACTAL_TRACE_SCOPE("ocl_preview_render");
+    if(!is_ready()) {
+      std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to render the preview on" << std::endl;
+      return false;
+    }
+    cl_kernel ocl_kernel = preview_engine->get_kernel("fractal2d.cl", "", "fractal2d");
+    if(!ocl_kernel) {
+      return false;
+    }
+    clSetKernelArg(ocl_kernel, 3, sizeof(cl_float), (void *)&boundary_val);
+    clSetKernelArg(ocl_kernel, 4, sizeof(cl_int),   (void *)&max_iter);
 
-    //create an opencl context
-    cl_context ocl_context = clCreateContext(nullptr, num_gpu, &device_id, nullptr, nullptr, nullptr); 
+    for (size_t first_tile = 0; first_tile < tiles.size(); )
+    {
+      //as many of the next tiles as fit in a batch (but always at least one)
+      size_t last_tile = first_tile;
+      size_t batch_pixels = 0;
+      while(last_tile < tiles.size() && last_tile - first_tile < max_batch_tiles &&
+            (last_tile == first_tile || (batch_pixels + tiles[last_tile].num_pixels()) * sizeof(cl_uchar) <= max_batch_bytes))
+      {
+        batch_pixels += tiles[last_tile].num_pixels();
+        ++last_tile;
+      }
+
+      if(!render_batch(ocl_kernel, tiles, first_tile, last_tile, batch_pixels)) {
+        return false;
+      }
+      first_tile = last_tile;
+    }
+    return true;
+  }
+
+  //Renders the view by perturbation, with the reference + series from the host. The deltas are float (down
+  //to a pixel spacing of ~1e-35, past which they underflow), or double with use_double on a device with
+  //cl_khr_fp64. Float is faster, but where the orbits stay near the boundary for long (so any rounding
+  //grows) it's off by a few iterations from double. iterations gets the escape iteration of every pixel,
+  //same as cpu_fractals::run_deep_zoom
+  bool render_deep_zoom(const deep_zoom::zoom_view& view, const deep_zoom::reference_orbit& reference, const deep_zoom::series_approximation& series,
+                        std::vector<cl_uint>& iterations, const bool use_double = false)
+  {
+    FRACTAL_TRACE_SCOPE("ocl_deep_zoom");
+    if(!is_ready()) {
+      std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to render the preview on" << std::endl;
+      return false;
+    }
+    if(use_double && !preview_engine->get_device_info().has_fp64)
+    {
+      std::cout << "ERROR @ KERNEL VARIANT -- " << preview_engine->get_device_info().device_name << " has no double precision support" << std::endl;
+      return false;
+    }
+    if(!use_double && view.get_pixel_spacing() < 1000 * std::numeric_limits<cl_float>::min())
+    {
+      std::cout << "ERROR @ DEEP ZOOM -- a pixel spacing of " << view.get_pixel_spacing() << " is past float, it needs the double deltas" << std::endl;
+      return false;
+    }
+    cl_kernel ocl_kernel = preview_engine->get_kernel("fractal2d.cl", use_double ? "-DUSE_DOUBLE" : "", "fractal2d_perturb");
+    if(!ocl_kernel || reference.size() < 2) {
+      return false;
+    }
 
-    // Create a command queue for the device in the context
-    cl_command_queue ocl_command_queue = clCreateCommandQueue(ocl_context, device_id, 0, nullptr);
+    return use_double ? launch_deep_zoom<cl_double, cl_double2>(ocl_kernel, view, reference, series, iterations)
+                      : launch_deep_zoom<cl_float, cl_float2>(ocl_kernel, view, reference, series, iterations);
+  }
 
-    const std::string file_name { "fractal2d.cl" };
-    std::string program_source;
-    load_kernel_file(file_name, program_source);
+  //the tile as a BGR image, coloured by iteration count (the interior is black)
+  static cv::Mat to_image(const preview_tile& tile, const int max_iter = static_cast<int>(fractal_params::MAX_ITER))
+  {
+    cv::Mat output_image = cv::Mat::zeros(tile.height, tile.width, CV_8UC3);
+    if(tile.image.size() < tile.num_pixels()) {
+      return output_image;
+    }
+    for (int i = 0; i < tile.height; ++i)
+    {
+      for (int j = 0; j < tile.width; ++j)
+      {
+        const int iter_num = tile.image[i*tile.width+j];
+        if(iter_num >= max_iter-1)
+          output_image.at<cv::Vec3b>(i,j) = cv::Vec3b(0, 0, 0);
+        else
+          output_image.at<cv::Vec3b>(i,j) = cv::Vec3b(cv::saturate_cast<uchar>(5*iter_num), cv::saturate_cast<uchar>(5*iter_num), iter_num);
+      }
+    }
+    return output_image;
+  }
+
+  //the most device memory a batch's images take up, and the most tiles per launch
+  size_t max_batch_bytes;
+  size_t max_batch_tiles;
+
+private:
+  template <typename real_t, typename real2_t>
+  bool launch_deep_zoom(cl_kernel ocl_kernel, const deep_zoom::zoom_view& view, const deep_zoom::reference_orbit& reference, 
+                        const deep_zoom::series_approximation& series, std::vector<cl_uint>& iterations)
+  {
+    const size_t num_pixels = static_cast<size_t>(std::max(0, view.width)) * std::max(0, view.height);
+    iterations.resize(num_pixels);
+    if(num_pixels == 0) {
+      return true;
+    }
 
-    //create + compile the opencl program
-    auto kernel_source_code = program_source.c_str();
-    cl_program ocl_program = clCreateProgramWithSource(ocl_context, 1, (const char**) &kernel_source_code, 0, &ocl_error_num);
+    std::vector<real2_t> h_orbit (reference.size());
+    for (int orbit_idx = 0; orbit_idx < reference.size(); ++orbit_idx) {
+      h_orbit[orbit_idx] = {{static_cast<real_t>(reference.orbit_real[orbit_idx]), static_cast<real_t>(reference.orbit_imag[orbit_idx])}};
+    }
+    cl_mem dev_orbit = preview_engine->get_buffer("deep_zoom_orbit", h_orbit.size() * sizeof(real2_t), CL_MEM_READ_ONLY);
+    cl_mem dev_iterations = preview_engine->get_buffer("deep_zoom_iterations", num_pixels * sizeof(cl_uint), CL_MEM_WRITE_ONLY);
+    if(!dev_orbit || !dev_iterations) {
+      return false;
+    }
+    cl_command_queue ocl_command_queue = preview_engine->get_queue();
+    clEnqueueWriteBuffer(ocl_command_queue, dev_orbit, CL_FALSE, 0, h_orbit.size() * sizeof(real2_t), h_orbit.data(), 0, nullptr, nullptr);
+
+    //the coefficients go in scaled to the pixel offsets (see the kernel)
+    const double pixel_spacing = view.get_pixel_spacing();
+    const std::complex<double> scaled_A = series.A * pixel_spacing;
+    const std::complex<double> scaled_B = series.B * pixel_spacing * pixel_spacing;
+    const std::complex<double> scaled_C = series.C * pixel_spacing * pixel_spacing * pixel_spacing;
+    const real2_t series_A = {{static_cast<real_t>(scaled_A.real()), static_cast<real_t>(scaled_A.imag())}};
+    const real2_t series_B = {{static_cast<real_t>(scaled_B.real()), static_cast<real_t>(scaled_B.imag())}};
+    const real2_t series_C = {{static_cast<real_t>(scaled_C.real()), static_cast<real_t>(scaled_C.imag())}};
+    const real_t dev_spacing = static_cast<real_t>(pixel_spacing);
+    const cl_int orbit_size = reference.size();
+    const cl_int2 dimensions = {{view.height, view.width}};
+
+    clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem),   (void *)&dev_iterations);
+    clSetKernelArg(ocl_kernel, 1, sizeof(cl_mem),   (void *)&dev_orbit);
+    clSetKernelArg(ocl_kernel, 2, sizeof(cl_int),   (void *)&orbit_size);
+    clSetKernelArg(ocl_kernel, 3, sizeof(cl_int2),  (void *)&dimensions);
+    clSetKernelArg(ocl_kernel, 4, sizeof(real_t),   (void *)&dev_spacing);
+    clSetKernelArg(ocl_kernel, 5, sizeof(real2_t),  (void *)&series_A);
+    clSetKernelArg(ocl_kernel, 6, sizeof(real2_t),  (void *)&series_B);
+    clSetKernelArg(ocl_kernel, 7, sizeof(real2_t),  (void *)&series_C);
+    clSetKernelArg(ocl_kernel, 8, sizeof(cl_int),   (void *)&series.skip_iter);
+    clSetKernelArg(ocl_kernel, 9, sizeof(cl_int),   (void *)&view.max_iter);
+
+    const size_t global_kernel_dims [2] = {static_cast<size_t>(view.height), static_cast<size_t>(view.width)};
+    auto ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, 2, nullptr, global_kernel_dims, nullptr, 0, nullptr, nullptr);
     if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ PROGRAM CREATION -- " << ocl_error_num << std::endl;
+    {
+      std::cout << "ERROR @ KERNEL LAUNCH -- " << ocl_error_num << std::endl;
+      return false;
+    }
 
-    ocl_error_num = clBuildProgram(ocl_program, 0, 0, 0, 0, 0);
+    //NOTE: blocking, as h_orbit has to outlive the write above
+    ocl_error_num = clEnqueueReadBuffer(ocl_command_queue, dev_iterations, CL_TRUE, 0, num_pixels * sizeof(cl_uint), iterations.data(), 0, nullptr, nullptr);
     if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ PROGRAM BUILD -- " << ocl_error_num << std::endl;
-
-    if (ocl_error_num == CL_BUILD_PROGRAM_FAILURE) {
-        // Determine the size of the log
-        size_t log_size;
-        clGetProgramBuildInfo(ocl_program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    {
+      std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool render_batch(cl_kernel ocl_kernel, std::vector<preview_tile>& tiles, const size_t first_tile, const size_t last_tile, const size_t batch_pixels)
+  {
+    const size_t num_tiles = last_tile - first_tile;
+    h_viewports.resize(num_tiles);
+    h_layouts.resize(num_tiles);
+    size_t max_rows = 0, max_cols = 0, pixel_offset = 0;
+    for (size_t tile_idx = 0; tile_idx < num_tiles; ++tile_idx)
+    {
+      const preview_tile& tile = tiles[first_tile + tile_idx];
+      h_viewports[tile_idx] = {{tile.min_real, tile.min_imag, tile.max_real, tile.max_imag}};
+      h_layouts[tile_idx] = {{std::max(0, tile.height), std::max(0, tile.width), static_cast<cl_int>(pixel_offset), 0}};
+      max_rows = std::max<size_t>(max_rows, h_layouts[tile_idx].s[0]);
+      max_cols = std::max<size_t>(max_cols, h_layouts[tile_idx].s[1]);
+      pixel_offset += tile.num_pixels();
+    }
+    h_image.resize(batch_pixels);
+    if(batch_pixels == 0)
+    {
+      for (size_t tile_idx = first_tile; tile_idx < last_tile; ++tile_idx) {
+        tiles[tile_idx].image.clear();
+      }
+      return true;
+    }
 
-        // Allocate memory for the log
-        char *log = (char *) malloc(log_size);
+    cl_mem dev_image = preview_engine->get_buffer("preview_image", batch_pixels * sizeof(cl_uchar), CL_MEM_WRITE_ONLY);
+    cl_mem dev_viewports = preview_engine->get_buffer("preview_viewports", num_tiles * sizeof(cl_float4), CL_MEM_READ_ONLY);
+    cl_mem dev_layouts = preview_engine->get_buffer("preview_layouts", num_tiles * sizeof(cl_int4), CL_MEM_READ_ONLY);
+    if(!dev_image || !dev_viewports || !dev_layouts) {
+      return false;
+    }
 
-        // Get the log
-        clGetProgramBuildInfo(ocl_program, device_id, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+    //the writes are done with by the time the blocking read below returns, as it's all on one queue
+    cl_command_queue ocl_command_queue = preview_engine->get_queue();
+    clEnqueueWriteBuffer(ocl_command_queue, dev_viewports, CL_FALSE, 0, num_tiles * sizeof(cl_float4), h_viewports.data(), 0, nullptr, nullptr);
+    clEnqueueWriteBuffer(ocl_command_queue, dev_layouts, CL_FALSE, 0, num_tiles * sizeof(cl_int4), h_layouts.data(), 0, nullptr, nullptr);
 
-        // Print the log
-        printf("%s\n", log);
-    }
+    clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem), (void *)&dev_image);
+    clSetKernelArg(ocl_kernel, 1, sizeof(cl_mem), (void *)&dev_viewports);
+    clSetKernelArg(ocl_kernel, 2, sizeof(cl_mem), (void *)&dev_layouts);
 
-    // Create kernel instance
-    cl_kernel ocl_kernel = clCreateKernel(ocl_program, "fractal2d", &ocl_error_num);
+    //{rows, columns of the biggest tile, tiles}
+    const size_t global_kernel_dims [3] = {std::max<size_t>(1, max_rows), std::max<size_t>(1, max_cols), num_tiles};
+    auto ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, 3, nullptr, global_kernel_dims, nullptr, 0, nullptr, nullptr);
     if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ KERNEL CREATION -- " << ocl_error_num << std::endl;
-
-    const int imheight = 512;
-    const int imwidth =  512;
-    const float BOUNDARY_VAL = 2;
-    const int MAX_ITER = 80;
-
-    cl_uint h_image [imheight * imwidth];
-    std::fill(std::begin(h_image), std::end(h_image), 0);
-   
-    cl_mem dev_image;
-    dev_image = clCreateBuffer(ocl_context, CL_MEM_WRITE_ONLY,
-            imheight * imwidth * sizeof(cl_uint), nullptr, 0);
-    
-    const float max_real = 1.0;
-    cl_float2 min_limits = {{-2.0, -1.2}};
-    cl_float2 max_limits = {{max_real, min_limits.s[1] + (max_real - min_limits.s[0] * imheight/imwidth)}};
-    cl_float2 dev_factor = {{(max_limits.s[0] - min_limits.s[0]) / (imwidth-1), 
-                             (max_limits.s[1] - min_limits.s[1]) / (imheight-1)}};
-
-    //make the kernel arguments
-    cl_float4 dev_limits = {{min_limits.s[0], min_limits.s[1], max_limits.s[0], max_limits.s[1]}};
-
-    std::cout << "limits: " << dev_limits.s[0] << "  " << dev_limits.s[1] << "  " << dev_limits.s[2] << "  " << dev_limits.s[3] << std::endl;
-    std::cout << "factor: " << dev_factor.s[0] << "  " << dev_factor.s[1] << std::endl;
-
-    // Setup parameter values
-    clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem),    (void *)&dev_image);
-    clSetKernelArg(ocl_kernel, 1, sizeof(cl_float4), (void *)&dev_limits);
-    clSetKernelArg(ocl_kernel, 2, sizeof(cl_float2), (void *)&dev_factor);
-    clSetKernelArg(ocl_kernel, 3, sizeof(cl_float),  (void *)&BOUNDARY_VAL);
-    clSetKernelArg(ocl_kernel, 4, sizeof(cl_int),    (void *)&imwidth);
-    clSetKernelArg(ocl_kernel, 5, sizeof(cl_int),    (void *)&MAX_ITER);
-
-    const size_t cnBlockSize = imheight;
-    const size_t cnBlocks = imwidth;
-    const size_t cnDimension = cnBlocks * cnBlockSize;
-
-    // Launch kernel
-    ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, 1, 0, &cnDimension, 0, 0, 0, 0);
-    if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ KERNEL LAUNCH -- " << ocl_error_num << std::endl;
+    {
+      std::cout << "ERROR @ KERNEL LAUNCH -- " << ocl_error_num << std::endl;
+      return false;
+    }
 
-    // Copy results from device back to host; block until complete
-    ocl_error_num = clEnqueueReadBuffer(ocl_command_queue, dev_image, CL_TRUE, 0, cnDimension * sizeof(cl_uint), &h_image, 0, 0, 0);
+    ocl_error_num = clEnqueueReadBuffer(ocl_command_queue, dev_image, CL_TRUE, 0, batch_pixels * sizeof(cl_uchar), h_image.data(), 0, nullptr, nullptr);
     if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << std::endl;
+    {
+      std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << std::endl;
+      return false;
+    }
 
-    cv::Mat output_image = cv::Mat::zeros (imheight, imwidth, CV_8UC3);
-    for (int i = 0; i < imheight; ++i)
+    for (size_t tile_idx = 0; tile_idx < num_tiles; ++tile_idx)
     {
-        for (int j = 0; j < imwidth; ++j)
-        {
-            auto iter_num = h_image[i*imwidth+j];
-            if(iter_num == MAX_ITER-1)
-                output_image.at<cv::Vec3b>(i,j) = cv::Vec3b(0, 0, 0);   
-            else
-                output_image.at<cv::Vec3b>(i,j) = cv::Vec3b(5*iter_num, 5*iter_num, iter_num);   
-        }
-    }
-    cv::imshow("Output Mandelbrot", output_image);
-    cv::waitKey(0);
-
-    clReleaseKernel(ocl_kernel);
-    clReleaseProgram(ocl_program);
-   
-    clReleaseMemObject(dev_image);
-
-    clReleaseCommandQueue(ocl_command_queue);
-    clReleaseContext(ocl_context);
-
-    return 0;
-}
+      preview_tile& tile = tiles[first_tile + tile_idx];
+      const auto tile_begin = h_image.begin() + h_layouts[tile_idx].s[2];
+      tile.image.assign(tile_begin, tile_begin + tile.num_pixels());
+    }
+    return true;
+  }
+
+  std::unique_ptr<ocl_engine> preview_engine;
+
+  //the host side of the last batch, kept around between renders
+  std::vector<cl_float4> h_viewports;
+  std::vector<cl_int4> h_layouts;
+  std::vector<cl_uchar> h_image;
+};
 
 #endif
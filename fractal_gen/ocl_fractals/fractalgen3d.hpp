@@ -24,136 +24,275 @@
 #include <array>
 #include <chrono>
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 //#include "../cpu_fractal.hpp"
 #include "util/ocl_helpers.hpp"
-
-namespace fractal_helpers
+#include "util/fractal_helpers.hpp"
+#include "util/cost_model.hpp"
+#include "ocl_engine.hpp"
+#include "ocl_kernel_variants.hpp"
+#include "ocl_autotuner.hpp"
+#include "util/trace.hpp"
+
+//how run_ocl_fractal runs the kernels: which variant, and how the stack is split up into launches
+struct ocl_launch_config
 {
+  ocl_launch_config()
+    : slices_per_launch(0), max_batch_bytes(16 * 1024 * 1024), num_buffers(2), compact_points(true), use_double(false), fast_math(false), autotune(true)
+  {}
 
-struct fractal_options
-{
-  static const std::vector<std::string>& get_ids()
+  //the kernel variant that generates the request
+  ocl_kernel_variant get_variant(const fractal_params& params) const
   {
-    static const std::vector <std::string> ids 
-    {
-      "mandelbrot",
-      "julia"
-    };
-    return ids;
+    return ocl_kernel_variant::for_request(params, use_double, fast_math);
   }
 
-  static std::string get_ocl_id(const std::string& id)
+  //the name the precision settings go by in the backend ID, as their results aren't interchangeable
+  std::string get_precision_name() const
   {
-    static const std::map <std::string, std::string> ocl_ids
-    {
-      {"mandelbrot", "MANDELBROT"},
-      {"julia", "JULIA"}
-    };
+    return std::string(use_double ? "double" : "float") + (fast_math ? "_fastmath" : "");
+  }
+
+  //how many slices each launch (and read-back) covers
+  inline int get_batch_slices(const fractal_params& params) const
+  {
+    if(slices_per_launch > 0) {
+      return std::max(1, std::min(slices_per_launch, params.imdepth));
+    }
 
-    auto id_it = ocl_ids.find(id);
-    if(id_it != ocl_ids.end())
-      return id_it->second;
-    else
-      throw std::runtime_error("INVALID Fractal Name -- " + id);
+    const size_t slice_bytes = std::max<size_t>(1, params.imheight * params.imwidth * sizeof(cl_uchar));
+    int num_slices = static_cast<int>(max_batch_bytes / slice_bytes);
+    //leave enough batches to keep all the buffers busy, or nothing overlaps
+    if(num_buffers > 1) {
+      num_slices = std::min(num_slices, (params.imdepth + 2 * num_buffers - 1) / (2 * num_buffers));
+    }
+    return std::max(1, std::min(num_slices, params.imdepth));
   }
+
+  //0 --> as many as fit in max_batch_bytes
+  int slices_per_launch;
+  //the size of each device image buffer when picking the batch size automatically
+  size_t max_batch_bytes;
+  //device image buffers to rotate through; with more than one, the next batch is computed while the
+  //last one is on its way back to the host
+  int num_buffers;
+  //only the points come back from the device (run_ocl_points), rather than the whole stack
+  bool compact_points;
+  //the kernel variant's precision: iterate in double (for devices with cl_khr_fp64), and/or build
+  //with -cl-fast-relaxed-math
+  bool use_double;
+  bool fast_math;
+  //launch the kernels that can run at any work-group size at their tuned one (see ocl_autotuner),
+  //rather than the driver's pick (or the fixed size of the compacting kernels)
+  bool autotune;
 };
 
-} //namespace fractal_helpers
+//the named kernel of the variant the request needs, built the first time it's asked for. Returns
+//nullptr if the variant doesn't build (or can't run on the engine's device)
+inline cl_kernel get_variant_kernel(ocl_engine& fractal_engine, const ocl_launch_config& launch_config, const fractal_params& params, const std::string& kernel_name)
+{
+  const auto variant = launch_config.get_variant(params);
+  if(variant.use_double && !fractal_engine.get_device_info().has_fp64)
+  {
+    std::cout << "ERROR @ KERNEL VARIANT -- " << fractal_engine.get_device_info().device_name << " has no double precision support" << std::endl;
+    return nullptr;
+  }
+  return fractal_engine.get_kernel("fractal3d.cl", variant.get_build_options(), kernel_name);
+}
+
+//the fractal3d kernel's iterations (see kernels/fractal3d.cl) on the host. NOTE: that's not the same
+//triplex formula as cpu_fractals::mandel_point, so it's this that has to stand in for the devices on the
+//host. dim_limits is in the kernel's {row, column, depth} order, and the juliabulb's constant is the
+//kernel's default one
+template <typename real_t>
+int host_kernel_iterations(const real_t dim_limits[3], const bool is_julia, const int order, const int max_iter, const real_t boundary_val)
+{
+    const real_t julia_c [3] = {static_cast<real_t>(0.353), static_cast<real_t>(0.288), static_cast<real_t>(0.2)};
+    const real_t* offset = is_julia ? julia_c : dim_limits;
+    real_t coords [3] = {0, 0, 0};
+    if(is_julia) {
+        std::copy(dim_limits, dim_limits + 3, coords);
+    }
 
+    int iter_num = 0;
+    for (iter_num = 0; iter_num < max_iter; ++iter_num)
+    {
+        const real_t r = std::sqrt(coords[0] * coords[0] + coords[1] * coords[1] + coords[2] * coords[2]);
+        if(r > boundary_val)
+            break;
+
+        const real_t theta = order * std::atan2(std::sqrt(coords[0] * coords[0] + coords[1] * coords[1]), coords[2]);
+        const real_t phi = order * std::atan2(coords[0], coords[1]);
+        const real_t r_pow = std::pow(r, order);
+        coords[0] = offset[0] + r_pow * std::cos(theta) * std::cos(phi);
+        coords[1] = offset[1] + r_pow * std::sin(theta) * std::cos(phi);
+        coords[2] = offset[2] + r_pow * std::sin(phi);
+    }
+    return iter_num;
+}
 
-template <typename data_t>
-void run_ocl_fractal(std::vector<data_t>& h_image_stack, const fractal_params& params)
+//the predicted cost of the request's slices (see util/cost_model.hpp), from the kernel's formula on a
+//coarse grid. Always in float, as it's only an estimate
+inline cost_map make_ocl_cost_map(const fractal_params& params)
 {
-  bool verbose_run = false;
-	using cldata_t = cl_uchar;
+    const bool is_julia = (fractal_helpers::fractal_options::get_ocl_id(params.fractal_name) == "JULIA");
+    const int max_iter = static_cast<int>(params.MAX_ITER);
+    const int order = params.ORDER;
+    const float limit_diff = params.MAX_LIMIT - params.MIN_LIMIT;
+    return make_cost_map(params, [&](const int row, const int col, const int depth)
+        {
+            const float dim_limits [3] = {params.MIN_LIMIT + row * (limit_diff / params.imheight), params.MIN_LIMIT + col * (limit_diff / params.imwidth),
+                                          params.MIN_LIMIT + depth * (limit_diff / params.imdepth)};
+            return host_kernel_iterations<float>(dim_limits, is_julia, order, max_iter, params.BOUNDARY_VAL);
+        });
+}
 
-    std::string target_platform_id {"NVIDIA"};
-    //get ONE GPU device on the target platform 
-    const int num_gpu = 1;
- 
-    cl_uint ocl_platform;
-    bool platform_present;
-    cl_platform_id ocl_platform_id;
-
-    std::cout << "Finding platform " << target_platform_id << std::endl;
-    std::tie(ocl_platform, ocl_platform_id, platform_present) = ocl_helpers::get_platform_id(target_platform_id);
-
-    if(platform_present)
-        std::cout << target_platform_id << " platform at index " << ocl_platform << std::endl;
-
-    //5 things for every opencl host-side program:
-    //1. cl_device_id
-    //2. cl_command_queue
-    //3. cl_context
-    //4. cl_program
-    //5. cl_kernel
-    cl_device_id device_id;
-    clGetDeviceIDs(ocl_platform_id, CL_DEVICE_TYPE_GPU, num_gpu, &device_id, nullptr);
-    std::cout << "GPU device id: " << device_id << std::endl; 
-    
-    cl_int ocl_error_num;
-    //create an opencl context
-    cl_context ocl_context = clCreateContext(nullptr, num_gpu, &device_id, nullptr, nullptr, nullptr); 
-    // Create a command queue for the device in the context
-    cl_command_queue ocl_command_queue = clCreateCommandQueue(ocl_context, device_id, 0, nullptr);
-
-    //NOTE: should I use boost::filepath for the ocl files?
-    const std::string kernel_fpath = ocl_helpers::get_kernelpath();
-    const std::string file_name { kernel_fpath + "fractal3d.cl" }; 
-    std::string program_source;
-    ocl_helpers::load_kernel_file(file_name, program_source);
-		
-    //NOTE: might be able to do some error recovery instead (e.g. switch to CPU fractals)
-    assert(!program_source.empty());
-
-    //create + compile the opencl program
-    auto kernel_source_code = program_source.c_str();
-    cl_program ocl_program = clCreateProgramWithSource(ocl_context, 1, (const char**) &kernel_source_code, 0, &ocl_error_num);
+//one of the rotating device image buffers, and the batch it's holding
+struct ocl_batch_slot
+{
+  ocl_batch_slot()
+    : dev_image(nullptr), mapped_image(nullptr), kernel_done(nullptr), map_done(nullptr), unmap_done(nullptr), depth_idx(0), num_slices(0)
+  {}
+
+  cl_mem dev_image;
+  void* mapped_image;
+  cl_event kernel_done;
+  cl_event map_done;
+  //the buffer is free to be written again
+  cl_event unmap_done;
+
+  int depth_idx;
+  //0 --> no batch in flight
+  int num_slices;
+};
+
+
+//the work-group size of the kernels that reduce or compact per group (STATS_GROUP_DIM in the kernel).
+//The global size gets padded up to a multiple of it
+static const size_t ocl_group_dim = 16;
+
+//the device side of the statistics of one run, which the *_stats kernels reduce into
+struct ocl_stats_buffers
+{
+  ocl_stats_buffers()
+    : dev_histogram(nullptr), dev_slice_iterations(nullptr), dev_bounds(nullptr)
+  {}
+
+  //gets the buffers from the engine, resets them (they're reused between requests) and sets them as
+  //the kernel's args from first_arg on
+  bool setup(ocl_engine& fractal_engine, cl_kernel ocl_kernel, const cl_uint first_arg, const int imdepth)
+  {
+    h_histogram.assign(fractal_stats::num_bins, 0);
+    h_slice_iterations.assign(imdepth, 0);
+    h_bounds = {std::numeric_limits<cl_int>::max(), std::numeric_limits<cl_int>::max(), std::numeric_limits<cl_int>::max(), -1, -1, -1};
+
+    dev_histogram = fractal_engine.get_buffer("stats_histogram", h_histogram.size() * sizeof(cl_uint), CL_MEM_READ_WRITE);
+    dev_slice_iterations = fractal_engine.get_buffer("stats_slice_iterations", h_slice_iterations.size() * sizeof(cl_uint), CL_MEM_READ_WRITE);
+    dev_bounds = fractal_engine.get_buffer("stats_bounds", h_bounds.size() * sizeof(cl_int), CL_MEM_READ_WRITE);
+    if(!dev_histogram || !dev_slice_iterations || !dev_bounds) {
+      return false;
+    }
+
+    cl_command_queue ocl_command_queue = fractal_engine.get_queue();
+    clEnqueueWriteBuffer(ocl_command_queue, dev_histogram, CL_FALSE, 0, h_histogram.size() * sizeof(cl_uint), h_histogram.data(), 0, nullptr, nullptr);
+    clEnqueueWriteBuffer(ocl_command_queue, dev_slice_iterations, CL_FALSE, 0, h_slice_iterations.size() * sizeof(cl_uint), h_slice_iterations.data(), 0, nullptr, nullptr);
+    clEnqueueWriteBuffer(ocl_command_queue, dev_bounds, CL_FALSE, 0, h_bounds.size() * sizeof(cl_int), h_bounds.data(), 0, nullptr, nullptr);
+
+    clSetKernelArg(ocl_kernel, first_arg, sizeof(cl_mem), (void *)&dev_histogram);
+    clSetKernelArg(ocl_kernel, first_arg + 1, sizeof(cl_mem), (void *)&dev_slice_iterations);
+    clSetKernelArg(ocl_kernel, first_arg + 2, sizeof(cl_mem), (void *)&dev_bounds);
+    return true;
+  }
+
+  //waits for the kernels on the queue, and adds the totals to run_stats (rather than assigning them,
+  //as a resumed request already has the earlier slices in there)
+  void read_back(cl_command_queue ocl_command_queue, fractal_stats& run_stats)
+  {
+    clEnqueueReadBuffer(ocl_command_queue, dev_histogram, CL_FALSE, 0, h_histogram.size() * sizeof(cl_uint), h_histogram.data(), 0, nullptr, nullptr);
+    clEnqueueReadBuffer(ocl_command_queue, dev_slice_iterations, CL_FALSE, 0, h_slice_iterations.size() * sizeof(cl_uint), h_slice_iterations.data(), 0, nullptr, nullptr);
+    auto ocl_error_num = clEnqueueReadBuffer(ocl_command_queue, dev_bounds, CL_TRUE, 0, h_bounds.size() * sizeof(cl_int), h_bounds.data(), 0, nullptr, nullptr);
     if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ PROGRAM CREATION -- " << ocl_error_num << std::endl;
+      std::cout << "ERROR @ STATS RETRIEVE -- " << ocl_error_num << std::endl;
 
-    auto fracids = fractal_helpers::fractal_options::get_ids();
-    std::string fractal_id_list = "";
-    std::for_each(fracids.begin(), fracids.end(), [&fractal_id_list](const std::string& id)
+    const size_t max_iter = fractal_params::MAX_ITER;
+    for (size_t bin_idx = 0; bin_idx < h_histogram.size(); ++bin_idx)
     {
-      fractal_id_list += (" -- " + fractal_helpers::fractal_options::get_ocl_id(id));
-    });
+      run_stats.iteration_histogram[bin_idx] += h_histogram[bin_idx];
+      if(bin_idx >= max_iter)
+        run_stats.num_interior += h_histogram[bin_idx];
+      else
+        run_stats.num_escaped += h_histogram[bin_idx];
+    }
+    for (size_t slice_idx = 0; slice_idx < h_slice_iterations.size(); ++slice_idx)
+    {
+      run_stats.slice_iterations[slice_idx] += h_slice_iterations[slice_idx];
+      run_stats.total_iterations += h_slice_iterations[slice_idx];
+    }
+    if(h_bounds[5] >= 0)
+      run_stats.add_bounds(h_bounds[0], h_bounds[1], h_bounds[2], h_bounds[3], h_bounds[4], h_bounds[5]);
+  }
 
-    std::cout << "fractal ID list: " << fractal_id_list << std::endl;
-    const std::string ocl_fractal_id = fractal_helpers::fractal_options::get_ocl_id(params.fractal_name);
-    const std::string cl_opts {"-DFRACTALID=" + ocl_fractal_id};
-    ocl_error_num = clBuildProgram(ocl_program, 0, 0, cl_opts.c_str(), nullptr, nullptr);
-    if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ PROGRAM BUILD -- " << ocl_error_num << std::endl;
+  std::vector<cl_uint> h_histogram;
+  std::vector<cl_uint> h_slice_iterations;
+  std::vector<cl_int> h_bounds;
+  cl_mem dev_histogram;
+  cl_mem dev_slice_iterations;
+  cl_mem dev_bounds;
+};
 
-    if (ocl_error_num == CL_BUILD_PROGRAM_FAILURE) {
-        // Determine the size of the log
-        size_t log_size;
-        clGetProgramBuildInfo(ocl_program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        // Allocate memory for the log
-        char *log = (char *) malloc(log_size);
-        // Get the log
-        clGetProgramBuildInfo(ocl_program, device_id, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        // Print the log
-        printf("%s\n", log);
+//Generates the slices [z_begin, z_end) of the stack, and returns the first slice it didn't generate
+//(z_end, unless the request was stopped). Recording where to resume is left to the caller, as a
+//request can be split over several devices.
+//run_stats (if given) gets the statistics of the generated slices added to it. They're reduced on the
+//device (fractal3d_stats), so all that comes back is the totals, once the slices are done.
+//Everything long-lived (context, queue, built kernels, buffers) comes from the engine.
+//The slices are generated in batches, one 3D launch + one read-back per batch, as the per-launch
+//overhead (and the sync on every read) otherwise dominates for all but the biggest slices.
+//
+//The batches rotate through a few device buffers: the kernels go on the compute queue, and each
+//finished batch gets mapped on the transfer queue (waiting on its kernel's event), so the next batch
+//is computed while the last one is being copied back. The buffers are allocated host-accessible
+//(CL_MEM_ALLOC_HOST_PTR), so on CPU + integrated devices the map is zero-copy and on discrete ones it's
+//a transfer straight into pinned memory, without the driver's staging copy
+template <typename data_t>
+int run_ocl_fractal(ocl_engine& fractal_engine, const ocl_launch_config& launch_config, std::vector<data_t>& h_image_stack, const fractal_params& params, 
+                    const int z_begin, const int z_end, fractal_stats* run_stats = nullptr)
+{
+  FRACTAL_TRACE_SCOPE("ocl_generate");
+  bool verbose_run = false;
+	using cldata_t = cl_uchar;
 
-        return;
+    if(!fractal_engine.is_ready()) {
+        std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to generate on" << std::endl;
+        return z_begin;
     }
+    cl_command_queue ocl_command_queue = fractal_engine.get_queue();
 
-    // Create kernel instance
-    const std::string fractal_kernel_name = "fractal3d";
-    cl_kernel ocl_kernel = clCreateKernel(ocl_program, fractal_kernel_name.c_str(), &ocl_error_num);
-    if(ocl_error_num != CL_SUCCESS)
-        std::cout << "ERROR @ KERNEL CREATION -- " << ocl_error_num  << " -- kernel name: " << fractal_kernel_name << std::endl;
-  
-    cl_mem dev_image;
-    dev_image = clCreateBuffer(ocl_context, CL_MEM_WRITE_ONLY, params.imheight * params.imwidth * sizeof(cldata_t), nullptr, 0);
-   
-    const cl_uint work_dims = 2;
-    const size_t global_kernel_dims [work_dims] = {static_cast<size_t>(params.imheight), static_cast<size_t>(params.imwidth)};  
- 
-    auto start = std::chrono::high_resolution_clock::now();
+    cl_kernel ocl_kernel = get_variant_kernel(fractal_engine, launch_config, params, run_stats ? "fractal3d_stats" : "fractal3d");
+    if(!ocl_kernel) {
+        return z_begin;
+    }
+
+    const size_t slice_bytes = params.imheight * params.imwidth * sizeof(cldata_t);
+    const int batch_slices = launch_config.get_batch_slices(params);
+    std::vector<ocl_batch_slot> batch_slots (std::max(1, launch_config.num_buffers));
+    for (size_t slot_idx = 0; slot_idx < batch_slots.size(); ++slot_idx)
+    {
+        batch_slots[slot_idx].dev_image = fractal_engine.get_buffer("image_" + std::to_string(slot_idx), batch_slices * slice_bytes, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR);
+        if(!batch_slots[slot_idx].dev_image) {
+            return z_begin;
+        }
+    }
+    cl_command_queue ocl_transfer_queue = fractal_engine.get_transfer_queue();
+
+    //{rows, columns, slices of the batch}
+    const cl_uint work_dims = 3;
+    size_t global_kernel_dims [work_dims] = {static_cast<size_t>(params.imheight), static_cast<size_t>(params.imwidth), static_cast<size_t>(batch_slices)};  
+    const size_t* local_kernel_dims = nullptr;
+    size_t tuned_local_dims [work_dims];
 
     const cl_int2 constants = {{static_cast<cl_int>(params.MAX_ITER), static_cast<cl_int>(params.ORDER)}};
     const cl_int3 dimensions = {{static_cast<cl_int>(params.imheight), static_cast<cl_int>(params.imwidth), static_cast<cl_int>(params.imdepth)}};
@@ -162,38 +301,512 @@ void run_ocl_fractal(std::vector<data_t>& h_image_stack, const fractal_params& p
     clSetKernelArg(ocl_kernel, 2, sizeof(cl_int3),  (void *)&dimensions);
     clSetKernelArg(ocl_kernel, 3, sizeof(cl_int2),  (void *)&constants);
     clSetKernelArg(ocl_kernel, 4, sizeof(cl_float3), (void *)&flt_constants);
-    
-    for (cl_int depth_idx = 0; depth_idx < params.imdepth; ++depth_idx)
+
+    //the statistics kernel needs whole work-groups of a fixed size; the plain one runs at its tuned
+    //size (tuned on the first buffer, the first time the variant runs on the device)
+    const size_t stats_local_dims [work_dims] = {ocl_group_dim, ocl_group_dim, 1};
+    ocl_stats_buffers stats_buffers;
+    if(run_stats)
+    {
+        for (cl_uint dim_idx = 0; dim_idx < 2; ++dim_idx) {
+            global_kernel_dims[dim_idx] = ocl_group_dim * ((global_kernel_dims[dim_idx] + ocl_group_dim - 1) / ocl_group_dim);
+        }
+        local_kernel_dims = stats_local_dims;
+        if(!stats_buffers.setup(fractal_engine, ocl_kernel, 5, params.imdepth)) {
+            return z_begin;
+        }
+    }
+    else if(launch_config.autotune)
     {
-        clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem),    (void *)&dev_image);
+        const auto local_size = ocl_autotuner::get_local_size(fractal_engine, ocl_kernel, "fractal3d", launch_config.get_variant(params).get_build_options(), params, 
+                                                              batch_slots[0].dev_image, std::min<int>(batch_slices, ocl_autotuner::max_probe_slices));
+        local_kernel_dims = ocl_autotuner::apply(local_size, global_kernel_dims, tuned_local_dims);
+    }
+ 
+    //copies a mapped batch into the stack, and hands the buffer back to the device
+    auto last_landed = std::chrono::high_resolution_clock::now();
+    auto drain_slot = [&](ocl_batch_slot& batch_slot)
+    {
+        FRACTAL_TRACE_SCOPE_ARG("ocl_readback", batch_slot.depth_idx);
+        clWaitForEvents(1, &batch_slot.map_done);
+        const size_t h_image_stack_offset = params.imheight * params.imwidth * batch_slot.depth_idx;
+        if(batch_slot.mapped_image) {
+            std::memcpy(&h_image_stack[h_image_stack_offset], batch_slot.mapped_image, batch_slot.num_slices * slice_bytes);
+        }
+
+        auto ocl_error_num = clEnqueueUnmapMemObject(ocl_transfer_queue, batch_slot.dev_image, batch_slot.mapped_image, 0, nullptr, &batch_slot.unmap_done);
+        if(ocl_error_num != CL_SUCCESS)
+            std::cout << "ERROR @ DATA UNMAP -- " << ocl_error_num << std::endl;
+        clFlush(ocl_transfer_queue);
+        clReleaseEvent(batch_slot.kernel_done);
+        clReleaseEvent(batch_slot.map_done);
+        batch_slot.kernel_done = nullptr;
+        batch_slot.map_done = nullptr;
+        batch_slot.mapped_image = nullptr;
+
+        //NOTE: the batches overlap, so this is the time between consecutive batches landing on the host.
+        //There's no telling the slices of a batch apart on the host, so they all get an even share
+        auto landed = std::chrono::high_resolution_clock::now();
+        if(run_stats)
+        {
+            const double batch_ms = std::chrono::duration<double, std::milli>(landed - last_landed).count();
+            for (int slice_idx = batch_slot.depth_idx; slice_idx < batch_slot.depth_idx + batch_slot.num_slices; ++slice_idx) {
+                run_stats->slice_ms[slice_idx] += batch_ms / batch_slot.num_slices;
+            }
+        }
+        last_landed = landed;
+        params.cancel_token.report_slices(batch_slot.depth_idx, batch_slot.depth_idx + batch_slot.num_slices, &h_image_stack[h_image_stack_offset]);
+
+        if(verbose_run)
+        {
+          auto batch_sum = std::accumulate(&h_image_stack[h_image_stack_offset], &h_image_stack[h_image_stack_offset] + batch_slot.num_slices * params.imheight * params.imwidth, 0);
+          std::cout << "slices " << batch_slot.depth_idx << " - " << batch_slot.depth_idx + batch_slot.num_slices - 1 << " sum: " << batch_sum << std::endl;
+        }
+        batch_slot.num_slices = 0;
+    };
+
+    size_t batch_idx = 0;
+    cl_int depth_idx = z_begin;
+    for (; depth_idx < z_end; depth_idx += batch_slices, ++batch_idx)
+    {
+        //stop launching batches if the request was cancelled, superseded or pre-empted. The ones in
+        //flight still land below, so the progress is counted in whole batches
+        if(params.cancel_token.should_stop()) {
+            std::cout << "Fractal generation stopped @depth " << depth_idx << std::endl;
+            break;
+        }
+        FRACTAL_TRACE_SCOPE_ARG("ocl_batch", depth_idx);
+
+        //the oldest batch has to be off the buffer before it can be reused
+        ocl_batch_slot& batch_slot = batch_slots[batch_idx % batch_slots.size()];
+        if(batch_slot.num_slices > 0) {
+            drain_slot(batch_slot);
+        }
+
+        //the last batch can come up short
+        batch_slot.depth_idx = depth_idx;
+        batch_slot.num_slices = std::min(batch_slices, z_end - depth_idx);
+        global_kernel_dims[2] = batch_slot.num_slices;
+        clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem),    (void *)&batch_slot.dev_image);
         clSetKernelArg(ocl_kernel, 1, sizeof(cl_int),    (void *)&depth_idx);
 
-        auto ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, work_dims, nullptr, global_kernel_dims, nullptr, 0, nullptr, nullptr);
+        const cl_uint num_wait_events = batch_slot.unmap_done ? 1 : 0;
+        auto ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, work_dims, nullptr, global_kernel_dims, local_kernel_dims, 
+                                                    num_wait_events, num_wait_events ? &batch_slot.unmap_done : nullptr, &batch_slot.kernel_done);
+        //a batch that can't be run ends the range here, short of z_end, which fails the request
         if(ocl_error_num != CL_SUCCESS)
+        {
             std::cout << "ERROR @ KERNEL LAUNCH -- " << ocl_error_num << " @depth " << depth_idx << std::endl;
+            batch_slot.num_slices = 0;
+            break;
+        }
+        clFlush(ocl_command_queue);
+        if(batch_slot.unmap_done) {
+            clReleaseEvent(batch_slot.unmap_done);
+            batch_slot.unmap_done = nullptr;
+        }
 
-        int h_image_stack_offset = params.imheight * params.imwidth * depth_idx;
-        ocl_error_num = clEnqueueReadBuffer(ocl_command_queue, dev_image, CL_TRUE, 0, params.imheight * params.imwidth * sizeof(cldata_t), 
-                                            &h_image_stack[h_image_stack_offset], 0, nullptr, nullptr);
+        batch_slot.mapped_image = clEnqueueMapBuffer(ocl_transfer_queue, batch_slot.dev_image, CL_FALSE, CL_MAP_READ, 0, batch_slot.num_slices * slice_bytes, 
+                                                     1, &batch_slot.kernel_done, &batch_slot.map_done, &ocl_error_num);
         if(ocl_error_num != CL_SUCCESS)
-            std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << std::endl;
+        {
+            std::cout << "ERROR @ DATA MAP -- " << ocl_error_num << " @depth " << depth_idx << std::endl;
+            clWaitForEvents(1, &batch_slot.kernel_done);
+            clReleaseEvent(batch_slot.kernel_done);
+            batch_slot.kernel_done = nullptr;
+            batch_slot.mapped_image = nullptr;
+            batch_slot.num_slices = 0;
+            break;
+        }
+        clFlush(ocl_transfer_queue);
+    }
 
-        if(verbose_run)
+    //the batches still in flight, oldest first
+    for (size_t drain_idx = 0; drain_idx < batch_slots.size(); ++drain_idx)
+    {
+        ocl_batch_slot& batch_slot = batch_slots[(batch_idx + drain_idx) % batch_slots.size()];
+        if(batch_slot.num_slices > 0) {
+            drain_slot(batch_slot);
+        }
+    }
+    //the buffers outlive the request, so the unmaps have to be done with before they're reused
+    clFinish(ocl_transfer_queue);
+    for (auto& batch_slot : batch_slots)
+    {
+        if(batch_slot.unmap_done) {
+            clReleaseEvent(batch_slot.unmap_done);
+        }
+    }
+
+    if(run_stats) {
+        stats_buffers.read_back(ocl_command_queue, *run_stats);
+    }
+    return std::min<int>(depth_idx, z_end);
+}
+
+//one of the rotating sets of point buffers of run_ocl_points, and the batch it's holding
+struct ocl_points_slot
+{
+  ocl_points_slot()
+    : dev_points(nullptr), dev_point_counts(nullptr), dev_num_points(nullptr), max_points(0), h_num_points(0), kernel_done(nullptr), 
+      counts_read(nullptr), depth_idx(0), num_slices(0)
+  {}
+
+  cl_mem dev_points;
+  cl_mem dev_point_counts;
+  cl_mem dev_num_points;
+  //how many points dev_points has room for
+  cl_uint max_points;
+
+  std::vector<cl_uint> h_point_counts;
+  cl_uint h_num_points;
+  cl_event kernel_done;
+  cl_event counts_read;
+
+  int depth_idx;
+  //0 --> no batch in flight
+  int num_slices;
+};
+
+//Same as run_ocl_fractal, except that only the points of the fractal (the voxels that never escaped)
+//come back from the device rather than the slices, and they're appended straight to the point cloud.
+//The kernel compacts them into a list of voxel indices + the points per slice, so both the transfers
+//and the host's share of the work go with the size of the fractal's surface, not the volume.
+//
+//The batches rotate through a few sets of point buffers the same way: while a batch is computed, the
+//point counts of the last one come back, and then just as many points. The buffers start out with
+//room for an eighth of the batch's voxels; if a batch has more points than that, it's run again (without
+//the statistics, so they aren't counted twice) once there's enough room.
+template <typename point_t, typename data_t>
+int run_ocl_points(ocl_engine& fractal_engine, const ocl_launch_config& launch_config, fractal_types::pointcloud<point_t, data_t>& pt_cloud, 
+                   const fractal_params& params, const int z_begin, const int z_end, fractal_stats* run_stats = nullptr)
+{
+    FRACTAL_TRACE_SCOPE("ocl_generate_points");
+    if(!fractal_engine.is_ready()) {
+        std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to generate on" << std::endl;
+        return z_begin;
+    }
+    cl_command_queue ocl_command_queue = fractal_engine.get_queue();
+    cl_command_queue ocl_transfer_queue = fractal_engine.get_transfer_queue();
+
+    cl_kernel points_kernel = get_variant_kernel(fractal_engine, launch_config, params, "fractal3d_points");
+    cl_kernel ocl_kernel = run_stats ? get_variant_kernel(fractal_engine, launch_config, params, "fractal3d_points_stats") : points_kernel;
+    if(!points_kernel || !ocl_kernel) {
+        return z_begin;
+    }
+
+    //the points are indices within the batch, so a batch can't have more voxels than fit in 32 bits
+    const size_t slice_voxels = static_cast<size_t>(params.imheight) * params.imwidth;
+    const size_t max_index_slices = std::numeric_limits<cl_uint>::max() / std::max<size_t>(1, slice_voxels);
+    if(max_index_slices == 0)
+    {
+        std::cout << "ERROR @ POINT COMPACTION -- a " << params.imheight << "x" << params.imwidth << " slice has more voxels than the 32-bit point indices cover" << std::endl;
+        return z_begin;
+    }
+    const int batch_slices = static_cast<int>(std::max<size_t>(1, std::min<size_t>(launch_config.get_batch_slices(params), max_index_slices)));
+    std::vector<ocl_points_slot> batch_slots (std::max(1, launch_config.num_buffers));
+    for (size_t slot_idx = 0; slot_idx < batch_slots.size(); ++slot_idx)
+    {
+        ocl_points_slot& batch_slot = batch_slots[slot_idx];
+        batch_slot.max_points = static_cast<cl_uint>(std::max<size_t>(4096, batch_slices * slice_voxels / 8));
+        batch_slot.dev_points = fractal_engine.get_buffer("points_" + std::to_string(slot_idx), batch_slot.max_points * sizeof(cl_uint), CL_MEM_WRITE_ONLY);
+        batch_slot.dev_point_counts = fractal_engine.get_buffer("point_counts_" + std::to_string(slot_idx), batch_slices * sizeof(cl_uint), CL_MEM_READ_WRITE);
+        batch_slot.dev_num_points = fractal_engine.get_buffer("num_points_" + std::to_string(slot_idx), sizeof(cl_uint), CL_MEM_READ_WRITE);
+        if(!batch_slot.dev_points || !batch_slot.dev_point_counts || !batch_slot.dev_num_points) {
+            return z_begin;
+        }
+        batch_slot.h_point_counts.resize(batch_slices);
+    }
+
+    ocl_stats_buffers stats_buffers;
+    if(run_stats && !stats_buffers.setup(fractal_engine, ocl_kernel, 8, params.imdepth)) {
+        return z_begin;
+    }
+
+    const cl_int2 constants = {{static_cast<cl_int>(params.MAX_ITER), static_cast<cl_int>(params.ORDER)}};
+    const cl_int3 dimensions = {{static_cast<cl_int>(params.imheight), static_cast<cl_int>(params.imwidth), static_cast<cl_int>(params.imdepth)}};
+    const cl_float3 flt_constants = {{params.MIN_LIMIT, params.MAX_LIMIT, params.BOUNDARY_VAL}};
+    for (cl_kernel fractal_kernel : {points_kernel, ocl_kernel})
+    {
+        clSetKernelArg(fractal_kernel, 2, sizeof(cl_int3),  (void *)&dimensions);
+        clSetKernelArg(fractal_kernel, 3, sizeof(cl_int2),  (void *)&constants);
+        clSetKernelArg(fractal_kernel, 4, sizeof(cl_float3), (void *)&flt_constants);
+    }
+
+    //whole work-groups, as the groups compact their points together. The statistics kernel's groups
+    //are of a fixed size, the plain one's are of its tuned size (or the same fixed size, untuned)
+    const cl_uint work_dims = 3;
+    ocl_autotuner::local_size_t points_local_size {{ocl_group_dim, ocl_group_dim}};
+    if(!run_stats && launch_config.autotune)
+    {
+        //the probe launches only count the points (there's no room for any), into the first slot's counters
+        const cl_uint no_points = 0;
+        clSetKernelArg(points_kernel, 5, sizeof(cl_mem),  (void *)&batch_slots[0].dev_point_counts);
+        clSetKernelArg(points_kernel, 6, sizeof(cl_mem),  (void *)&batch_slots[0].dev_num_points);
+        clSetKernelArg(points_kernel, 7, sizeof(cl_uint), (void *)&no_points);
+        points_local_size = ocl_autotuner::get_local_size(fractal_engine, points_kernel, "fractal3d_points", launch_config.get_variant(params).get_build_options(), params, 
+                                                          batch_slots[0].dev_points, std::min<int>(batch_slices, ocl_autotuner::max_probe_slices));
+    }
+    size_t points_global_dims [work_dims] = {static_cast<size_t>(params.imheight), static_cast<size_t>(params.imwidth), static_cast<size_t>(batch_slices)};
+    size_t points_local_dims [work_dims];
+    const size_t* points_local_ptr = ocl_autotuner::apply(points_local_size, points_global_dims, points_local_dims);
+    size_t stats_global_dims [work_dims] = {ocl_group_dim * ((params.imheight + ocl_group_dim - 1) / ocl_group_dim), 
+                                            ocl_group_dim * ((params.imwidth + ocl_group_dim - 1) / ocl_group_dim), static_cast<size_t>(batch_slices)};
+    const size_t stats_local_dims [work_dims] = {ocl_group_dim, ocl_group_dim, 1};
+
+    //clears the slot's counters, and runs the kernel over its batch. false if it couldn't be launched
+    auto launch_batch = [&](cl_kernel fractal_kernel, ocl_points_slot& batch_slot)
+    {
+        //NOTE: the host counts are the source of the clears and then the destination of the read-back,
+        //which is fine as the read waits on the kernel, which comes after the clears on the same queue
+        std::fill(batch_slot.h_point_counts.begin(), batch_slot.h_point_counts.end(), 0);
+        batch_slot.h_num_points = 0;
+        clEnqueueWriteBuffer(ocl_command_queue, batch_slot.dev_point_counts, CL_FALSE, 0, batch_slot.num_slices * sizeof(cl_uint), batch_slot.h_point_counts.data(), 0, nullptr, nullptr);
+        clEnqueueWriteBuffer(ocl_command_queue, batch_slot.dev_num_points, CL_FALSE, 0, sizeof(cl_uint), &batch_slot.h_num_points, 0, nullptr, nullptr);
+
+        const bool is_stats_kernel = (fractal_kernel != points_kernel);
+        size_t* global_kernel_dims = is_stats_kernel ? stats_global_dims : points_global_dims;
+        global_kernel_dims[2] = batch_slot.num_slices;
+        clSetKernelArg(fractal_kernel, 0, sizeof(cl_mem),  (void *)&batch_slot.dev_points);
+        clSetKernelArg(fractal_kernel, 1, sizeof(cl_int),  (void *)&batch_slot.depth_idx);
+        clSetKernelArg(fractal_kernel, 5, sizeof(cl_mem),  (void *)&batch_slot.dev_point_counts);
+        clSetKernelArg(fractal_kernel, 6, sizeof(cl_mem),  (void *)&batch_slot.dev_num_points);
+        clSetKernelArg(fractal_kernel, 7, sizeof(cl_uint), (void *)&batch_slot.max_points);
+        auto ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, fractal_kernel, work_dims, nullptr, global_kernel_dims, is_stats_kernel ? stats_local_dims : points_local_ptr, 
+                                                    0, nullptr, &batch_slot.kernel_done);
+        if(ocl_error_num != CL_SUCCESS)
         {
-          auto slice_sum = std::accumulate(&h_image_stack[h_image_stack_offset], &h_image_stack[h_image_stack_offset] + params.imheight * params.imwidth, 0);
-          std::cout << "slice " << depth_idx << " sum: " << slice_sum << std::endl;
+            std::cout << "ERROR @ KERNEL LAUNCH -- " << ocl_error_num << " @depth " << batch_slot.depth_idx << std::endl;
+            return false;
+        }
+        clFlush(ocl_command_queue);
+
+        clEnqueueReadBuffer(ocl_transfer_queue, batch_slot.dev_point_counts, CL_FALSE, 0, batch_slot.num_slices * sizeof(cl_uint), batch_slot.h_point_counts.data(), 
+                            1, &batch_slot.kernel_done, nullptr);
+        ocl_error_num = clEnqueueReadBuffer(ocl_transfer_queue, batch_slot.dev_num_points, CL_FALSE, 0, sizeof(cl_uint), &batch_slot.h_num_points, 
+                                            1, &batch_slot.kernel_done, &batch_slot.counts_read);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << " @depth " << batch_slot.depth_idx << std::endl;
+            return false;
+        }
+        clFlush(ocl_transfer_queue);
+        return true;
+    };
+
+    auto release_events = [](ocl_points_slot& batch_slot)
+    {
+        if(batch_slot.kernel_done) {
+            clReleaseEvent(batch_slot.kernel_done);
+        }
+        if(batch_slot.counts_read) {
+            clReleaseEvent(batch_slot.counts_read);
+        }
+        batch_slot.kernel_done = nullptr;
+        batch_slot.counts_read = nullptr;
+    };
+
+    //the first slice of the first batch that failed. The points have to stay in z order, so nothing
+    //from there on is kept, and the range ends short of z_end (which fails the request)
+    int stop_depth = z_end;
+    //drops a batch, once the device is done with its buffers
+    auto discard_slot = [&](ocl_points_slot& batch_slot)
+    {
+        clFinish(ocl_command_queue);
+        clFinish(ocl_transfer_queue);
+        release_events(batch_slot);
+        batch_slot.num_slices = 0;
+    };
+
+    //brings a batch's points back, and appends them to the point cloud in the same order as the
+    //host-side extraction (i.e. by slice, row, column)
+    const data_t point_value = static_cast<data_t>(fractal_params::MAX_ITER - 1);
+    std::vector<cl_uint> h_points;
+    std::vector<cl_uint> sorted_points;
+    auto last_landed = std::chrono::high_resolution_clock::now();
+    auto drain_slot = [&](ocl_points_slot& batch_slot)
+    {
+        FRACTAL_TRACE_SCOPE_ARG("ocl_readback", batch_slot.depth_idx);
+        if(batch_slot.depth_idx >= stop_depth)
+        {
+            discard_slot(batch_slot);
+            return;
+        }
+        clWaitForEvents(1, &batch_slot.counts_read);
+        if(batch_slot.h_num_points > batch_slot.max_points)
+        {
+            //too many points to fit, so it's run again with enough room. The buffer stays this big for
+            //the rest of the request (and the engine keeps it for the next ones)
+            release_events(batch_slot);
+            batch_slot.max_points = static_cast<cl_uint>(std::min<uint64_t>(std::numeric_limits<cl_uint>::max(), uint64_t(batch_slot.h_num_points) + batch_slot.h_num_points / 4));
+            batch_slot.dev_points = fractal_engine.get_buffer("points_" + std::to_string(&batch_slot - batch_slots.data()), batch_slot.max_points * sizeof(cl_uint), CL_MEM_WRITE_ONLY);
+            if(!batch_slot.dev_points || !launch_batch(points_kernel, batch_slot)) 
+            {
+                stop_depth = std::min(stop_depth, batch_slot.depth_idx);
+                discard_slot(batch_slot);
+                return;
+            }
+            clWaitForEvents(1, &batch_slot.counts_read);
+        }
+
+        h_points.resize(batch_slot.h_num_points);
+        if(!h_points.empty())
+        {
+            auto ocl_error_num = clEnqueueReadBuffer(ocl_transfer_queue, batch_slot.dev_points, CL_TRUE, 0, h_points.size() * sizeof(cl_uint), h_points.data(), 0, nullptr, nullptr);
+            if(ocl_error_num != CL_SUCCESS)
+            {
+                std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << " @depth " << batch_slot.depth_idx << std::endl;
+                stop_depth = std::min(stop_depth, batch_slot.depth_idx);
+                discard_slot(batch_slot);
+                return;
+            }
+        }
+        release_events(batch_slot);
+
+        //the groups append in whatever order they finish, so the points get bucketed by slice (the
+        //per-slice counts give where each slice's points start), and then sorted within each slice
+        std::vector<size_t> slice_offsets (batch_slot.num_slices + 1, 0);
+        for (int slice_idx = 0; slice_idx < batch_slot.num_slices; ++slice_idx) {
+            slice_offsets[slice_idx + 1] = slice_offsets[slice_idx] + batch_slot.h_point_counts[slice_idx];
+        }
+        sorted_points.resize(h_points.size());
+        std::vector<size_t> slice_fill (slice_offsets.begin(), slice_offsets.end() - 1);
+        for (const cl_uint point_idx : h_points) {
+            sorted_points[slice_fill[point_idx / slice_voxels]++] = point_idx;
+        }
+
+        pt_cloud.cloud.reserve(pt_cloud.cloud.size() + sorted_points.size());
+        for (int slice_idx = 0; slice_idx < batch_slot.num_slices; ++slice_idx)
+        {
+            std::sort(sorted_points.begin() + slice_offsets[slice_idx], sorted_points.begin() + slice_offsets[slice_idx + 1]);
+            for (size_t point_pos = slice_offsets[slice_idx]; point_pos < slice_offsets[slice_idx + 1]; ++point_pos)
+            {
+                const size_t slice_point = sorted_points[point_pos] - slice_idx * slice_voxels;
+                pt_cloud.emplace_back(static_cast<int>(slice_point % params.imwidth), static_cast<int>(slice_point / params.imwidth), batch_slot.depth_idx + slice_idx, point_value);
+            }
+        }
+
+        auto landed = std::chrono::high_resolution_clock::now();
+        if(run_stats)
+        {
+            const double batch_ms = std::chrono::duration<double, std::milli>(landed - last_landed).count();
+            for (int slice_idx = batch_slot.depth_idx; slice_idx < batch_slot.depth_idx + batch_slot.num_slices; ++slice_idx) {
+                run_stats->slice_ms[slice_idx] += batch_ms / batch_slot.num_slices;
+            }
+        }
+        last_landed = landed;
+        params.cancel_token.report_slices(batch_slot.depth_idx, batch_slot.depth_idx + batch_slot.num_slices, nullptr);
+        batch_slot.num_slices = 0;
+    };
+
+    size_t batch_idx = 0;
+    cl_int depth_idx = z_begin;
+    for (; depth_idx < z_end; depth_idx += batch_slices, ++batch_idx)
+    {
+        if(params.cancel_token.should_stop()) {
+            std::cout << "Fractal generation stopped @depth " << depth_idx << std::endl;
+            break;
+        }
+        FRACTAL_TRACE_SCOPE_ARG("ocl_batch", depth_idx);
+
+        ocl_points_slot& batch_slot = batch_slots[batch_idx % batch_slots.size()];
+        if(batch_slot.num_slices > 0) {
+            drain_slot(batch_slot);
+        }
+        if(stop_depth < z_end) {
+            break;
+        }
+        batch_slot.depth_idx = depth_idx;
+        batch_slot.num_slices = std::min(batch_slices, z_end - depth_idx);
+        if(!launch_batch(ocl_kernel, batch_slot))
+        {
+            stop_depth = depth_idx;
+            discard_slot(batch_slot);
+            break;
+        }
+    }
+
+    //the batches still in flight, oldest first (so the points stay in order)
+    for (size_t drain_idx = 0; drain_idx < batch_slots.size(); ++drain_idx)
+    {
+        ocl_points_slot& batch_slot = batch_slots[(batch_idx + drain_idx) % batch_slots.size()];
+        if(batch_slot.num_slices > 0) {
+            drain_slot(batch_slot);
         }
     }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration<double, std::milli>(end - start);
-    std::cout << "Fractal Generation Time: " << duration.count() << " ms" << std::endl;
+    if(run_stats) {
+        stats_buffers.read_back(ocl_command_queue, *run_stats);
+    }
+    return std::min<int>(std::min<int>(depth_idx, z_end), stop_depth);
+}
 
-    clReleaseKernel(ocl_kernel);
-    clReleaseProgram(ocl_program);
-    clReleaseMemObject(dev_image);
-    clReleaseCommandQueue(ocl_command_queue);
-    clReleaseContext(ocl_context);
+//Evaluates the plane's grid of points (see slice_plane) into image, row-major, with the pixels in the
+//same convention as the stack's. It's one launch + one read of a plane's worth of pixels (rather than
+//a whole stack), so it's quick enough to redo as the plane moves. There's nothing to tune the launch
+//on, but it's the same iterations as fractal3d, so the kernel borrows fractal3d's tuned work-group
+//shape if the device has one. Returns false if the slice couldn't be generated
+template <typename data_t>
+bool run_ocl_slice(ocl_engine& fractal_engine, const ocl_launch_config& launch_config, std::vector<data_t>& image, const fractal_params& params, const slice_plane& plane)
+{
+  FRACTAL_TRACE_SCOPE("ocl_slice_plane");
+  using cldata_t = cl_uchar;
+  image.assign(plane.num_pixels(), 0);
+  if(!fractal_engine.is_ready()) {
+    std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to generate on" << std::endl;
+    return false;
+  }
+  if(plane.num_pixels() == 0) {
+    return true;
+  }
+
+  cl_kernel ocl_kernel = get_variant_kernel(fractal_engine, launch_config, params, "fractal3d_slice");
+  if(!ocl_kernel) {
+    return false;
+  }
+  cl_mem dev_image = fractal_engine.get_buffer("slice_image", plane.num_pixels() * sizeof(cldata_t), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR);
+  if(!dev_image) {
+    return false;
+  }
+
+  //NOTE: the plane is in {x, y, z}, the kernel wants the stack's {row, column, depth}
+  const cl_float3 origin = {{plane.origin[1], plane.origin[0], plane.origin[2]}};
+  const cl_float3 col_axis = {{plane.u_axis[1], plane.u_axis[0], plane.u_axis[2]}};
+  const cl_float3 row_axis = {{plane.v_axis[1], plane.v_axis[0], plane.v_axis[2]}};
+  const cl_int2 dimensions = {{static_cast<cl_int>(plane.height), static_cast<cl_int>(plane.width)}};
+  const cl_int2 constants = {{static_cast<cl_int>(params.MAX_ITER), static_cast<cl_int>(params.ORDER)}};
+  const cl_float boundary_val = params.BOUNDARY_VAL;
+
+  clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem), (void *)&dev_image);
+  clSetKernelArg(ocl_kernel, 1, sizeof(cl_float3), (void *)&origin);
+  clSetKernelArg(ocl_kernel, 2, sizeof(cl_float3), (void *)&col_axis);
+  clSetKernelArg(ocl_kernel, 3, sizeof(cl_float3), (void *)&row_axis);
+  clSetKernelArg(ocl_kernel, 4, sizeof(cl_int2), (void *)&dimensions);
+  clSetKernelArg(ocl_kernel, 5, sizeof(cl_int2), (void *)&constants);
+  clSetKernelArg(ocl_kernel, 6, sizeof(cl_float), (void *)&boundary_val);
+
+  size_t global_kernel_dims [3] = {static_cast<size_t>(plane.height), static_cast<size_t>(plane.width), 1};
+  size_t tuned_local_dims [3];
+  const size_t* local_kernel_dims = nullptr;
+  ocl_autotuner::local_size_t local_size {{0, 0}};
+  if(launch_config.autotune && fractal_engine.get_tuned_size("fractal3d " + launch_config.get_variant(params).get_build_options(), local_size)) {
+    local_kernel_dims = ocl_autotuner::apply(local_size, global_kernel_dims, tuned_local_dims);
+  }
+
+  cl_command_queue ocl_command_queue = fractal_engine.get_queue();
+  auto ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, 3, nullptr, global_kernel_dims, local_kernel_dims, 0, nullptr, nullptr);
+  if(ocl_error_num != CL_SUCCESS)
+  {
+    std::cout << "ERROR @ KERNEL LAUNCH -- " << ocl_error_num << " -- slice " << plane.width << "x" << plane.height << std::endl;
+    return false;
+  }
+  ocl_error_num = clEnqueueReadBuffer(ocl_command_queue, dev_image, CL_TRUE, 0, plane.num_pixels() * sizeof(cldata_t), image.data(), 0, nullptr, nullptr);
+  if(ocl_error_num != CL_SUCCESS)
+  {
+    std::cout << "ERROR @ DATA RETRIEVE -- " << ocl_error_num << " -- slice " << plane.width << "x" << plane.height << std::endl;
+    return false;
+  }
+  return true;
 }
 
 #endif
@@ -1,6 +1,6 @@
-// fractal2d.cl -- part of the OpenCL fractal3d implementation 
+// fractal2d.cl -- part of the OpenCL fractal3d implementation
 //
-// Copyright (C) 2015 Alrik Firl 
+// Copyright (C) 2015 Alrik Firl
 //
 // This software may be modified and distributed under the terms
 // of the MIT license.  See the LICENSE file for details.
@@ -8,29 +8,50 @@
 
 
 
+//the precision of the deep-zoom deltas: float unless built with -DUSE_DOUBLE (needs cl_khr_fp64)
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real_t;
+typedef double2 real2;
+#else
+typedef float real_t;
+typedef float2 real2;
+#endif
 
+//one launch renders a batch of preview tiles: the third NDRange dimension is the tile, and the rows +
+//columns cover the biggest tile of the batch (the work-items past the edge of a smaller tile do nothing).
+//Each tile has its viewport of the complex plane ({min real, min imag, max real, max imag}, the top row
+//being max imag) and its layout ({rows, columns, offset of its first pixel in image}). The viewport is
+//half-open, [min real, max real) x (min imag, max imag], so the tiles of a grid don't overlap: the pixel
+//past the last column is the first column of the next tile over. The pixels are the iteration counts in
+//the same convention as fractal3d, i.e. max(0, iterations-1) clamped to a byte
 __kernel void fractal2d
-         (__global uint* image,
-          const float4 limits,
-          const float2 factor,
+         (__global unsigned char* restrict image,
+          __global const float4* restrict viewports,
+          __global const int4* restrict layouts,
           const float BOUNDARY_VAL,
-          const int imwidth,
           const int MAX_ITER)
 {
-    const int tid = get_global_id(0);
-    int row_idx = tid / imwidth;
-    int col_idx = tid % imwidth;
+    const int row_idx = get_global_id(0);
+    const int col_idx = get_global_id(1);
+    const int4 layout = layouts[get_global_id(2)];
+    if(row_idx >= layout.s0 || col_idx >= layout.s1)
+        return;
+
+    const float4 limits = viewports[get_global_id(2)];
+    const float2 factor = (float2)((limits.s2 - limits.s0) / layout.s1, (limits.s3 - limits.s1) / layout.s0);
 
     float Zfactor_imag = limits.s3 - row_idx * factor.s1;
     float Zfactor_real = limits.s0 + col_idx * factor.s0;
-    
+
     float Zi = Zfactor_imag;
     float Zr = Zfactor_real;
-  
+    const float boundary_sq = BOUNDARY_VAL * BOUNDARY_VAL;
+
     int iter_num = 0;
     for (iter_num = 0; iter_num < MAX_ITER; ++iter_num)
     {
-        if(sqrt(Zr * Zr + Zi * Zi) > BOUNDARY_VAL)
+        if(Zr * Zr + Zi * Zi > boundary_sq)
             break;
 
         float real_tmp = Zr * Zr - Zi * Zi;
@@ -38,7 +59,62 @@ __kernel void fractal2d
         Zr = real_tmp + Zfactor_real;
         Zi = imag_tmp + Zfactor_imag;
     }
-    image[tid] = iter_num;
+    image[layout.s2 + row_idx * layout.s1 + col_idx] = max(0, clamp(iter_num, 0, 255)-1);
 }
 
+//-----------------------------------------------------------------------------------------------------
+//deep zoom: every pixel iterates its difference from the reference orbit (computed on the host at high
+//precision, see util/deep_zoom.hpp) rather than its own value, starting from the series approximation
+//at skip_iter. Where the reference is no good for the pixel (|z| < |delta|, or the reference ran out) it
+//rebases onto the start of the orbit. iterations gets the first n with |z[n]| > 2 (max_iter for the
+//interior), row-major with the top row at the highest imaginary part.
+//The series coefficients come scaled to the pixel offset (A * spacing, B * spacing^2, C * spacing^3), as
+//deep in a zoom the plain ones are well past what a float can hold, while the scaled terms stay < 2
+__kernel void fractal2d_perturb
+         (__global uint* restrict iterations,
+          __global const real2* restrict orbit,
+          const int orbit_size,
+          const int2 dimensions,
+          const real_t pixel_spacing,
+          const real2 series_A,
+          const real2 series_B,
+          const real2 series_C,
+          const int skip_iter,
+          const int max_iter)
+{
+    const int row_idx = get_global_id(0);
+    const int col_idx = get_global_id(1);
+    if(row_idx >= dimensions.s0 || col_idx >= dimensions.s1)
+        return;
+
+    //the offset from the centre, in pixels
+    const real2 offset = (real2)(col_idx - (real_t)0.5 * dimensions.s1, (real_t)0.5 * dimensions.s0 - row_idx);
+    const real2 dc = offset * pixel_spacing;
+
+    //delta = ((C offset + B) offset + A) offset
+    real2 series_sum = (real2)(series_C.x * offset.x - series_C.y * offset.y, series_C.x * offset.y + series_C.y * offset.x) + series_B;
+    series_sum = (real2)(series_sum.x * offset.x - series_sum.y * offset.y, series_sum.x * offset.y + series_sum.y * offset.x) + series_A;
+    real2 delta = (real2)(series_sum.x * offset.x - series_sum.y * offset.y, series_sum.x * offset.y + series_sum.y * offset.x);
 
+    int ref_idx = skip_iter;
+    int iter_num = skip_iter;
+    for (; iter_num < max_iter; ++iter_num)
+    {
+        const real2 z = orbit[ref_idx] + delta;
+        const real_t z_mag = dot(z, z);
+        if(z_mag > 4)
+            break;
+
+        if(z_mag < dot(delta, delta) || ref_idx == orbit_size - 1)
+        {
+            delta = z;
+            ref_idx = 0;
+        }
+
+        //delta = (2 Z + delta) delta + dc
+        const real2 factor = 2 * orbit[ref_idx] + delta;
+        delta = (real2)(factor.x * delta.x - factor.y * delta.y, factor.x * delta.y + factor.y * delta.x) + dc;
+        ++ref_idx;
+    }
+    iterations[row_idx * dimensions.s1 + col_idx] = iter_num;
+}
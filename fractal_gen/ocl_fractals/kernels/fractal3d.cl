@@ -9,26 +9,121 @@
 
 
 
-float4 juliabulb(const float3 dim_limits, const float r, const float theta, const float phi)
+//-----------------------------------------------------------------------------------------------------
+//the kernel variants (see ocl_kernel_variants.hpp) are built with their constants as macros:
+//  FRACTALID          MANDELBROT or JULIA
+//  FRACTAL_ORDER      the power of the bulb
+//  FRACTAL_MAX_ITER   the iteration limit
+//  USE_DOUBLE         the iterations in double rather than single precision
+//  JULIA_C0/C1/C2     the constant of the julia set
+//Without them, the kernels fall back on mandelbrot, and take the order + iteration limit from INT_CONSTANTS.
+//Baked in, the compiler can fold the powers and the loop bounds
+
+#define MANDELBROT 0
+#define JULIA 1
+
+#ifndef FRACTALID
+#define FRACTALID MANDELBROT
+#endif
+
+#ifdef FRACTAL_ORDER
+#define GET_ORDER(INT_CONSTANTS) FRACTAL_ORDER
+#else
+#define GET_ORDER(INT_CONSTANTS) (INT_CONSTANTS).s1
+#endif
+
+#ifdef FRACTAL_MAX_ITER
+#define GET_MAX_ITER(INT_CONSTANTS) FRACTAL_MAX_ITER
+#else
+#define GET_MAX_ITER(INT_CONSTANTS) (INT_CONSTANTS).s0
+#endif
+
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real_t;
+typedef double3 real3;
+#else
+typedef float real_t;
+typedef float3 real3;
+#endif
+
+#ifndef JULIA_C0
+#define JULIA_C0 0.353
+#define JULIA_C1 0.288
+#define JULIA_C2 0.2
+#endif
+
+//one step of the bulb: the point raised to the order's power (in spherical coordinates), plus the offset
+//(the voxel's position for the mandelbulb, the set's constant for the juliabulb)
+real3 bulb_step(const real3 offset, const real_t r_pow, const real_t theta, const real_t phi)
 {
-    float4 out_coords;
-    out_coords.s3 = r * r * r * r * r * r * r * r;
-    out_coords.s0 = dim_limits.s0 + out_coords.s3 * cos(theta) * cos(phi) + 0.353;
-    out_coords.s1 = dim_limits.s1 + out_coords.s3 * sin(theta) * cos(phi) + 0.288;
-    out_coords.s2 = dim_limits.s2 + out_coords.s3 * sin(phi) + 0.2;
+    real3 out_coords;
+    out_coords.s0 = offset.s0 + r_pow * cos(theta) * cos(phi);
+    out_coords.s1 = offset.s1 + r_pow * sin(theta) * cos(phi);
+    out_coords.s2 = offset.s2 + r_pow * sin(phi);
     return out_coords;
 }
 
-float4 mandelbulb(const float3 dim_limits, const float r, const float theta, const float phi)
+real3 juliabulb(const real_t r_pow, const real_t theta, const real_t phi)
 {
-    float4 out_coords;
-    out_coords.s3 = r * r * r * r * r * r * r * r;
-    out_coords.s0 = dim_limits.s0 + out_coords.s3 * cos(theta) * cos(phi);
-    out_coords.s1 = dim_limits.s1 + out_coords.s3 * sin(theta) * cos(phi);
-    out_coords.s2 = dim_limits.s2 + out_coords.s3 * sin(phi);
-    return out_coords;
+    return bulb_step((real3)(JULIA_C0, JULIA_C1, JULIA_C2), r_pow, theta, phi);
+}
+
+real3 mandelbulb(const real3 dim_limits, const real_t r_pow, const real_t theta, const real_t phi)
+{
+    return bulb_step(dim_limits, r_pow, theta, phi);
+}
+
+//the number of iterations evaluated for the point at dim_limits ({row, column, depth} axes); the iteration
+//limit (i.e. MAX_ITER) --> never escaped
+int point_iterations(const real3 dim_limits, const int2 INT_CONSTANTS, const real_t BOUNDARY_VAL)
+{
+    const int ORDER = GET_ORDER(INT_CONSTANTS);
+    const int MAX_ITER = GET_MAX_ITER(INT_CONSTANTS);
+
+    //the mandelbulb starts every voxel at the origin, the juliabulb at the voxel itself
+#if FRACTALID == JULIA
+    real3 coords = dim_limits;
+#else
+    real3 coords = (real3)(0, 0, 0);
+#endif
+
+    int iter_num = 0;
+    for (iter_num = 0; iter_num < MAX_ITER; ++iter_num)
+    {
+        const real_t r = sqrt(coords.s0 * coords.s0 + coords.s1 * coords.s1 + coords.s2 * coords.s2);
+        if(r > BOUNDARY_VAL)
+            break;
+
+        const real_t theta = ORDER * atan2(sqrt(coords.s0 * coords.s0 + coords.s1 * coords.s1), coords.s2);
+        const real_t phi =   ORDER * atan2(coords.s0, coords.s1);
+        const real_t r_pow = pown(r, ORDER);
+
+#if FRACTALID == JULIA
+        coords = juliabulb(r_pow, theta, phi);
+#else
+        coords = mandelbulb(dim_limits, r_pow, theta, phi);
+#endif
+    }
+    return iter_num;
 }
 
+//the number of iterations evaluated for the voxel at (row, col, depth_idx)
+int fractal_iterations(const int row, const int col, const int depth_idx, const int3 dimensions, const int2 INT_CONSTANTS, const float3 FLT_CONSTANTS)
+{
+    const real_t MIN_LIMIT = FLT_CONSTANTS.s0;
+    const real_t MAX_LIMIT = FLT_CONSTANTS.s1;
+
+    real3 dim_limits;
+    dim_limits.s0 = MIN_LIMIT + row * ((MAX_LIMIT - MIN_LIMIT) / dimensions.s0);
+    dim_limits.s1 = MIN_LIMIT + col * ((MAX_LIMIT - MIN_LIMIT) / dimensions.s1);
+    dim_limits.s2 = MIN_LIMIT + depth_idx * ((MAX_LIMIT - MIN_LIMIT) / dimensions.s2);
+    return point_iterations(dim_limits, INT_CONSTANTS, FLT_CONSTANTS.s2);
+}
+
+//one launch covers a batch of slices: the third NDRange dimension is the slice within the batch (a 2D
+//launch is a batch of one), depth_idx is the first slice of the batch, and the image holds the whole batch.
+//The rows + columns can be padded up to whole work-groups (of the tuned size), so the padding is skipped
 __kernel void fractal3d
          (__global unsigned char* restrict image,
           const int depth_idx,
@@ -36,39 +131,232 @@ __kernel void fractal3d
           const int2 INT_CONSTANTS,
           const float3 FLT_CONSTANTS)
 {
-    const float MIN_LIMIT = FLT_CONSTANTS.s0;
-    const float MAX_LIMIT = FLT_CONSTANTS.s1;
-    const int ORDER = INT_CONSTANTS.s1;
+    if(get_global_id(0) >= dimensions.s0 || get_global_id(1) >= dimensions.s1)
+        return;
 
-    float3 dim_limits;
-    dim_limits.s0 = MIN_LIMIT + get_global_id(0) * ((MAX_LIMIT - MIN_LIMIT) / dimensions.s0);
-    dim_limits.s1 = MIN_LIMIT + get_global_id(1) * ((MAX_LIMIT - MIN_LIMIT) / dimensions.s1);
-    dim_limits.s2 = MIN_LIMIT + depth_idx * ((MAX_LIMIT - MIN_LIMIT) / dimensions.s2);
+    int iter_num = fractal_iterations(get_global_id(0), get_global_id(1), depth_idx + get_global_id(2), dimensions, INT_CONSTANTS, FLT_CONSTANTS);
+
+		iter_num = clamp(iter_num, 0, 255);
+    image[(get_global_id(2) * dimensions.s0 + get_global_id(0)) * dimensions.s1 + get_global_id(1)] = max(0, iter_num-1);
+}
+
+//-----------------------------------------------------------------------------------------------------
+//statistics mode: same image as fractal3d, plus the iteration histogram, the iterations per slice and
+//the bounding box of the interior voxels. Each work-group reduces its share in local memory first, so
+//there's only a handful of global atomics per group rather than per voxel
+
+#define STATS_GROUP_DIM 16
+#define STATS_GROUP_SIZE (STATS_GROUP_DIM * STATS_GROUP_DIM)
+//NOTE: the local histogram is cleared with one bin per work-item, so it can't have more bins than that
+#define STATS_NUM_BINS 256
 
-    float4 coords;
-    coords.s0 = 0.0f;
-    coords.s1 = 0.0f;
-    coords.s2 = 0.0f;
-    coords.s3 = 0.0f;
+//adds the voxel to the group's share of the statistics, and once the whole group has, the group's
+//share to the totals. Every work-item of the group has to call it (it has barriers); in_image is
+//false for the padding past the image edges
+void reduce_stats(const int iter_num, const bool in_image, const int row, const int col, const int slice_idx, const int max_iter,
+                  __local uint* local_histogram, __local uint* local_iterations, __local int4* local_bounds,
+                  __global uint* histogram, __global uint* slice_iterations, __global int* bounds)
+{
+    const int local_idx = get_local_id(0) * STATS_GROUP_DIM + get_local_id(1);
+    local_histogram[local_idx] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint iterations = 0;
+    int4 voxel_bounds = (int4)(INT_MAX, INT_MAX, -1, -1);
+    if(in_image)
+    {
+        iterations = iter_num;
+        atomic_inc(&local_histogram[min(iter_num, STATS_NUM_BINS-1)]);
+        if(iter_num >= max_iter)
+            voxel_bounds = (int4)(col, row, col, row);
+    }
+    local_iterations[local_idx] = iterations;
+    local_bounds[local_idx] = voxel_bounds;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    float r = 0.0f;
-    float theta = 0.0f;
-    float phi = 0.0f;
+    for (int stride = STATS_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+    {
+        if(local_idx < stride)
+        {
+            local_iterations[local_idx] += local_iterations[local_idx + stride];
+            const int4 other_bounds = local_bounds[local_idx + stride];
+            local_bounds[local_idx] = (int4)(min(local_bounds[local_idx].s01, other_bounds.s01), max(local_bounds[local_idx].s23, other_bounds.s23));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(local_histogram[local_idx] > 0)
+        atomic_add(&histogram[local_idx], local_histogram[local_idx]);
+
+    if(local_idx == 0)
+    {
+        atomic_add(&slice_iterations[slice_idx], local_iterations[0]);
+        const int4 group_bounds = local_bounds[0];
+        if(group_bounds.s2 >= 0)
+        {
+            atomic_min(&bounds[0], group_bounds.s0);
+            atomic_min(&bounds[1], group_bounds.s1);
+            atomic_min(&bounds[2], slice_idx);
+            atomic_max(&bounds[3], group_bounds.s2);
+            atomic_max(&bounds[4], group_bounds.s3);
+            atomic_max(&bounds[5], slice_idx);
+        }
+    }
+}
+
+//the global size is padded up to whole work-groups, the work-items past the image edges only join in the reductions.
+//Batches of slices work the same as with fractal3d (the work-groups are one slice deep).
+//bounds is {min x, min y, min z, max x, max y, max z}, with x the column, y the row and z the slice
+__kernel __attribute__((reqd_work_group_size(STATS_GROUP_DIM, STATS_GROUP_DIM, 1)))
+void fractal3d_stats
+         (__global unsigned char* restrict image,
+          const int depth_idx,
+          const int3 dimensions,
+          const int2 INT_CONSTANTS,
+          const float3 FLT_CONSTANTS,
+          __global uint* restrict histogram,
+          __global uint* restrict slice_iterations,
+          __global int* restrict bounds)
+{
+    __local uint local_histogram[STATS_NUM_BINS];
+    __local uint local_iterations[STATS_GROUP_SIZE];
+    //{min col, min row, max col, max row}
+    __local int4 local_bounds[STATS_GROUP_SIZE];
+
+    const int row = get_global_id(0);
+    const int col = get_global_id(1);
+    const int slice_idx = depth_idx + get_global_id(2);
+    const bool in_image = row < dimensions.s0 && col < dimensions.s1;
     int iter_num = 0;
-    int i = 0;
-    for (iter_num = 0; iter_num < INT_CONSTANTS.s0; ++iter_num)
+    if(in_image)
     {
-        r = sqrt(coords.s0 * coords.s0 + coords.s1 * coords.s1 + coords.s2 * coords.s2);
-        if(r > FLT_CONSTANTS.s2)
-            break;
+        iter_num = fractal_iterations(row, col, slice_idx, dimensions, INT_CONSTANTS, FLT_CONSTANTS);
+        image[(get_global_id(2) * dimensions.s0 + row) * dimensions.s1 + col] = max(0, clamp(iter_num, 0, 255)-1);
+    }
+    reduce_stats(iter_num, in_image, row, col, slice_idx, GET_MAX_ITER(INT_CONSTANTS), local_histogram, local_iterations, local_bounds, histogram, slice_iterations, bounds);
+}
+
+//-----------------------------------------------------------------------------------------------------
+//compaction mode: rather than the image, only the voxels that make it into the point cloud (the ones
+//that never escaped) come out, as their index within the batch ((slice * rows + row) * columns + col).
+//The group counts its points in local memory, and reserves room for all of them with one global
+//atomic, so the order of the points is only fixed within a group. point_counts gets the points per
+//slice of the batch, and num_points the total -- which can be more than max_points, in which case
+//the points past max_points were dropped and the batch has to be run again with more room
 
-        theta = ORDER * atan2(sqrt(coords.s0 * coords.s0 + coords.s1 * coords.s1), coords.s2);
-        phi =   ORDER * atan2(coords.s0, coords.s1);
-          
-				coords = mandelbulb(dim_limits, r, theta, phi);  
+//the index of the work-item's voxel within the batch. It's a uint, same as the points buffer: the host
+//keeps a batch's voxels within 32 bits, but not within 31
+uint batch_point_idx(const int row, const int col, const int3 dimensions)
+{
+    return ((uint)get_global_id(2) * (uint)dimensions.s0 + (uint)row) * (uint)dimensions.s1 + (uint)col;
+}
+
+//every work-item of the group has to call it (it has barriers)
+void append_point(const bool is_point, const uint point_idx, const int batch_slice, __local uint* local_count, __local uint* group_offset,
+                  __global uint* points, __global uint* point_counts, __global uint* num_points, const uint max_points)
+{
+    if(get_local_id(0) == 0 && get_local_id(1) == 0)
+        *local_count = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint local_offset = 0;
+    if(is_point)
+        local_offset = atomic_inc(local_count);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(get_local_id(0) == 0 && get_local_id(1) == 0 && *local_count > 0)
+    {
+        *group_offset = atomic_add(num_points, *local_count);
+        atomic_add(&point_counts[batch_slice], *local_count);
     }
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-		iter_num = clamp(iter_num, 0, 255);
-    image[get_global_id(0) * dimensions.s1 + get_global_id(1)] = max(0, iter_num-1);
-}                      
+    if(is_point && *group_offset + local_offset < max_points)
+        points[*group_offset + local_offset] = point_idx;
+}
 
+//the group only shares its counters, so (unlike the statistics kernels) it runs at any work-group size
+__kernel void fractal3d_points
+         (__global uint* restrict points,
+          const int depth_idx,
+          const int3 dimensions,
+          const int2 INT_CONSTANTS,
+          const float3 FLT_CONSTANTS,
+          __global uint* restrict point_counts,
+          __global uint* restrict num_points,
+          const uint max_points)
+{
+    __local uint local_count;
+    __local uint group_offset;
+
+    const int row = get_global_id(0);
+    const int col = get_global_id(1);
+    const bool in_image = row < dimensions.s0 && col < dimensions.s1;
+    bool is_point = false;
+    if(in_image)
+        is_point = fractal_iterations(row, col, depth_idx + get_global_id(2), dimensions, INT_CONSTANTS, FLT_CONSTANTS) >= GET_MAX_ITER(INT_CONSTANTS);
+
+    append_point(is_point, batch_point_idx(row, col, dimensions), get_global_id(2), &local_count, &group_offset, 
+                 points, point_counts, num_points, max_points);
+}
+
+//both of the above: the points, and the statistics of all the voxels
+__kernel __attribute__((reqd_work_group_size(STATS_GROUP_DIM, STATS_GROUP_DIM, 1)))
+void fractal3d_points_stats
+         (__global uint* restrict points,
+          const int depth_idx,
+          const int3 dimensions,
+          const int2 INT_CONSTANTS,
+          const float3 FLT_CONSTANTS,
+          __global uint* restrict point_counts,
+          __global uint* restrict num_points,
+          const uint max_points,
+          __global uint* restrict histogram,
+          __global uint* restrict slice_iterations,
+          __global int* restrict bounds)
+{
+    __local uint local_count;
+    __local uint group_offset;
+    __local uint local_histogram[STATS_NUM_BINS];
+    __local uint local_iterations[STATS_GROUP_SIZE];
+    __local int4 local_bounds[STATS_GROUP_SIZE];
+
+    const int row = get_global_id(0);
+    const int col = get_global_id(1);
+    const int slice_idx = depth_idx + get_global_id(2);
+    const bool in_image = row < dimensions.s0 && col < dimensions.s1;
+    int iter_num = 0;
+    if(in_image)
+        iter_num = fractal_iterations(row, col, slice_idx, dimensions, INT_CONSTANTS, FLT_CONSTANTS);
+
+    append_point(in_image && iter_num >= GET_MAX_ITER(INT_CONSTANTS), batch_point_idx(row, col, dimensions), get_global_id(2), 
+                 &local_count, &group_offset, points, point_counts, num_points, max_points);
+    reduce_stats(iter_num, in_image, row, col, slice_idx, GET_MAX_ITER(INT_CONSTANTS), local_histogram, local_iterations, local_bounds, histogram, slice_iterations, bounds);
+}
+
+//-----------------------------------------------------------------------------------------------------
+//cross-section mode: a plane's grid of points (see slice_plane) rather than the stack's, into a
+//dimensions.s0 x dimensions.s1 image, same pixels as fractal3d. The origin + axes come in the kernel's
+//{row, column, depth} order, and the steps between the pixels are worked out the same way as the
+//stack's, so the plane of a stack slice lands on exactly its voxels
+__kernel void fractal3d_slice
+         (__global unsigned char* restrict image,
+          const float3 origin,
+          const float3 col_axis,
+          const float3 row_axis,
+          const int2 dimensions,
+          const int2 INT_CONSTANTS,
+          const float BOUNDARY_VAL)
+{
+    const int row = get_global_id(0);
+    const int col = get_global_id(1);
+    if(row >= dimensions.s0 || col >= dimensions.s1)
+        return;
+
+    const real3 col_step = (real3)(col_axis.s0, col_axis.s1, col_axis.s2) / dimensions.s1;
+    const real3 row_step = (real3)(row_axis.s0, row_axis.s1, row_axis.s2) / dimensions.s0;
+    const real3 dim_limits = (real3)(origin.s0, origin.s1, origin.s2) + col * col_step + row * row_step;
+
+    const int iter_num = clamp(point_iterations(dim_limits, INT_CONSTANTS, BOUNDARY_VAL), 0, 255);
+    image[row * dimensions.s1 + col] = max(0, iter_num-1);
+}
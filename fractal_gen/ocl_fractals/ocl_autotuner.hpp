@@ -0,0 +1,148 @@
+/* ocl_autotuner.hpp -- part of the OpenCL fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+
+#ifndef OCL_FRACTALS_AUTOTUNER_HPP
+#define OCL_FRACTALS_AUTOTUNER_HPP
+
+#include <CL/cl.hpp>
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+#include "util/fractal_helpers.hpp"
+#include "ocl_engine.hpp"
+
+/* Picks the work-group shape of a kernel by trying them out. Which shape is fastest depends on the
+ * device (SIMD width, cache lines, how it schedules the groups) as well as on the kernel variant, so
+ * rather than leaving it to the driver's guess, each candidate gets a few timed launches over some
+ * slices of the first request that needs the kernel. The winner is kept in the engine's tuning file
+ * (one per device, next to the cached binaries), so that's only ever done once per device + variant;
+ * deleting the file makes it tune again.
+ *
+ * Only the kernels without a fixed work-group size get tuned (fractal3d and fractal3d_points); the
+ * statistics kernels reduce in local memory laid out for their reqd_work_group_size.
+ */
+struct ocl_autotuner
+{
+  //timed launches per candidate (after a warm-up), and the most slices the probe launches cover
+  enum { num_timed_launches = 2, max_probe_slices = 4 };
+
+  //{rows, columns} per work-group. {0, 0} is the driver's pick (i.e. a null local size)
+  using local_size_t = std::array<size_t, 2>;
+
+  //the shapes worth trying on a kernel that fits max_group_size work-items per group. The columns are
+  //what's contiguous in the image, so they're never narrower than 4
+  static std::vector<local_size_t> get_candidates(const size_t max_group_size)
+  {
+    std::vector<local_size_t> candidates {{{0, 0}}};
+    for (size_t group_size = 32; group_size <= std::min<size_t>(max_group_size, 1024); group_size *= 2)
+    {
+      for (size_t group_rows = 1; group_rows <= 32 && group_size / group_rows >= 4; group_rows *= 2) {
+        candidates.push_back({{group_rows, group_size / group_rows}});
+      }
+    }
+    return candidates;
+  }
+
+  //sets up the launch dimensions for the shape: the rows + columns get padded up to whole groups.
+  //Returns the local size to launch with (nullptr for the driver's pick)
+  static const size_t* apply(const local_size_t& local_size, size_t global_dims[3], size_t local_dims[3])
+  {
+    if(local_size[0] == 0 || local_size[1] == 0) {
+      return nullptr;
+    }
+    for (int dim_idx = 0; dim_idx < 2; ++dim_idx)
+    {
+      local_dims[dim_idx] = local_size[dim_idx];
+      global_dims[dim_idx] = local_size[dim_idx] * ((global_dims[dim_idx] + local_size[dim_idx] - 1) / local_size[dim_idx]);
+    }
+    local_dims[2] = 1;
+    return local_dims;
+  }
+
+  //the tuned shape of the kernel, tuning it first if the engine doesn't have one yet. The kernel has
+  //to have all of its args set except for the first two (the output buffer + the first slice), as the
+  //probe launches write probe_slices slices' worth to probe_buffer
+  static local_size_t get_local_size(ocl_engine& fractal_engine, cl_kernel ocl_kernel, const std::string& kernel_name, const std::string& build_options,
+                                     const fractal_params& params, cl_mem probe_buffer, const int probe_slices)
+  {
+    const std::string tuning_key = kernel_name + " " + build_options;
+    local_size_t local_size {{0, 0}};
+    if(fractal_engine.get_tuned_size(tuning_key, local_size)) {
+      return local_size;
+    }
+
+    size_t max_group_size = 0;
+    auto ocl_error_num = clGetKernelWorkGroupInfo(ocl_kernel, fractal_engine.get_device_info().device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_group_size, nullptr);
+    if(ocl_error_num != CL_SUCCESS)
+    {
+      std::cout << "ERROR @ KERNEL WORK GROUP INFO -- " << ocl_error_num << std::endl;
+      return local_size;
+    }
+
+    //the middle of the stack, where there's the most of the fractal (and so the most divergence)
+    const cl_int probe_depth = std::max(0, params.imdepth / 2 - probe_slices / 2);
+    const int num_slices = std::min(probe_slices, params.imdepth - probe_depth);
+    clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem), (void *)&probe_buffer);
+    clSetKernelArg(ocl_kernel, 1, sizeof(cl_int), (void *)&probe_depth);
+
+    cl_command_queue ocl_command_queue = fractal_engine.get_queue();
+    double best_ms = std::numeric_limits<double>::max();
+    for (const auto& candidate : get_candidates(max_group_size))
+    {
+      size_t global_kernel_dims [3] = {static_cast<size_t>(params.imheight), static_cast<size_t>(params.imwidth), static_cast<size_t>(num_slices)};
+      size_t local_kernel_dims [3];
+      const size_t* local_dims = apply(candidate, global_kernel_dims, local_kernel_dims);
+
+      //the first launch is a warm-up, the best of the rest counts
+      double candidate_ms = std::numeric_limits<double>::max();
+      for (int launch_idx = 0; launch_idx < 1 + num_timed_launches; ++launch_idx)
+      {
+        auto launch_start = std::chrono::high_resolution_clock::now();
+        ocl_error_num = clEnqueueNDRangeKernel(ocl_command_queue, ocl_kernel, 3, nullptr, global_kernel_dims, local_dims, 0, nullptr, nullptr);
+        if(ocl_error_num == CL_SUCCESS) {
+          ocl_error_num = clFinish(ocl_command_queue);
+        }
+        //a shape the device can't run (e.g. past its max work-item sizes) just drops out
+        if(ocl_error_num != CL_SUCCESS)
+        {
+          candidate_ms = std::numeric_limits<double>::max();
+          break;
+        }
+        if(launch_idx > 0) {
+          candidate_ms = std::min(candidate_ms, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - launch_start).count());
+        }
+      }
+
+      if(candidate_ms < best_ms)
+      {
+        best_ms = candidate_ms;
+        local_size = candidate;
+      }
+    }
+
+    if(best_ms == std::numeric_limits<double>::max())
+    {
+      std::cout << "ERROR @ KERNEL TUNING -- none of the work-group sizes ran for " << kernel_name << std::endl;
+      return local_size;
+    }
+    std::cout << "Tuned " << kernel_name << " on " << fractal_engine.get_device_info().device_name << ": " << local_size[0] << "x" << local_size[1]
+              << ((local_size[0] == 0) ? " (driver's pick)" : "") << ", " << best_ms << " ms per probe" << std::endl;
+    fractal_engine.set_tuned_size(tuning_key, local_size);
+    return local_size;
+  }
+};
+
+#endif
@@ -0,0 +1,437 @@
+/* ocl_engine.hpp -- part of the OpenCL fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+
+#ifndef OCL_FRACTALS_ENGINE_HPP
+#define OCL_FRACTALS_ENGINE_HPP
+
+#include <CL/cl.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <tuple>
+#include <map>
+#include <array>
+#include <sstream>
+#include <iterator>
+#include <cstdio>
+#include <cstdint>
+
+#include <sys/stat.h>
+
+#include "util/ocl_helpers.hpp"
+#include "fractal_gen/fractal_cache.hpp"
+
+/* The long-lived OpenCL state of one device of a backend instance: the context and command queues are set
+ * up once, the programs get built once per set of build options (and their kernels created once),
+ * and the device buffers are kept around and only re-allocated when a request needs a bigger one.
+ *
+ * The built program binaries are also cached on disk, so that later runs can skip the compiler. The
+ * binaries are keyed by the device, the driver version, the build options and the kernel source, so
+ * a driver update (or an edit to the kernel) just means a rebuild. The tuned work-group sizes (see
+ * ocl_autotuner.hpp) are kept next to them, in one small tuning file per device.
+ *
+ * Not thread-safe -- every generator thread has its own backend instance, and so its own engines. A
+ * backend spreading a request over several devices drives each device's engine from its own thread.
+ */
+class ocl_engine
+{
+public:
+    //an empty binary cache directory turns off the on-disk cache
+    explicit ocl_engine(const ocl_helpers::ocl_device_info& device_info, const std::string& binary_cache_dir = "ocl_cache")
+      : binary_cache_dir(binary_cache_dir), device_info(device_info), device_id(device_info.device_id), ocl_context(nullptr), ocl_command_queue(nullptr), 
+        ocl_transfer_queue(nullptr), is_initialized(false)
+    {
+        initialize();
+    }
+
+    ~ocl_engine()
+    {
+        for (auto& buffer_entry : device_buffers) {
+            clReleaseMemObject(buffer_entry.second.dev_buffer);
+        }
+        for (auto& kernel_entry : ocl_kernels) {
+            clReleaseKernel(kernel_entry.second);
+        }
+        for (auto& program_entry : ocl_programs) {
+            clReleaseProgram(program_entry.second);
+        }
+        if(ocl_transfer_queue) {
+            clReleaseCommandQueue(ocl_transfer_queue);
+        }
+        if(ocl_command_queue) {
+            clReleaseCommandQueue(ocl_command_queue);
+        }
+        if(ocl_context) {
+            clReleaseContext(ocl_context);
+        }
+    }
+
+    ocl_engine(const ocl_engine&) = delete;
+    ocl_engine& operator=(const ocl_engine&) = delete;
+
+    inline bool is_ready() const
+    {
+        return is_initialized;
+    }
+
+    inline cl_device_id get_device() const
+    {
+        return device_id;
+    }
+
+    inline const ocl_helpers::ocl_device_info& get_device_info() const
+    {
+        return device_info;
+    }
+
+    inline cl_context get_context() const
+    {
+        return ocl_context;
+    }
+
+    inline cl_command_queue get_queue() const
+    {
+        return ocl_command_queue;
+    }
+
+    //a second in-order queue, so the transfers can overlap with the kernels on the first one
+    inline cl_command_queue get_transfer_queue() const
+    {
+        return ocl_transfer_queue;
+    }
+
+    //the named kernel of the program in kernel_fname (under OCLKERNEL_FILEPATH), built with the given
+    //options. Returns nullptr if the program doesn't build
+    cl_kernel get_kernel(const std::string& kernel_fname, const std::string& build_options, const std::string& kernel_name)
+    {
+        const auto kernel_key = std::make_tuple(kernel_fname, build_options, kernel_name);
+        auto kernel_it = ocl_kernels.find(kernel_key);
+        if(kernel_it != ocl_kernels.end()) {
+            return kernel_it->second;
+        }
+
+        cl_program ocl_program = get_program(kernel_fname, build_options);
+        if(!ocl_program) {
+            return nullptr;
+        }
+
+        cl_int ocl_error_num;
+        cl_kernel ocl_kernel = clCreateKernel(ocl_program, kernel_name.c_str(), &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ KERNEL CREATION -- " << ocl_error_num  << " -- kernel name: " << kernel_name << std::endl;
+            return nullptr;
+        }
+        ocl_kernels[kernel_key] = ocl_kernel;
+        return ocl_kernel;
+    }
+
+    //a device buffer of at least num_bytes, kept under the given name between requests. The contents
+    //don't carry over if it has to be re-allocated
+    cl_mem get_buffer(const std::string& buffer_name, const size_t num_bytes, const cl_mem_flags mem_flags)
+    {
+        auto buffer_it = device_buffers.find(buffer_name);
+        if(buffer_it != device_buffers.end())
+        {
+            if(buffer_it->second.num_bytes >= num_bytes && buffer_it->second.mem_flags == mem_flags) {
+                return buffer_it->second.dev_buffer;
+            }
+            clReleaseMemObject(buffer_it->second.dev_buffer);
+            device_buffers.erase(buffer_it);
+        }
+
+        cl_int ocl_error_num;
+        cl_mem dev_buffer = clCreateBuffer(ocl_context, mem_flags, num_bytes, nullptr, &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ BUFFER CREATION -- " << ocl_error_num << " -- buffer " << buffer_name << " (" << num_bytes << " bytes)" << std::endl;
+            return nullptr;
+        }
+        device_buffers[buffer_name] = device_buffer{dev_buffer, num_bytes, mem_flags};
+        return dev_buffer;
+    }
+
+    //the tuned local size stored under the key, if there is one
+    bool get_tuned_size(const std::string& tuning_key, std::array<size_t, 2>& local_size) const
+    {
+        auto tuning_it = tuned_sizes.find(tuning_key);
+        if(tuning_it == tuned_sizes.end()) {
+            return false;
+        }
+        local_size = tuning_it->second;
+        return true;
+    }
+
+    //stores the local size, and writes the device's tuning file back out
+    void set_tuned_size(const std::string& tuning_key, const std::array<size_t, 2>& local_size)
+    {
+        tuned_sizes[tuning_key] = local_size;
+        save_tuning();
+    }
+
+private:
+    struct device_buffer
+    {
+        cl_mem dev_buffer;
+        size_t num_bytes;
+        cl_mem_flags mem_flags;
+    };
+
+    void initialize()
+    {
+        //the platform has to be named, as the devices can be spread over several of them
+        const cl_context_properties context_props[] = {CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(device_info.platform_id), 0};
+        cl_int ocl_error_num;
+        ocl_context = clCreateContext(context_props, 1, &device_id, nullptr, nullptr, &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ CONTEXT CREATION -- " << ocl_error_num << std::endl;
+            return;
+        }
+
+        ocl_command_queue = clCreateCommandQueue(ocl_context, device_id, 0, &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ QUEUE CREATION -- " << ocl_error_num << std::endl;
+            return;
+        }
+        ocl_transfer_queue = clCreateCommandQueue(ocl_context, device_id, 0, &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ QUEUE CREATION -- " << ocl_error_num << std::endl;
+            return;
+        }
+
+        //everything that can make a cached binary stale, other than the build options + source
+        device_signature = device_info.platform_name + "|" + device_info.device_name + "|" + device_info.device_version + "|" + device_info.driver_version;
+        std::cout << "OpenCL device: " << device_signature << std::endl;
+
+        if(!binary_cache_dir.empty())
+        {
+            mkdir(binary_cache_dir.c_str(), 0755);
+            fractal_cache_helpers::param_hasher hasher;
+            hasher.add(device_signature);
+            tuning_fname = binary_cache_dir + "/tuning_" + fractal_cache_helpers::key_to_string(hasher.hash_val) + ".txt";
+            load_tuning();
+        }
+        is_initialized = true;
+    }
+
+    //one "<local size 0> <local size 1> <tuning key>" line per tuned kernel, after a comment line naming the device
+    void load_tuning()
+    {
+        std::ifstream tuning_file(tuning_fname);
+        std::string tuning_line;
+        while(std::getline(tuning_file, tuning_line))
+        {
+            if(tuning_line.empty() || tuning_line[0] == '#') {
+                continue;
+            }
+            std::istringstream tuning_ss(tuning_line);
+            std::array<size_t, 2> local_size;
+            std::string tuning_key;
+            if(tuning_ss >> local_size[0] >> local_size[1] && std::getline(tuning_ss >> std::ws, tuning_key)) {
+                tuned_sizes[tuning_key] = local_size;
+            }
+        }
+    }
+
+    void save_tuning() const
+    {
+        if(tuning_fname.empty()) {
+            return;
+        }
+
+        const std::string tmp_fname = tuning_fname + ".tmp" + std::to_string(reinterpret_cast<uintptr_t>(this));
+        {
+            std::ofstream tuning_file(tmp_fname);
+            if(!tuning_file) {
+                std::cout << "WARNING: couldn't write the tuning file " << tuning_fname << std::endl;
+                return;
+            }
+            tuning_file << "# " << device_signature << "\n";
+            for (const auto& tuning_entry : tuned_sizes) {
+                tuning_file << tuning_entry.second[0] << " " << tuning_entry.second[1] << " " << tuning_entry.first << "\n";
+            }
+        }
+        std::rename(tmp_fname.c_str(), tuning_fname.c_str());
+    }
+
+    const std::string& get_source(const std::string& kernel_fname)
+    {
+        auto source_it = program_sources.find(kernel_fname);
+        if(source_it == program_sources.end())
+        {
+            std::string program_source;
+            ocl_helpers::load_kernel_file(ocl_helpers::get_kernelpath() + kernel_fname, program_source);
+            source_it = program_sources.emplace(kernel_fname, program_source).first;
+        }
+        return source_it->second;
+    }
+
+    cl_program get_program(const std::string& kernel_fname, const std::string& build_options)
+    {
+        const auto program_key = std::make_pair(kernel_fname, build_options);
+        auto program_it = ocl_programs.find(program_key);
+        if(program_it != ocl_programs.end()) {
+            return program_it->second;
+        }
+
+        const std::string& program_source = get_source(kernel_fname);
+        if(program_source.empty())
+        {
+            std::cout << "ERROR @ PROGRAM SOURCE -- couldn't load " << kernel_fname << std::endl;
+            return nullptr;
+        }
+
+        fractal_cache_helpers::param_hasher hasher;
+        hasher.add(device_signature);
+        hasher.add(build_options);
+        hasher.add(program_source);
+        const std::string binary_fname = binary_cache_dir + "/" + fractal_cache_helpers::key_to_string(hasher.hash_val) + ".clbin";
+
+        cl_program ocl_program = load_binary(binary_fname, build_options);
+        if(!ocl_program)
+        {
+            ocl_program = build_source(program_source, build_options);
+            if(!ocl_program) {
+                return nullptr;
+            }
+            save_binary(binary_fname, ocl_program);
+        }
+        ocl_programs[program_key] = ocl_program;
+        return ocl_program;
+    }
+
+    cl_program build_source(const std::string& program_source, const std::string& build_options)
+    {
+        cl_int ocl_error_num;
+        auto kernel_source_code = program_source.c_str();
+        cl_program ocl_program = clCreateProgramWithSource(ocl_context, 1, &kernel_source_code, nullptr, &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ PROGRAM CREATION -- " << ocl_error_num << std::endl;
+            return nullptr;
+        }
+
+        ocl_error_num = clBuildProgram(ocl_program, 1, &device_id, build_options.c_str(), nullptr, nullptr);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "ERROR @ PROGRAM BUILD -- " << ocl_error_num << " -- options: " << build_options << std::endl;
+            if(ocl_error_num == CL_BUILD_PROGRAM_FAILURE)
+            {
+                size_t log_size = 0;
+                clGetProgramBuildInfo(ocl_program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+                std::vector<char> build_log (log_size + 1, 0);
+                clGetProgramBuildInfo(ocl_program, device_id, CL_PROGRAM_BUILD_LOG, log_size, build_log.data(), nullptr);
+                std::cout << build_log.data() << std::endl;
+            }
+            clReleaseProgram(ocl_program);
+            return nullptr;
+        }
+        return ocl_program;
+    }
+
+    //a stale or corrupt binary just fails to build, and the caller falls back to the source
+    cl_program load_binary(const std::string& binary_fname, const std::string& build_options)
+    {
+        if(binary_cache_dir.empty()) {
+            return nullptr;
+        }
+
+        std::ifstream binary_file(binary_fname, std::ios::binary);
+        if(!binary_file) {
+            return nullptr;
+        }
+        const std::vector<unsigned char> program_binary ((std::istreambuf_iterator<char>(binary_file)), std::istreambuf_iterator<char>());
+        if(program_binary.empty()) {
+            return nullptr;
+        }
+
+        cl_int binary_status;
+        cl_int ocl_error_num;
+        const size_t binary_size = program_binary.size();
+        const unsigned char* binary_data = program_binary.data();
+        cl_program ocl_program = clCreateProgramWithBinary(ocl_context, 1, &device_id, &binary_size, &binary_data, &binary_status, &ocl_error_num);
+        if(ocl_error_num != CL_SUCCESS || binary_status != CL_SUCCESS)
+        {
+            std::cout << "WARNING: ignoring the unusable program binary " << binary_fname << std::endl;
+            if(ocl_program) {
+                clReleaseProgram(ocl_program);
+            }
+            return nullptr;
+        }
+
+        ocl_error_num = clBuildProgram(ocl_program, 1, &device_id, build_options.c_str(), nullptr, nullptr);
+        if(ocl_error_num != CL_SUCCESS)
+        {
+            std::cout << "WARNING: ignoring the unusable program binary " << binary_fname << std::endl;
+            clReleaseProgram(ocl_program);
+            return nullptr;
+        }
+        std::cout << "Loaded the program binary " << binary_fname << std::endl;
+        return ocl_program;
+    }
+
+    void save_binary(const std::string& binary_fname, cl_program ocl_program) const
+    {
+        if(binary_cache_dir.empty()) {
+            return;
+        }
+
+        size_t binary_size = 0;
+        clGetProgramInfo(ocl_program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, nullptr);
+        if(binary_size == 0) {
+            return;
+        }
+        std::vector<unsigned char> program_binary (binary_size);
+        unsigned char* binary_data = program_binary.data();
+        if(clGetProgramInfo(ocl_program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary_data, nullptr) != CL_SUCCESS) {
+            return;
+        }
+
+        //written under a temporary name first, so that the other engines never see half a binary
+        const std::string tmp_fname = binary_fname + ".tmp" + std::to_string(reinterpret_cast<uintptr_t>(this));
+        {
+            std::ofstream binary_file(tmp_fname, std::ios::binary);
+            if(!binary_file) {
+                std::cout << "WARNING: couldn't write the program binary " << binary_fname << std::endl;
+                return;
+            }
+            binary_file.write(reinterpret_cast<const char*>(program_binary.data()), program_binary.size());
+        }
+        std::rename(tmp_fname.c_str(), binary_fname.c_str());
+    }
+
+    const std::string binary_cache_dir;
+
+    const ocl_helpers::ocl_device_info device_info;
+    cl_device_id device_id;
+    cl_context ocl_context;
+    cl_command_queue ocl_command_queue;
+    cl_command_queue ocl_transfer_queue;
+    std::string device_signature;
+    bool is_initialized;
+
+    std::map<std::string, std::string> program_sources;
+    //keyed by (kernel file, build options)
+    std::map<std::pair<std::string, std::string>, cl_program> ocl_programs;
+    //keyed by (kernel file, build options, kernel name)
+    std::map<std::tuple<std::string, std::string, std::string>, cl_kernel> ocl_kernels;
+    std::map<std::string, device_buffer> device_buffers;
+
+    //empty --> the tuning isn't kept on disk
+    std::string tuning_fname;
+    std::map<std::string, std::array<size_t, 2>> tuned_sizes;
+};
+
+#endif
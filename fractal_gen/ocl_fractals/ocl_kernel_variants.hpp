@@ -0,0 +1,99 @@
+/* ocl_kernel_variants.hpp -- part of the OpenCL fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+
+#ifndef OCL_FRACTALS_KERNEL_VARIANTS_HPP
+#define OCL_FRACTALS_KERNEL_VARIANTS_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "util/fractal_helpers.hpp"
+
+namespace fractal_helpers
+{
+
+struct fractal_options
+{
+  static const std::vector<std::string>& get_ids()
+  {
+    static const std::vector <std::string> ids
+    {
+      "mandelbrot",
+      "julia"
+    };
+    return ids;
+  }
+
+  static std::string get_ocl_id(const std::string& id)
+  {
+    static const std::map <std::string, std::string> ocl_ids
+    {
+      {"mandelbrot", "MANDELBROT"},
+      {"julia", "JULIA"}
+    };
+
+    auto id_it = ocl_ids.find(id);
+    if(id_it != ocl_ids.end())
+      return id_it->second;
+    else
+      throw std::runtime_error("INVALID Fractal Name -- " + id);
+  }
+};
+
+} //namespace fractal_helpers
+
+/* One specialization of the fractal kernels: everything the kernels would otherwise take as runtime
+ * arguments and branch on in the hot loop gets baked into the program as macros. There's a variant
+ * for every combination the requests come up with; the engine builds each one the first time it's
+ * asked for (or loads it from its binary cache), and keeps it for the later requests.
+ */
+struct ocl_kernel_variant
+{
+  ocl_kernel_variant()
+    : order(0), max_iter(0), use_double(false), fast_math(false)
+  {}
+
+  //the variant that generates the request, at the backend's precision settings
+  static ocl_kernel_variant for_request(const fractal_params& params, const bool use_double, const bool fast_math)
+  {
+    ocl_kernel_variant variant;
+    variant.fractal_id = fractal_helpers::fractal_options::get_ocl_id(params.fractal_name);
+    variant.order = fractal_params::ORDER;
+    variant.max_iter = static_cast<int>(fractal_params::MAX_ITER);
+    variant.use_double = use_double;
+    variant.fast_math = fast_math;
+    return variant;
+  }
+
+  //the variant is identified by its build options, so they double as the engine's program key
+  std::string get_build_options() const
+  {
+    std::string build_options = "-DFRACTALID=" + fractal_id + " -DFRACTAL_ORDER=" + std::to_string(order) + " -DFRACTAL_MAX_ITER=" + std::to_string(max_iter);
+    if(use_double) {
+      build_options += " -DUSE_DOUBLE";
+    }
+    if(fast_math) {
+      build_options += " -cl-fast-relaxed-math";
+    }
+    return build_options;
+  }
+
+  std::string fractal_id;
+  int order;
+  int max_iter;
+  //needs a device with cl_khr_fp64
+  bool use_double;
+  //built with -cl-fast-relaxed-math
+  bool fast_math;
+};
+
+#endif
@@ -13,35 +13,95 @@
 
 #include <iostream>
 #include <algorithm>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
 
 #include <CL/cl.hpp>
 
 #include "util/fractal_helpers.hpp"
+#include "util/cost_model.hpp"
 #include "fractalgen3d.hpp"
+#include "ocl_engine.hpp"
 
 //#include "cpu_fractals/fractalgen3d.hpp"
 
+/* Generates on whichever OpenCL devices the selection picks, out of those on every platform. With
+ * more than one device, each request's slices are split into one contiguous z-range per device, and
+ * the devices fill in their ranges of the same stack in parallel. The ranges are sized by the predicted
+ * cost of their slices (from a coarse pre-pass on the host, see make_ocl_cost_map) against how fast
+ * each device has been on the earlier requests (predicted cost per ms, smoothed), so that the devices
+ * all finish at about the same time. Until every device has been measured, the split goes by the
+ * rough estimates from the device properties. How the predictions held up is in get_cost_report.
+ */
 template <typename point_t, typename data_t>
 class oclFractals
 {
 public:
-  oclFractals()
-  {}
+  explicit oclFractals(const ocl_launch_config& config = ocl_launch_config(), const ocl_helpers::ocl_device_selection& selection = ocl_helpers::ocl_device_selection())
+    : launch_config(config)
+  {
+    set_devices(selection);
+  }
+
+  //replaces the devices (and so everything built + measured on them)
+  void set_devices(const ocl_helpers::ocl_device_selection& selection)
+  {
+    fractal_engines.clear();
+    device_throughput.clear();
+    for (const auto& device_info : ocl_helpers::select_devices(ocl_helpers::get_devices(), selection))
+    {
+      std::unique_ptr<ocl_engine> device_engine (new ocl_engine(device_info));
+      if(!device_engine->is_ready()) {
+        continue;
+      }
+      std::cout << "Generating on " << device_info.get_description() << std::endl;
+      fractal_engines.push_back(std::move(device_engine));
+      device_throughput.push_back(0);
+    }
+    if(fractal_engines.empty()) {
+      std::cout << "ERROR @ OCL DEVICES -- no OpenCL device matches the selection" << std::endl;
+    }
+  }
 
   virtual ~oclFractals()
   {}
 
-  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params)
+  inline void set_launch_config(const ocl_launch_config& config)
+  {
+    launch_config = config;
+  }
+
+  static std::string backend_name()
+  {
+    return "ocl";
+  }
+
+  //of the last request split over more than one device
+  inline const cost_report& get_cost_report() const
+  {
+    return last_report;
+  }
+
+  //the precision of the kernel variants (see ocl_kernel_variant)
+  std::string precision_name() const
+  {
+    return launch_config.get_precision_name();
+  }
+
+  //run_stats is only given if the request asked for statistics
+  virtual void make_fractal(std::vector<data_t>& h_image_stack, fractal_params& fractalgen_params, fractal_stats* run_stats = nullptr)
   {
     //NOTE: need to dynamically allocate, as the memory requirements become prohibitive very fast (e.g. 512 x 512 x 512 of ints --> 4*2^27 bytes)
 
-    std::cout << "Making fractal... " << std::endl;
-    run_ocl_fractal<data_t>(h_image_stack, fractalgen_params);
+    generate_slices(fractalgen_params, run_stats, [&](const size_t device_idx, const int z_begin, const int z_end, fractal_stats* device_stats)
+      {
+        return run_ocl_fractal<data_t>(*fractal_engines[device_idx], launch_config, h_image_stack, fractalgen_params, z_begin, z_end, device_stats);
+      },
+      [](const size_t) {});
 	//cpu_fractals::run_cpu_fractal<data_t>(h_image_stack, fractalgen_params);
-    std::cout << "Making Point Cloud... " << std::endl;
 
-	auto fracstack_sum = std::accumulate(h_image_stack.begin(), h_image_stack.end(), 0);
-	std::cout << "NOTE: stack sum is " << fracstack_sum << std::endl;
 
   //-------------------------------------------------------
 
@@ -67,6 +127,170 @@ public:
 
     //return fdata;
   }
+
+  //whether make_points is the way to go, rather than make_fractal + the host-side extraction
+  inline bool makes_points() const
+  {
+    return launch_config.compact_points;
+  }
+
+  //appends the points of the slices still to be generated to pt_cloud (which, for a resumed request,
+  //already has the points of the slices before). Only the points come back from the devices
+  virtual void make_points(fractal_types::pointcloud<point_t, data_t>& pt_cloud, fractal_params& fractalgen_params, fractal_stats* run_stats = nullptr)
+  {
+    //every device appends to its own cloud, and they're joined in z order
+    std::vector<fractal_types::pointcloud<point_t, data_t>> device_clouds (fractal_engines.size());
+    generate_slices(fractalgen_params, run_stats, [&](const size_t device_idx, const int z_begin, const int z_end, fractal_stats* device_stats)
+      {
+        return run_ocl_points<point_t, data_t>(*fractal_engines[device_idx], launch_config, device_clouds[device_idx], fractalgen_params, z_begin, z_end, device_stats);
+      },
+      [&](const size_t device_idx)
+      {
+        pt_cloud.cloud.insert(pt_cloud.cloud.end(), device_clouds[device_idx].cloud.begin(), device_clouds[device_idx].cloud.end());
+      });
+  }
+
+  //the plane's cross-section of the fractal (see run_ocl_slice) into image. A plane is too little work
+  //to split, so it goes to the first device
+  virtual bool make_slice(std::vector<data_t>& image, const fractal_params& fractalgen_params, const slice_plane& plane)
+  {
+    if(fractal_engines.empty())
+    {
+      std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to generate on" << std::endl;
+      return false;
+    }
+    return run_ocl_slice<data_t>(*fractal_engines.front(), launch_config, image, fractalgen_params, plane);
+  }
+
+private:
+  //one contiguous range of slices per device, of about the same predicted time
+  std::vector<int> split_slices(const cost_map& slice_costs, const int z_begin, const int z_end) const
+  {
+    const bool all_measured = std::find(device_throughput.begin(), device_throughput.end(), 0.0) == device_throughput.end();
+    std::vector<double> device_weights (fractal_engines.size());
+    for (size_t device_idx = 0; device_idx < fractal_engines.size(); ++device_idx) {
+      device_weights[device_idx] = all_measured ? device_throughput[device_idx] : fractal_engines[device_idx]->get_device_info().get_speed_estimate();
+    }
+    return slice_costs.split(z_begin, z_end, device_weights);
+  }
+
+  //run_on_device(device_idx, z_begin, z_end, device_stats) generates a range of slices on one device and
+  //returns the first slice it didn't generate; keep_device(device_idx) is called (in z order) for the
+  //devices whose results count. A range that ends short without the request having been stopped means
+  //the device failed, and so does the request (see generation_token::fail)
+  template <typename run_fn, typename keep_fn>
+  void generate_slices(fractal_params& fractalgen_params, fractal_stats* run_stats, run_fn run_on_device, keep_fn keep_device)
+  {
+    const int z_begin = fractalgen_params.cancel_token.get_resume_slice();
+    const int z_end = fractalgen_params.imdepth;
+    if(fractal_engines.empty())
+    {
+      std::cout << "ERROR @ OCL ENGINE -- no OpenCL device to generate on" << std::endl;
+      fractalgen_params.cancel_token.fail();
+      return;
+    }
+    //checked here rather than in the device threads, where an unknown fractal can't be reported
+    fractal_helpers::fractal_options::get_ocl_id(fractalgen_params.fractal_name);
+
+    //a single device has nothing to balance, so it can skip the pre-pass
+    auto run_start = std::chrono::high_resolution_clock::now();
+    const size_t num_devices = fractal_engines.size();
+    const cost_map slice_costs = (num_devices > 1) ? make_ocl_cost_map(fractalgen_params) : cost_map();
+    const std::vector<int> z_splits = (num_devices > 1) ? split_slices(slice_costs, z_begin, z_end) : std::vector<int>{z_begin, z_end};
+    std::vector<int> z_stops (num_devices);
+    std::vector<double> device_ms (num_devices, 0);
+    std::vector<std::chrono::high_resolution_clock::time_point> device_finish (num_devices, run_start);
+    //every device keeps its own statistics, so nothing is shared between the threads
+    std::vector<std::unique_ptr<fractal_stats>> device_stats (num_devices);
+
+    auto run_device = [&](const size_t device_idx)
+    {
+      if(run_stats) {
+        device_stats[device_idx].reset(new fractal_stats(fractalgen_params.imdepth));
+      }
+      auto device_start = std::chrono::high_resolution_clock::now();
+      z_stops[device_idx] = run_on_device(device_idx, z_splits[device_idx], z_splits[device_idx+1], device_stats[device_idx].get());
+      device_finish[device_idx] = std::chrono::high_resolution_clock::now();
+      device_ms[device_idx] = std::chrono::duration<double, std::milli>(device_finish[device_idx] - device_start).count();
+    };
+
+    //the first device runs on this thread. The ranges don't overlap, so the devices can all write to the stack
+    std::vector<std::thread> device_threads;
+    for (size_t device_idx = 1; device_idx < num_devices; ++device_idx)
+    {
+      if(z_splits[device_idx] < z_splits[device_idx+1]) {
+        device_threads.emplace_back([&run_device, device_idx]()
+          {
+            FRACTAL_TRACE_THREAD_NAME("ocl_device_" + std::to_string(device_idx));
+            run_device(device_idx);
+          });
+      }
+      else {
+        z_stops[device_idx] = z_splits[device_idx+1];
+      }
+    }
+    run_device(0);
+    for (auto& device_thread : device_threads) {
+      device_thread.join();
+    }
+
+    //the progress of a stopped request has to be a single slice to resume from, so it's the first
+    //unfinished range that counts -- anything the devices after it did gets generated again
+    size_t last_device = num_devices - 1;
+    for (size_t device_idx = 0; device_idx < num_devices; ++device_idx)
+    {
+      if(z_stops[device_idx] < z_splits[device_idx+1])
+      {
+        last_device = device_idx;
+        if(fractalgen_params.cancel_token.should_stop()) {
+          fractalgen_params.cancel_token.stop_at(z_stops[device_idx]);
+        }
+        else {
+          fractalgen_params.cancel_token.fail();
+        }
+        break;
+      }
+    }
+
+    if(num_devices > 1)
+    {
+      std::vector<std::string> device_names;
+      for (const auto& device_engine : fractal_engines) {
+        device_names.push_back(device_engine->get_device_info().device_name);
+      }
+      last_report = cost_report(device_names, slice_costs.prepass_ms);
+    }
+    for (size_t device_idx = 0; device_idx <= last_device; ++device_idx)
+    {
+      keep_device(device_idx);
+      if(run_stats && device_stats[device_idx]) {
+        run_stats->merge(*device_stats[device_idx]);
+      }
+
+      //only whole ranges say anything about the device's speed
+      const int num_slices = z_splits[device_idx+1] - z_splits[device_idx];
+      if(num_devices > 1 && num_slices > 0 && z_stops[device_idx] == z_splits[device_idx+1] && device_ms[device_idx] > 0)
+      {
+        const double range_cost = slice_costs.get_cost(z_splits[device_idx], z_splits[device_idx+1]);
+        const double predicted_ms = (device_throughput[device_idx] > 0) ? range_cost / device_throughput[device_idx] : 0;
+        last_report.add_unit(device_idx, z_splits[device_idx], z_splits[device_idx+1], range_cost, predicted_ms, device_ms[device_idx], 
+                             std::chrono::duration<double, std::milli>(device_finish[device_idx] - run_start).count());
+
+        const double cost_per_ms = range_cost / device_ms[device_idx];
+        device_throughput[device_idx] = (device_throughput[device_idx] > 0) ? 0.5 * (device_throughput[device_idx] + cost_per_ms) : cost_per_ms;
+      }
+    }
+    if(num_devices > 1) {
+      last_report.print_report();
+    }
+  }
+
+  //set up once, and kept for all the requests this backend instance generates
+  std::vector<std::unique_ptr<ocl_engine>> fractal_engines;
+  //measured predicted cost (see cost_map) per ms of every device; 0 --> not measured yet
+  std::vector<double> device_throughput;
+  ocl_launch_config launch_config;
+  cost_report last_report;
 };
 
 #endif
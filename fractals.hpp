@@ -10,26 +10,105 @@
 #define FRACTALS_HPP
 
 #include "util/fractal_helpers.hpp"
+#include "util/camera_view.hpp"
+#include "util/request_scheduler.hpp"
+#include "util/event_queue.hpp"
+#include "util/pipeline.hpp"
+#include "util/vertex_packing.hpp"
+#include "util/trace.hpp"
+#include "fractal_gen/fractal_cache.hpp"
 
 #include <thread>
 #include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <functional>
 
-//@backend: fractal_data make_fractal(fractal_params&& fractalgen_parameters)
+//@backend: std::shared_ptr<std::vector<pixel_type>> generate_stack(fractal_params& fractalgen_parameters, std::shared_ptr<const fractal_stats>& run_stats)
+//           static std::shared_ptr<pointcloud> extract_points(const std::vector<pixel_type>& image_stack, const fractal_params&)
+//           bool makes_points() + std::shared_ptr<pointcloud> generate_points(fractal_params&, std::shared_ptr<const fractal_stats>&)
+//             (for the backends that pull the points out themselves, in which case the extract stage has nothing to do)
+//           both return nullptr for a request that didn't finish; one that failed has its token marked (generation_token::fail)
 
 //@frontend: std::shared_ptr<FractalBufferType> get_fractalgenevt_buffer()
+//           std::shared_ptr<const camera_view> get_camera_view()
 //           void display_fractal (fractal_data&&)
 
+struct fractals_config
+{
+  fractals_config()
+    : num_workers(1), num_extract_workers(1), num_shade_workers(1), num_pack_workers(1), cache_budget(512 * 1024 * 1024), cache_dir(""),
+      trace_file("fractal_trace.json")
+  {}
+
+  //number of generator threads, each with its own backend instance
+  int num_workers;
+  //the thread counts of the stages after generation
+  int num_extract_workers;
+  int num_shade_workers;
+  int num_pack_workers;
+
+  //memory budget for the finished fractals held by the result cache
+  size_t cache_budget;
+  //on-disk tier of the result cache; empty string --> memory-only
+  std::string cache_dir;
+
+  //where the Chrome trace goes on shutdown (only if built with FRACTAL_ENABLE_TRACING)
+  std::string trace_file;
+};
+
+//how the generator threads spent their time -- waiting for requests (idle) vs. making fractals (busy).
+//The times are summed over all the workers
+struct generator_utilization
+{
+  generator_utilization()
+    : idle_ms(0), busy_ms(0), num_requests(0)
+  {}
+
+  inline double get_utilization() const
+  {
+    return (idle_ms + busy_ms > 0) ? busy_ms / (idle_ms + busy_ms) : 0;
+  }
+
+  double idle_ms;
+  double busy_ms;
+  size_t num_requests;
+};
+
+/* The requests go through a pipeline of stages, each with its own worker threads:
+ *   generate (fills the image stack, or finds the fractal in the cache) -> extract (point cloud) ->
+ *   shade (colours + placement) -> pack (vertex array) -> the frontend's display buffer
+ * Backends that make the points themselves (e.g. compacted on the device) skip the stack, and the
+ * extract stage just passes their points on.
+ * The queues between the stages are bounded and every hand-off blocks while the next queue is full,
+ * so a slow stage (or frontend) holds back the stages before it, all the way up to the scheduler,
+ * rather than anything getting dropped.
+ */
 template <typename fractalgen_type, typename visualize_type>
 class Fractals
 {
 public:
-  Fractals(fractalgen_type* fractalgen, visualize_type* fractalvis)
-    : fractal_backend(fractalgen), fractal_frontend(fractalvis), fractal_evtflag(false)
+  //the given backend is used by the first worker, the rest get default-constructed ones
+  Fractals(fractalgen_type* fractalgen, visualize_type* fractalvis, const fractals_config& config = fractals_config())
+    : fractal_frontend(fractalvis), fractal_config(config), fractal_results(config.cache_budget, config.cache_dir), 
+      fractal_scheduler(config.num_workers), fractal_evtflag(false)
   {
     fractal_genbuffer = fractal_frontend->get_fractalgenevt_buffer();
     fractal_displaybuffer = fractal_frontend->get_fractaldispevt_buffer();
-    
-    fractal_thread = nullptr;
+    //requests for what's on screen go first
+    fractal_scheduler.set_camera_view(fractal_frontend->get_camera_view());
+
+    fractal_backends.emplace_back(fractalgen);
+    for (int worker_idx = 1; worker_idx < config.num_workers; ++worker_idx) {
+      fractal_backends.emplace_back(new fractalgen_type());
+    }
+
+    extract_queue = std::make_shared<StageQueueType>();
+    shade_queue = std::make_shared<StageQueueType>();
+    pack_queue = std::make_shared<StageQueueType>();
   }
 
   ~Fractals()
@@ -41,7 +120,7 @@ public:
       fractal_genbuffer->pop();
     }
 */    
-    if(fractal_thread)
+    if(fractal_evtflag.load())
     {
       stop_fractals();
     }
@@ -49,39 +128,278 @@ public:
 
   inline void start_fractals()
   {
-    //spawn a thread to check for new events (and take action if an event is present)
+    typedef Fractals<fractalgen_type, visualize_type> FractalsType;
+    using namespace std::placeholders;
+
     fractal_evtflag.store(true);
-    fractal_thread = std::unique_ptr<std::thread>(new std::thread(&Fractals<fractalgen_type, visualize_type>::fractal_evtloop, this));
+    dispatch_thread = std::thread(&FractalsType::fractal_dispatchloop, this);
+
+    fractal_stages.clear();
+    fractal_stages.emplace_back(new FractalStageType("generate", fractal_config.num_workers, std::bind(&FractalsType::next_request, this, _1),
+        std::bind(&FractalsType::generate_stage, this, _1, _2), make_sink(extract_queue)));
+    fractal_stages.emplace_back(new FractalStageType("extract", fractal_config.num_extract_workers, make_source(extract_queue),
+        std::bind(&FractalsType::extract_stage, this, _1, _2), make_sink(shade_queue), make_depth(extract_queue)));
+    fractal_stages.emplace_back(new FractalStageType("shade", fractal_config.num_shade_workers, make_source(shade_queue),
+        std::bind(&FractalsType::shade_stage, this, _1, _2), make_sink(pack_queue), make_depth(shade_queue)));
+    fractal_stages.emplace_back(new FractalStageType("pack", fractal_config.num_pack_workers, make_source(pack_queue),
+        std::bind(&FractalsType::pack_stage, this, _1, _2), std::bind(&FractalsType::display_result, this, _1), make_depth(pack_queue)));
+
+    for (auto& fractal_stage : fractal_stages) {
+      fractal_stage->start();
+    }
   }
 
   inline void stop_fractals()
   {
     fractal_evtflag.store(false);
-    fractal_thread->join();
-    fractal_thread.reset(nullptr);
+    //any of the stages might be parked, waiting for work or for room downstream
+    fractal_genbuffer->wake();
+    fractal_scheduler.wake();
+    extract_queue->wake();
+    shade_queue->wake();
+    pack_queue->wake();
+    fractal_displaybuffer->wake();
+
+    dispatch_thread.join();
+    for (auto& fractal_stage : fractal_stages) {
+      fractal_stage->join();
+    }
+
+    auto gen_util = get_utilization();
+    fractal_scheduler.print_stats();
+    fractal_results.print_stats();
+    std::cout << "Generator (" << fractal_backends.size() << " workers): " << gen_util.num_requests << " requests, busy " << gen_util.busy_ms << " ms, idle " << gen_util.idle_ms 
+              << " ms (" << 100.0 * gen_util.get_utilization() << "% utilization) -- " << fractal_scheduler.get_waiter().get_spin_wakeups() 
+              << " spin / " << fractal_scheduler.get_waiter().get_park_wakeups() << " park wakeups" << std::endl;
+    for (const auto& stage_stats : get_pipeline_stats()) {
+      FractalStageType::print_stats(stage_stats);
+    }
+    FRACTAL_TRACE_EXPORT(fractal_config.trace_file);
+  }
+
+  //drops the request if it's still queued, or stops it at the next slice if it's being generated.
+  //Cancelled requests don't produce a fractal_data
+  bool cancel_request(const uint64_t request_id)
+  {
+    return fractal_scheduler.cancel(request_id);
+  }
+
+  //can be polled from any thread while the generator is running
+  generator_utilization get_utilization() const
+  {
+    generator_utilization gen_util;
+    if(!fractal_stages.empty())
+    {
+      const auto gen_stats = fractal_stages.front()->get_stats();
+      gen_util.idle_ms = gen_stats.idle_ms;
+      gen_util.busy_ms = gen_stats.busy_ms;
+      gen_util.num_requests = gen_stats.num_items;
+    }
+    return gen_util;
+  }
+
+  //one per stage, in pipeline order. Can be polled from any thread while the generator is running
+  std::vector<pipeline_stage_stats> get_pipeline_stats() const
+  {
+    std::vector<pipeline_stage_stats> stage_stats;
+    for (const auto& fractal_stage : fractal_stages) {
+      stage_stats.push_back(fractal_stage->get_stats());
+    }
+    return stage_stats;
   }
 
 private:
+  typedef typename fractalgen_type::point_type FractalPointType;
+  typedef typename fractalgen_type::pixel_type FractalPixelType;
+  typedef fractal_data<FractalPointType, FractalPixelType> FractalDataType;
+
+  //what gets passed along the pipeline; each stage fills in the next part
+  struct fractal_job
+  {
+    fractal_job()
+      : cache_key(0), is_cached(false)
+    {}
 
-  void fractal_evtloop()
+    fractal_genevent request;
+    uint64_t cache_key;
+    //the cache had the finished fractal, so there's nothing left to do but display it
+    bool is_cached;
+
+    std::shared_ptr<std::vector<FractalPixelType>> image_stack;
+    std::shared_ptr<const fractal_types::pointcloud<FractalPointType, FractalPixelType>> point_cloud;
+    std::shared_ptr<fractal_types::point_shading> shading;
+    FractalDataType result;
+  };
+
+  //only a few in-flight fractals per stage, so that the backpressure kicks in early (the stacks are big)
+  static constexpr size_t stage_queue_capacity = 4;
+  typedef event_queue<fractal_job, stage_queue_capacity> StageQueueType;
+  typedef pipeline_stage<fractal_job> FractalStageType;
+
+  typename FractalStageType::source_fn make_source(std::shared_ptr<StageQueueType> stage_queue)
   {
+    return [this, stage_queue](fractal_job& job) { return stage_queue->wait_pop(job, fractal_evtflag); };
+  }
+
+  typename FractalStageType::sink_fn make_sink(std::shared_ptr<StageQueueType> stage_queue)
+  {
+    return [this, stage_queue](fractal_job& job) { return stage_queue->wait_push(job, fractal_evtflag); };
+  }
+
+  typename FractalStageType::depth_fn make_depth(std::shared_ptr<StageQueueType> stage_queue)
+  {
+    return [stage_queue]() { return stage_queue->read_available(); };
+  }
+
+  //moves the incoming requests over to the scheduler as soon as they arrive, so that a newer request
+  //can supersede an older one even while all the workers are busy. In between, it keeps an eye on
+  //the camera, so that in-flight work can be pre-empted when it moves out of view
+  void fractal_dispatchloop()
+  {
+    FRACTAL_TRACE_THREAD_NAME("dispatch");
+    const std::chrono::milliseconds camera_check_interval (50);
+    auto camera = fractal_frontend->get_camera_view();
+    uint64_t camera_version = camera ? camera->get_version() : 0;
+
+    fractal_genevent fgen_evt;
     while(fractal_evtflag.load())
     {
-      //TODO: use a condition variable to sleep when the queue is empty
-      fractal_genevent fgen_evt;
-			while(fractal_genbuffer->pop(fgen_evt))
+      if(fractal_genbuffer->wait_pop_for(fgen_evt, fractal_evtflag, camera_check_interval)) {
+        fractal_scheduler.submit(fgen_evt);
+      }
+
+      if(camera && camera->get_version() != camera_version)
       {
-        //TODO: see what else could be needed here.... (e.g. pre-process anything, get the parameters into a different form, etc)
-        auto fractalgen_parameters = fgen_evt.params;
-        auto generated_fractal = fractal_backend->make_fractal(std::move(fractalgen_parameters));
-        
-        //carry along the target coordinate information
-        generated_fractal.target_coord = fgen_evt.target_coord;
-        fractal_displaybuffer->push(generated_fractal);
+        FRACTAL_TRACE_SCOPE("reprioritize");
+        camera_version = camera->get_version();
+        fractal_scheduler.reprioritize();
       }
     }
   }
 
+  //the source of the generate stage: sleeps (after a short spin) whenever there's nothing to generate
+  bool next_request(fractal_job& job)
+  {
+    while(fractal_evtflag.load())
+    {
+      const uint64_t last_epoch = fractal_scheduler.get_epoch();
+      if(fractal_scheduler.next(job.request)) {
+        return true;
+      }
+      fractal_scheduler.wait(last_epoch, fractal_evtflag);
+    }
+    return false;
+  }
+
+  bool generate_stage(const int worker_idx, fractal_job& job)
+  {
+    const fractal_genevent& fgen_evt = job.request;
+    job.image_stack.reset();
+    job.point_cloud.reset();
+    job.shading.reset();
+    job.result = FractalDataType();
+
+    //repeated requests for the same fractal are served from the cache (and share the one copy)
+    job.cache_key = fractal_cache_helpers::hash_params(fgen_evt.params, fractal_backends[worker_idx]->backend_id());
+    job.result.params = fgen_evt.params;
+    job.is_cached = fractal_results.lookup(job.cache_key, job.result);
+    if(job.is_cached)
+    {
+      fractal_scheduler.complete(fgen_evt);
+      return true;
+    }
+
+    auto fractalgen_parameters = fgen_evt.params;
+    if(fractal_backends[worker_idx]->makes_points()) {
+      job.point_cloud = fractal_backends[worker_idx]->generate_points(fractalgen_parameters, job.result.stats);
+    }
+    else {
+      job.image_stack = fractal_backends[worker_idx]->generate_stack(fractalgen_parameters, job.result.stats);
+    }
+    if(job.image_stack || job.point_cloud)
+    {
+      fractal_scheduler.complete(fgen_evt);
+      return true;
+    }
+
+    //partial results don't go any further, and neither do failed ones: retrying would only fail again
+    if(fgen_evt.params.cancel_token.is_cancelled())
+    {
+      std::cout << "Fractal request " << fgen_evt.request_id << " was cancelled" << std::endl;
+      fractal_scheduler.complete(fgen_evt);
+    }
+    else if(fractalgen_parameters.cancel_token.has_failed())
+    {
+      std::cout << "ERROR @ FRACTAL REQUEST -- request " << fgen_evt.request_id << " failed" << std::endl;
+      fractal_scheduler.complete(fgen_evt);
+    }
+    else
+    {
+      std::cout << "Fractal request " << fgen_evt.request_id << " was pre-empted" << std::endl;
+      fractal_scheduler.requeue(fgen_evt);
+    }
+    return false;
+  }
+
+  bool extract_stage(const int, fractal_job& job)
+  {
+    if(job.is_cached) {
+      return true;
+    }
+    //NOTE: requests can still be cancelled after they're generated, no sense in finishing them
+    if(job.request.params.cancel_token.is_cancelled()) {
+      return false;
+    }
+
+    if(job.point_cloud) {
+      return true;
+    }
+    job.point_cloud = fractalgen_type::extract_points(*job.image_stack, job.request.params);
+    //the stack is the biggest thing in flight, don't hold on to it any longer than needed
+    job.image_stack.reset();
+    return true;
+  }
+
+  bool shade_stage(const int, fractal_job& job)
+  {
+    if(job.is_cached) {
+      return true;
+    }
+    if(job.request.params.cancel_token.is_cancelled()) {
+      return false;
+    }
+
+    job.shading = std::make_shared<fractal_types::point_shading>();
+    vertex_packing::shade_points(*job.point_cloud, job.request.params, *job.shading);
+    return true;
+  }
+
+  bool pack_stage(const int, fractal_job& job)
+  {
+    if(!job.is_cached)
+    {
+      auto vertices = std::make_shared<fractal_types::vertex_data>();
+      vertex_packing::pack_shaded(*job.point_cloud, *job.shading, *vertices);
+      job.shading.reset();
+
+      job.result.point_cloud = job.point_cloud;
+      job.result.vertices = vertices;
+      fractal_results.insert(job.cache_key, job.result);
+    }
+    job.result.cache_key = job.cache_key;
+
+    //carry along the request information
+    job.result.target_coord = job.request.target_coord;
+    job.result.request_id = job.request.request_id;
+    return true;
+  }
+
+  //the sink of the pack stage: waits for the frontend to make room, rather than dropping the result
+  bool display_result(fractal_job& job)
+  {
+    return fractal_displaybuffer->wait_push(job.result, fractal_evtflag);
+  }
+
   //gen events for making new fractals
   typedef typename visualize_type::FractalBufferType FractalBufferType;
   std::shared_ptr<FractalBufferType> fractal_genbuffer;
@@ -89,10 +407,21 @@ private:
   typedef typename visualize_type::FractalDisplayBufferType FractalDisplayBufferType;
   std::shared_ptr<FractalDisplayBufferType> fractal_displaybuffer;
 
-  std::unique_ptr<fractalgen_type> fractal_backend;
+  //one per generate worker
+  std::vector<std::unique_ptr<fractalgen_type>> fractal_backends;
   std::unique_ptr<visualize_type> fractal_frontend;
+  const fractals_config fractal_config;
+  fractal_cache<FractalPointType, FractalPixelType> fractal_results;
+  //the pending + in-flight requests, shared by all the workers
+  request_scheduler fractal_scheduler;
+
+  //the inputs of the stages after generation
+  std::shared_ptr<StageQueueType> extract_queue;
+  std::shared_ptr<StageQueueType> shade_queue;
+  std::shared_ptr<StageQueueType> pack_queue;
+  std::vector<std::unique_ptr<FractalStageType>> fractal_stages;
 
-  std::unique_ptr<std::thread> fractal_thread;  
+  std::thread dispatch_thread;
   std::atomic<bool> fractal_evtflag;
 };
 
@@ -0,0 +1,125 @@
+/* camera_view.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_CAMERA_VIEW_HPP
+#define UTIL_CAMERA_VIEW_HPP
+
+#include <mutex>
+#include <cstdint>
+
+//where the camera is and what it can see, in world coordinates. The frustum planes point inwards,
+//i.e. a point p is inside a plane if (normal . p + d) >= 0
+struct camera_snapshot
+{
+  camera_snapshot()
+    : position{0, 0, 0}, frustum_planes{}, world_scale(1.0f), is_valid(false)
+  {}
+
+  //sphere vs. frustum test; conservative, so it can report some spheres near the corners as visible
+  bool is_visible(const float centre[3], const float radius) const
+  {
+    if(!is_valid) {
+      return true;
+    }
+    for (int plane_idx = 0; plane_idx < num_planes; ++plane_idx)
+    {
+      const float* plane = frustum_planes[plane_idx];
+      const float plane_dist = plane[0] * centre[0] + plane[1] * centre[1] + plane[2] * centre[2] + plane[3];
+      if(plane_dist < -radius) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  float distance_sq(const float point[3]) const
+  {
+    const float dx = point[0] - position[0];
+    const float dy = point[1] - position[1];
+    const float dz = point[2] - position[2];
+    return dx*dx + dy*dy + dz*dz;
+  }
+
+  //exact comparison, as the frontend takes the same snapshot again for as long as the camera holds still
+  bool same_view(const camera_snapshot& other) const
+  {
+    if(is_valid != other.is_valid || world_scale != other.world_scale) {
+      return false;
+    }
+    for (int axis_idx = 0; axis_idx < 3; ++axis_idx)
+    {
+      if(position[axis_idx] != other.position[axis_idx]) {
+        return false;
+      }
+    }
+    for (int plane_idx = 0; plane_idx < num_planes; ++plane_idx)
+    {
+      for (int coeff_idx = 0; coeff_idx < 4; ++coeff_idx)
+      {
+        if(frustum_planes[plane_idx][coeff_idx] != other.frustum_planes[plane_idx][coeff_idx]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  enum { num_planes = 6 };
+
+  float position [3];
+  //{normal_x, normal_y, normal_z, d} for each plane
+  float frustum_planes [num_planes][4];
+  //world units per voxel of a placed fractal, for sizing their bounding spheres
+  float world_scale;
+  //an invalid snapshot (i.e. no camera yet) sees everything
+  bool is_valid;
+};
+
+/* Latest camera snapshot, published by the frontend (once a frame) and read by the generator side.
+ * The version only goes up when a published snapshot differs from the current one, so readers can
+ * tell when the camera has moved without redoing their work on every frame.
+ */
+class camera_view
+{
+public:
+  camera_view()
+    : version(0)
+  {}
+
+  //false --> the camera hasn't moved since the last publish (i.e. the version stays the same)
+  bool publish(const camera_snapshot& snapshot)
+  {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    if(version > 0 && current_snapshot.same_view(snapshot)) {
+      return false;
+    }
+    current_snapshot = snapshot;
+    ++version;
+    return true;
+  }
+
+  camera_snapshot get_snapshot() const
+  {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    return current_snapshot;
+  }
+
+  uint64_t get_version() const
+  {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    return version;
+  }
+
+private:
+  mutable std::mutex view_mutex;
+  camera_snapshot current_snapshot;
+  uint64_t version;
+};
+
+#endif
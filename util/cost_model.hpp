@@ -0,0 +1,305 @@
+/* cost_model.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_COST_MODEL_HPP
+#define UTIL_COST_MODEL_HPP
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "util/fractal_helpers.hpp"
+#include "util/trace.hpp"
+
+/* The predicted cost of every slice of a request, from a coarse pre-pass over the stack (see
+ * make_cost_map). A voxel costs the iterations it takes plus one, as even a voxel that escapes right
+ * away goes through the loop once -- so the voxels can differ by up to MAX_ITER times, and slices with
+ * the same number of voxels can be anything but the same amount of work. The schedulers cut the stack
+ * by this cost rather than by the slice count.
+ */
+struct cost_map
+{
+  cost_map()
+    : prepass_ms(0), prepass_cost(0), num_samples(0)
+  {}
+
+  //the predicted cost of the slices [z_begin, z_end)
+  double get_cost(const int z_begin, const int z_end) const
+  {
+    return std::accumulate(slice_cost.begin() + z_begin, slice_cost.begin() + z_end, 0.0);
+  }
+
+  //the end of the range starting at z_begin (and ending by z_end) whose predicted cost comes closest
+  //to target_cost. The range can be empty
+  int get_range_end(const int z_begin, const int z_end, const double target_cost) const
+  {
+    int z = z_begin;
+    double range_cost = 0;
+    while(z < z_end && range_cost + 0.5 * slice_cost[z] <= target_cost)
+    {
+      range_cost += slice_cost[z];
+      ++z;
+    }
+    return z;
+  }
+
+  //cuts [z_begin, z_end) into one contiguous range per weight, with predicted costs in proportion to the
+  //weights: range i is [z_splits[i], z_splits[i+1])
+  std::vector<int> split(const int z_begin, const int z_end, const std::vector<double>& weights) const
+  {
+    const double total_cost = get_cost(z_begin, z_end);
+    const double total_weight = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+    std::vector<int> z_splits {z_begin};
+    double cumulative_weight = 0;
+    double split_cost = 0;
+    for (size_t range_idx = 0; range_idx < weights.size(); ++range_idx)
+    {
+      cumulative_weight += weights[range_idx];
+      const double cost_frac = (total_weight > 0) ? cumulative_weight / total_weight : static_cast<double>(range_idx + 1) / weights.size();
+      const int range_end = get_range_end(z_splits.back(), z_end, cost_frac * total_cost - split_cost);
+      split_cost += get_cost(z_splits.back(), range_end);
+      z_splits.push_back(range_end);
+    }
+    z_splits.back() = z_end;
+    return z_splits;
+  }
+
+  //num_units ranges of about the same predicted cost
+  inline std::vector<int> split_even(const int z_begin, const int z_end, const int num_units) const
+  {
+    return split(z_begin, z_end, std::vector<double>(std::max(1, num_units), 1.0));
+  }
+
+  //what the pre-pass got through per ms, on the one host thread. As the CPU backends run the same
+  //formula, that's what a CPU thread should get through generating the stack as well
+  inline double get_prepass_rate() const
+  {
+    return (prepass_ms > 0) ? prepass_cost / prepass_ms : 0;
+  }
+
+  //one per slice of the stack
+  std::vector<double> slice_cost;
+  double prepass_ms;
+  //of the sampled voxels alone
+  double prepass_cost;
+  size_t num_samples;
+};
+
+/* Samples the stack on a coarse grid -- depth_samples slices, plane_samples x plane_samples voxels
+ * each, at the centres of the grid cells -- and spreads the sampled cost out over the slices in
+ * between. iterations(row, col, depth) gives the iterations the voxel at those stack indices takes,
+ * with the same formula the stack is generated with, or the map says nothing about the work.
+ *
+ * NOTE: thin features between the samples get missed; the schedulers keep enough slack (more units
+ * than workers, or units that shrink towards the end) that a bit off here doesn't cost much
+ */
+template <typename iterations_fn>
+cost_map make_cost_map(const fractal_params& params, iterations_fn iterations, const int plane_samples = 16, const int depth_samples = 32)
+{
+  FRACTAL_TRACE_SCOPE("cost_prepass");
+  auto prepass_start = std::chrono::high_resolution_clock::now();
+
+  cost_map slice_costs;
+  slice_costs.slice_cost.assign(std::max(0, params.imdepth), 0);
+  if(params.imheight <= 0 || params.imwidth <= 0 || params.imdepth <= 0) {
+    return slice_costs;
+  }
+
+  const int num_rows = std::min(plane_samples, params.imheight);
+  const int num_cols = std::min(plane_samples, params.imwidth);
+  const int num_depths = std::min(depth_samples, params.imdepth);
+  const double slice_voxels = static_cast<double>(params.imheight) * params.imwidth;
+  std::vector<int> sample_z (num_depths);
+  std::vector<double> sample_cost (num_depths);
+  for (int depth_idx = 0; depth_idx < num_depths; ++depth_idx)
+  {
+    sample_z[depth_idx] = (2 * depth_idx + 1) * params.imdepth / (2 * num_depths);
+    double sampled_cost = 0;
+    for (int row_idx = 0; row_idx < num_rows; ++row_idx)
+    {
+      const int row = (2 * row_idx + 1) * params.imheight / (2 * num_rows);
+      for (int col_idx = 0; col_idx < num_cols; ++col_idx)
+      {
+        const int col = (2 * col_idx + 1) * params.imwidth / (2 * num_cols);
+        sampled_cost += iterations(row, col, sample_z[depth_idx]) + 1;
+      }
+    }
+    slice_costs.prepass_cost += sampled_cost;
+    sample_cost[depth_idx] = sampled_cost / (num_rows * num_cols) * slice_voxels;
+  }
+  slice_costs.num_samples = static_cast<size_t>(num_depths) * num_rows * num_cols;
+
+  //linear between the sampled slices, and flat past the first + last one
+  int depth_idx = 0;
+  for (int z = 0; z < params.imdepth; ++z)
+  {
+    while(depth_idx + 1 < num_depths && sample_z[depth_idx + 1] <= z) {
+      ++depth_idx;
+    }
+    if(z <= sample_z[depth_idx] || depth_idx + 1 == num_depths) {
+      slice_costs.slice_cost[z] = sample_cost[depth_idx];
+    }
+    else
+    {
+      const double frac = static_cast<double>(z - sample_z[depth_idx]) / (sample_z[depth_idx + 1] - sample_z[depth_idx]);
+      slice_costs.slice_cost[z] = (1 - frac) * sample_cost[depth_idx] + frac * sample_cost[depth_idx + 1];
+    }
+  }
+
+  slice_costs.prepass_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - prepass_start).count();
+  return slice_costs;
+}
+
+/* How a request's work units went against the cost model: what each was predicted to take (its
+ * predicted cost over the worker's rate so far) and what it did take, plus when the workers ran out
+ * of work. The gap between the first and the last worker to finish is the tail the model is there to
+ * cut down.
+ */
+struct cost_report
+{
+  struct work_unit
+  {
+    size_t worker_idx;
+    int z_begin;
+    int z_end;
+    double predicted_cost;
+    //0 --> the worker had no rate to go by yet
+    double predicted_ms;
+    double actual_ms;
+    //since the start of the request
+    double finish_ms;
+  };
+
+  cost_report()
+    : prepass_ms(0)
+  {}
+
+  cost_report(std::vector<std::string> names, const double prepass_time)
+    : worker_names(std::move(names)), prepass_ms(prepass_time)
+  {}
+
+  inline void add_unit(const size_t worker_idx, const int z_begin, const int z_end, const double predicted_cost, const double predicted_ms, const double actual_ms,
+                       const double finish_ms)
+  {
+    units.push_back(work_unit{worker_idx, z_begin, z_end, predicted_cost, predicted_ms, actual_ms, finish_ms});
+  }
+
+  //when each worker finished its last unit (0 --> it didn't get any)
+  std::vector<double> get_finish_ms() const
+  {
+    std::vector<double> finish_ms (worker_names.size(), 0);
+    for (const auto& unit : units) {
+      finish_ms[unit.worker_idx] = std::max(finish_ms[unit.worker_idx], unit.finish_ms);
+    }
+    return finish_ms;
+  }
+
+  //from the first worker to run out of work to the last
+  double get_tail_ms() const
+  {
+    double first_finish = 0, last_finish = 0;
+    bool any_finished = false;
+    for (const double finish_ms : get_finish_ms())
+    {
+      if(finish_ms <= 0) {
+        continue;
+      }
+      first_finish = any_finished ? std::min(first_finish, finish_ms) : finish_ms;
+      last_finish = std::max(last_finish, finish_ms);
+      any_finished = true;
+    }
+    return last_finish - first_finish;
+  }
+
+  inline double get_run_ms() const
+  {
+    const auto finish_ms = get_finish_ms();
+    return finish_ms.empty() ? 0 : *std::max_element(finish_ms.begin(), finish_ms.end());
+  }
+
+  //the mean |predicted - actual| / actual of the units that had a prediction (-1 --> none did)
+  double get_prediction_error() const
+  {
+    double total_error = 0;
+    size_t num_predicted = 0;
+    for (const auto& unit : units)
+    {
+      if(unit.predicted_ms > 0 && unit.actual_ms > 0)
+      {
+        total_error += std::abs(unit.predicted_ms - unit.actual_ms) / unit.actual_ms;
+        ++num_predicted;
+      }
+    }
+    return (num_predicted > 0) ? total_error / num_predicted : -1;
+  }
+
+  void print_report() const
+  {
+    const double prediction_error = get_prediction_error();
+    std::cout << "Cost model: pre-pass " << prepass_ms << " ms, " << units.size() << " units, ";
+    if(prediction_error >= 0) {
+      std::cout << "predicted times off by " << 100 * prediction_error << "% on average" << std::endl;
+    }
+    else {
+      std::cout << "no predicted times yet (the workers haven't been measured)" << std::endl;
+    }
+
+    const auto finish_ms = get_finish_ms();
+    for (size_t worker_idx = 0; worker_idx < worker_names.size(); ++worker_idx)
+    {
+      size_t num_units = 0;
+      int num_slices = 0;
+      double predicted_ms = 0, actual_ms = 0;
+      for (const auto& unit : units)
+      {
+        if(unit.worker_idx == worker_idx)
+        {
+          ++num_units;
+          num_slices += unit.z_end - unit.z_begin;
+          predicted_ms += unit.predicted_ms;
+          actual_ms += unit.actual_ms;
+        }
+      }
+      std::cout << "  " << worker_names[worker_idx] << ": " << num_slices << " slices in " << num_units << " units, predicted " << predicted_ms << " ms, took " << actual_ms
+                << " ms, done at " << finish_ms[worker_idx] << " ms" << std::endl;
+    }
+    const double run_ms = get_run_ms();
+    std::cout << "  tail: " << get_tail_ms() << " ms between the first and the last worker to finish ("
+              << ((run_ms > 0) ? 100 * get_tail_ms() / run_ms : 0) << "% of the " << run_ms << " ms run)" << std::endl;
+  }
+
+  void write_json(std::ostream& json_out) const
+  {
+    json_out << "{\"prepass_ms\":" << prepass_ms << ",\"prediction_error\":" << get_prediction_error() << ",\"tail_ms\":" << get_tail_ms()
+             << ",\"run_ms\":" << get_run_ms() << ",\"workers\":[";
+    for (size_t worker_idx = 0; worker_idx < worker_names.size(); ++worker_idx) {
+      json_out << ((worker_idx > 0) ? "," : "") << "\"" << worker_names[worker_idx] << "\"";
+    }
+    json_out << "],\"units\":[";
+    for (size_t unit_idx = 0; unit_idx < units.size(); ++unit_idx)
+    {
+      const auto& unit = units[unit_idx];
+      json_out << ((unit_idx > 0) ? "," : "") << "{\"worker\":" << unit.worker_idx << ",\"slices\":[" << unit.z_begin << "," << unit.z_end
+               << "],\"predicted_cost\":" << unit.predicted_cost << ",\"predicted_ms\":" << unit.predicted_ms << ",\"actual_ms\":" << unit.actual_ms
+               << ",\"finish_ms\":" << unit.finish_ms << "}";
+    }
+    json_out << "]}";
+  }
+
+  std::vector<std::string> worker_names;
+  std::vector<work_unit> units;
+  double prepass_ms;
+};
+
+#endif
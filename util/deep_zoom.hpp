@@ -0,0 +1,362 @@
+/* deep_zoom.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_DEEP_ZOOM_HPP
+#define UTIL_DEEP_ZOOM_HPP
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cctype>
+#include <cstdint>
+#include <complex>
+#include <algorithm>
+#include <stdexcept>
+
+/* The host side of the deep-zoom 2D mandelbrot. Past a zoom of ~1e-5 the pixels of a view are closer
+ * together than a float can tell apart (~1e-14 for a double), so rather than iterating every pixel at
+ * the precision the zoom needs, only one point (the reference, at the centre of the view) is iterated
+ * in high precision. Every pixel then iterates its difference from the reference orbit,
+ *
+ *   d[n+1] = 2 Z[n] d[n] + d[n]^2 + dc
+ *
+ * which stays small enough for float/double no matter how deep the zoom is (down to where dc itself
+ * underflows: ~1e-38 for float deltas, ~1e-308 for double).
+ *
+ * The series approximation skips the first iterations. While the deltas are small, d[n] is
+ * approximately A[n] dc + B[n] dc^2 + C[n] dc^3, with the coefficients iterated once (from the reference)
+ * for the whole view, so every pixel starts at the last iteration that's still accurate for the view's
+ * corners.
+ *
+ * Where the reference orbit is no good for a pixel (the pixel's orbit gets closer to 0 than the delta is
+ * small, which is where the perturbation loses precision and shows up as glitched blobs, or the
+ * reference escapes before the pixel does), the pixel rebases: its full value becomes its delta, and it
+ * carries on from the start of the reference orbit. So one reference does for the whole view.
+ */
+namespace deep_zoom
+{
+
+//Fixed-point number with as many 32-bit limbs as it's made with: limbs[0..n-2] are the fraction (least
+//significant first), and limbs[n-1] is the integer part. The orbit never gets past |z| = 2 (+ |c|), so
+//that's plenty of integer range. Only has what the reference orbit needs.
+class hp_real
+{
+public:
+  explicit hp_real(const int num_limbs = 4)
+    : negative(false), limbs(std::max(2, num_limbs), 0)
+  {}
+
+  static hp_real from_double(const double value, const int num_limbs)
+  {
+    hp_real result(num_limbs);
+    double magnitude = std::fabs(value);
+    result.negative = value < 0;
+    result.limbs.back() = static_cast<uint32_t>(magnitude);
+    magnitude -= std::floor(magnitude);
+    //exact, as scaling by a power of 2 + taking off the integer part doesn't round
+    for (int limb_idx = result.num_limbs() - 2; limb_idx >= 0 && magnitude > 0; --limb_idx)
+    {
+      magnitude *= limb_scale;
+      result.limbs[limb_idx] = static_cast<uint32_t>(magnitude);
+      magnitude -= std::floor(magnitude);
+    }
+    return result;
+  }
+
+  //a plain decimal ("-0.7436438870371587047521915061"), to as many digits as the zoom needs
+  static hp_real from_string(const std::string& decimal, const int num_limbs)
+  {
+    hp_real result(num_limbs);
+    size_t char_idx = 0;
+    if(char_idx < decimal.size() && (decimal[char_idx] == '-' || decimal[char_idx] == '+')) {
+      result.negative = (decimal[char_idx++] == '-');
+    }
+
+    uint32_t integer_part = 0;
+    for (; char_idx < decimal.size() && decimal[char_idx] != '.'; ++char_idx)
+    {
+      if(!std::isdigit(static_cast<unsigned char>(decimal[char_idx]))) {
+        throw std::runtime_error("INVALID decimal -- " + decimal);
+      }
+      integer_part = 10 * integer_part + (decimal[char_idx] - '0');
+    }
+
+    //the fraction is built up from its last digit: frac = (digit + frac) / 10
+    for (size_t digit_idx = decimal.size(); digit_idx > char_idx + 1; --digit_idx)
+    {
+      const char digit = decimal[digit_idx - 1];
+      if(!std::isdigit(static_cast<unsigned char>(digit))) {
+        throw std::runtime_error("INVALID decimal -- " + decimal);
+      }
+      result.limbs.back() += digit - '0';
+      result.divide(10);
+    }
+    result.limbs.back() = integer_part;
+    return result;
+  }
+
+  double to_double() const
+  {
+    double value = 0;
+    for (int limb_idx = 0; limb_idx < num_limbs(); ++limb_idx) {
+      value += std::ldexp(static_cast<double>(limbs[limb_idx]), 32 * (limb_idx - (num_limbs() - 1)));
+    }
+    return negative ? -value : value;
+  }
+
+  hp_real operator+(const hp_real& other) const
+  {
+    if(negative == other.negative)
+    {
+      hp_real result = *this;
+      result.add_magnitude(other);
+      return result;
+    }
+    //opposite signs: the smaller magnitude comes off the bigger one, which keeps its sign
+    const bool this_bigger = compare_magnitude(other) >= 0;
+    hp_real result = this_bigger ? *this : other;
+    result.subtract_magnitude(this_bigger ? other : *this);
+    return result;
+  }
+
+  hp_real operator-(const hp_real& other) const
+  {
+    hp_real negated = other;
+    negated.negative = !negated.negative;
+    return *this + negated;
+  }
+
+  //truncated back to the same number of limbs (i.e. rounds towards 0 in the last bit)
+  hp_real operator*(const hp_real& other) const
+  {
+    const int n = num_limbs();
+    std::vector<uint64_t> product (2 * n + 1, 0);
+    for (int i = 0; i < n; ++i)
+    {
+      uint64_t carry = 0;
+      for (int j = 0; j < n; ++j)
+      {
+        const uint64_t partial = static_cast<uint64_t>(limbs[i]) * other.limbs[j] + product[i + j] + carry;
+        product[i + j] = partial & 0xffffffffu;
+        carry = partial >> 32;
+      }
+      product[i + n] += carry;
+    }
+
+    //the product has 2(n-1) fraction limbs, so the result is the n limbs from n-1 on
+    hp_real result(n);
+    for (int limb_idx = 0; limb_idx < n; ++limb_idx) {
+      result.limbs[limb_idx] = static_cast<uint32_t>(product[limb_idx + n - 1]);
+    }
+    result.negative = (negative != other.negative);
+    return result;
+  }
+
+  inline int num_limbs() const
+  {
+    return static_cast<int>(limbs.size());
+  }
+
+private:
+  void add_magnitude(const hp_real& other)
+  {
+    uint64_t carry = 0;
+    for (int limb_idx = 0; limb_idx < num_limbs(); ++limb_idx)
+    {
+      const uint64_t limb_sum = static_cast<uint64_t>(limbs[limb_idx]) + other.limbs[limb_idx] + carry;
+      limbs[limb_idx] = static_cast<uint32_t>(limb_sum);
+      carry = limb_sum >> 32;
+    }
+  }
+
+  //needs |other| <= |this|
+  void subtract_magnitude(const hp_real& other)
+  {
+    int64_t borrow = 0;
+    for (int limb_idx = 0; limb_idx < num_limbs(); ++limb_idx)
+    {
+      int64_t limb_diff = static_cast<int64_t>(limbs[limb_idx]) - other.limbs[limb_idx] - borrow;
+      borrow = (limb_diff < 0) ? 1 : 0;
+      limbs[limb_idx] = static_cast<uint32_t>(limb_diff + (borrow << 32));
+    }
+  }
+
+  int compare_magnitude(const hp_real& other) const
+  {
+    for (int limb_idx = num_limbs() - 1; limb_idx >= 0; --limb_idx)
+    {
+      if(limbs[limb_idx] != other.limbs[limb_idx]) {
+        return (limbs[limb_idx] > other.limbs[limb_idx]) ? 1 : -1;
+      }
+    }
+    return 0;
+  }
+
+  void divide(const uint32_t divisor)
+  {
+    uint64_t remainder = 0;
+    for (int limb_idx = num_limbs() - 1; limb_idx >= 0; --limb_idx)
+    {
+      const uint64_t dividend = (remainder << 32) | limbs[limb_idx];
+      limbs[limb_idx] = static_cast<uint32_t>(dividend / divisor);
+      remainder = dividend % divisor;
+    }
+  }
+
+  static constexpr double limb_scale = 4294967296.0;
+
+  bool negative;
+  std::vector<uint32_t> limbs;
+};
+
+//What to render: the centre (in decimal, as it needs more digits than a double has) and the width of
+//the view in the complex plane, at width x height pixels
+struct zoom_view
+{
+  zoom_view()
+    : center_real("-0.75"), center_imag("0"), view_width(3.0), width(256), height(256), max_iter(1000)
+  {}
+
+  inline double get_pixel_spacing() const
+  {
+    return view_width / std::max(1, width);
+  }
+
+  //the offset of the pixel from the centre, with the top row at the highest imaginary part
+  inline std::complex<double> get_pixel_offset(const int row, const int col) const
+  {
+    return std::complex<double>((col - 0.5 * width) * get_pixel_spacing(), (0.5 * height - row) * get_pixel_spacing());
+  }
+
+  //the distance from the centre to the corners
+  inline double get_radius() const
+  {
+    return 0.5 * std::hypot(static_cast<double>(width), static_cast<double>(height)) * get_pixel_spacing();
+  }
+
+  //enough bits to tell the pixels apart, plus 64 to spare for the rounding over the orbit
+  int get_num_limbs() const
+  {
+    const int spacing_bits = static_cast<int>(std::ceil(-std::log2(std::max(get_pixel_spacing(), 1e-300))));
+    return 1 + (std::max(0, spacing_bits) + 64 + 31) / 32;
+  }
+
+  std::string center_real;
+  std::string center_imag;
+  double view_width;
+  int width;
+  int height;
+  int max_iter;
+};
+
+//The orbit of the view's centre, Z[0] = 0 up to (and including) the first Z[n] past the escape radius,
+//or max_iter. Stored at double precision, which is all the deltas need of it
+struct reference_orbit
+{
+  inline int size() const
+  {
+    return static_cast<int>(orbit_real.size());
+  }
+
+  std::vector<double> orbit_real;
+  std::vector<double> orbit_imag;
+  //the reference escaped (at size()-1), rather than running to max_iter
+  bool escaped;
+};
+
+inline reference_orbit make_reference_orbit(const zoom_view& view)
+{
+  const int num_limbs = view.get_num_limbs();
+  const hp_real c_real = hp_real::from_string(view.center_real, num_limbs);
+  const hp_real c_imag = hp_real::from_string(view.center_imag, num_limbs);
+
+  reference_orbit reference;
+  reference.escaped = false;
+  reference.orbit_real.push_back(0);
+  reference.orbit_imag.push_back(0);
+  hp_real z_real(num_limbs), z_imag(num_limbs);
+  for (int iter_num = 0; iter_num < view.max_iter; ++iter_num)
+  {
+    const hp_real real_sq = z_real * z_real;
+    const hp_real imag_sq = z_imag * z_imag;
+    const hp_real real_imag = z_real * z_imag;
+    z_real = real_sq - imag_sq + c_real;
+    z_imag = real_imag + real_imag + c_imag;
+
+    const double orbit_real = z_real.to_double();
+    const double orbit_imag = z_imag.to_double();
+    reference.orbit_real.push_back(orbit_real);
+    reference.orbit_imag.push_back(orbit_imag);
+    if(orbit_real * orbit_real + orbit_imag * orbit_imag > 4)
+    {
+      reference.escaped = true;
+      break;
+    }
+  }
+  return reference;
+}
+
+//d[skip_iter] ~ A dc + B dc^2 + C dc^3, for all the pixels of the view
+struct series_approximation
+{
+  series_approximation()
+    : skip_iter(0), A(0), B(0), C(0)
+  {}
+
+  inline std::complex<double> get_delta(const std::complex<double> dc) const
+  {
+    return ((C * dc + B) * dc + A) * dc;
+  }
+
+  int skip_iter;
+  std::complex<double> A;
+  std::complex<double> B;
+  std::complex<double> C;
+};
+
+//Iterates the coefficients along the reference for as long as the series is accurate out to the view's
+//corners: the cubic term has to stay negligible next to the linear one, and no pixel can be near the
+//escape radius yet (the skipped iterations can't tell if one escaped)
+inline series_approximation make_series_approximation(const zoom_view& view, const reference_orbit& reference, const double tolerance = 1e-8)
+{
+  typedef std::complex<double> complex_t;
+  const double radius = view.get_radius();
+
+  series_approximation series;
+  complex_t A(0), B(0), C(0);
+  //stops short of the end of the orbit, as the pixels need a reference iteration to carry on from
+  for (int iter_num = 0; iter_num + 2 < reference.size(); ++iter_num)
+  {
+    const complex_t Z (reference.orbit_real[iter_num], reference.orbit_imag[iter_num]);
+    const complex_t next_A = 2.0 * Z * A + 1.0;
+    const complex_t next_B = 2.0 * Z * B + A * A;
+    const complex_t next_C = 2.0 * Z * C + 2.0 * A * B;
+
+    const double linear_term = std::abs(next_A) * radius;
+    const double cubic_term = std::abs(next_C) * radius * radius * radius;
+    const double max_delta = linear_term + std::abs(next_B) * radius * radius + cubic_term;
+    const double next_orbit = std::hypot(reference.orbit_real[iter_num + 1], reference.orbit_imag[iter_num + 1]);
+    if(!std::isfinite(max_delta) || cubic_term > tolerance * linear_term || next_orbit + max_delta > 2.0) {
+      break;
+    }
+
+    A = next_A;
+    B = next_B;
+    C = next_C;
+    series.skip_iter = iter_num + 1;
+    series.A = A;
+    series.B = B;
+    series.C = C;
+  }
+  return series;
+}
+
+} //namespace deep_zoom
+
+#endif
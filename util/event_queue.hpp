@@ -0,0 +1,239 @@
+/* event_queue.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_EVENT_QUEUE_HPP
+#define UTIL_EVENT_QUEUE_HPP
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+
+/* Spin-then-park wakeups. Every notify() bumps an epoch counter; a waiter that saw epoch N
+ * returns once the epoch moves past N. It spins on the counter first (cheap wakeups when events
+ * come in bursts), then parks on a condition variable. The spin budget adapts: waits that
+ * were satisfied while spinning grow it, waits that ended up parking shrink it.
+ */
+class event_waiter
+{
+public:
+    event_waiter()
+      : epoch(0), num_parked(0), spin_limit(min_spins), num_spin_wakeups(0), num_park_wakeups(0)
+    {}
+
+    inline uint64_t get_epoch() const
+    {
+        return epoch.load();
+    }
+
+    void notify()
+    {
+        epoch.fetch_add(1);
+        //NOTE: both are seq_cst, so either the parking thread sees the new epoch or we see it parked
+        if(num_parked.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            park_cv.notify_all();
+        }
+    }
+
+    //returns when the epoch moved past last_epoch, or keep_running was cleared (and notify() called)
+    void wait(const uint64_t last_epoch, const std::atomic<bool>& keep_running)
+    {
+        wait_until(last_epoch, keep_running, std::chrono::steady_clock::time_point::max());
+    }
+
+    //same, but gives up after the timeout
+    void wait_for(const uint64_t last_epoch, const std::atomic<bool>& keep_running, const std::chrono::milliseconds timeout)
+    {
+        wait_until(last_epoch, keep_running, std::chrono::steady_clock::now() + timeout);
+    }
+
+    inline uint64_t get_spin_wakeups() const { return num_spin_wakeups.load(); }
+    inline uint64_t get_park_wakeups() const { return num_park_wakeups.load(); }
+
+private:
+    void wait_until(const uint64_t last_epoch, const std::atomic<bool>& keep_running, const std::chrono::steady_clock::time_point deadline)
+    {
+        const int num_spins = spin_limit.load(std::memory_order_relaxed);
+        for (int i = 0; i < num_spins; ++i)
+        {
+            if(epoch.load() != last_epoch || !keep_running.load())
+            {
+                num_spin_wakeups.fetch_add(1, std::memory_order_relaxed);
+                spin_limit.store(std::min<int>(num_spins * 2, max_spins), std::memory_order_relaxed);
+                return;
+            }
+            cpu_relax(i);
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(park_mutex);
+            num_parked.fetch_add(1);
+            //NOTE: the 100ms timeout is only a backstop, the wakeups are all explicit
+            while(epoch.load() == last_epoch && keep_running.load())
+            {
+                const auto now = std::chrono::steady_clock::now();
+                if(now >= deadline) {
+                    break;
+                }
+                park_cv.wait_until(lock, std::min(deadline, now + std::chrono::milliseconds(100)));
+            }
+            num_parked.fetch_sub(1);
+        }
+        num_park_wakeups.fetch_add(1, std::memory_order_relaxed);
+        spin_limit.store(std::max<int>(num_spins / 2, min_spins), std::memory_order_relaxed);
+    }
+
+    static inline void cpu_relax(const int spin_idx)
+    {
+        //busy-wait for the first few rounds, then start giving up the core
+        if(spin_idx < yield_threshold)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    enum { min_spins = 64, max_spins = 16384, yield_threshold = 256 };
+
+    std::atomic<uint64_t> epoch;
+    std::atomic<int> num_parked;
+    std::mutex park_mutex;
+    std::condition_variable park_cv;
+
+    std::atomic<int> spin_limit;
+    std::atomic<uint64_t> num_spin_wakeups;
+    std::atomic<uint64_t> num_park_wakeups;
+};
+
+
+/* Bounded multi-producer/multi-consumer queue that can be waited on (instead of polled) from 
+ * either side. The events are a handful of requests/results per second at most, so a 
+ * plain locked deque is plenty -- the lockfree queues would need trivially copyable events.
+ */
+template <typename T, size_t queue_capacity>
+class event_queue
+{
+public:
+    bool push(const T& item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            if(event_buffer.size() >= queue_capacity) {
+                return false;
+            }
+            event_buffer.push_back(item);
+        }
+        waiter.notify();
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            if(event_buffer.empty()) {
+                return false;
+            }
+            item = std::move(event_buffer.front());
+            event_buffer.pop_front();
+        }
+        space_waiter.notify();
+        return true;
+    }
+
+    //blocks while the queue is full, so that the producer is held back rather than the item dropped.
+    //Returns false (without pushing) if keep_running gets cleared
+    bool wait_push(const T& item, const std::atomic<bool>& keep_running)
+    {
+        while(true)
+        {
+            const uint64_t last_epoch = space_waiter.get_epoch();
+            if(push(item)) {
+                return true;
+            }
+            if(!keep_running.load()) {
+                return false;
+            }
+            space_waiter.wait(last_epoch, keep_running);
+        }
+    }
+
+    inline size_t read_available() const
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        return event_buffer.size();
+    }
+
+    //blocks until an item is available. Returns false (without an item) if keep_running gets
+    //cleared -- whoever clears it has to call wake() afterwards
+    bool wait_pop(T& item, const std::atomic<bool>& keep_running)
+    {
+        while(true)
+        {
+            const uint64_t last_epoch = waiter.get_epoch();
+            if(pop(item)) {
+                return true;
+            }
+            if(!keep_running.load()) {
+                return false;
+            }
+            waiter.wait(last_epoch, keep_running);
+        }
+    }
+
+    //same as wait_pop, but also gives up (returning false) after the timeout
+    bool wait_pop_for(T& item, const std::atomic<bool>& keep_running, const std::chrono::milliseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while(true)
+        {
+            const uint64_t last_epoch = waiter.get_epoch();
+            if(pop(item)) {
+                return true;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            if(!keep_running.load() || now >= deadline) {
+                return false;
+            }
+            waiter.wait_for(last_epoch, keep_running, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+        }
+    }
+
+    //wakes up all the waiting consumers (and producers)
+    inline void wake()
+    {
+        waiter.notify();
+        space_waiter.notify();
+    }
+
+    inline const event_waiter& get_waiter() const
+    {
+        return waiter;
+    }
+
+private:
+    mutable std::mutex buffer_mutex;
+    std::deque<T> event_buffer;
+    event_waiter waiter;
+    //for producers waiting on a full queue
+    event_waiter space_waiter;
+};
+
+#endif
@@ -12,6 +12,11 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <memory>
+
+#include "util/generation_token.hpp"
+#include "util/fractal_stats.hpp"
 
 namespace fractal_types
 {
@@ -59,10 +64,57 @@ struct pointcloud
 
   std::vector<fractal_point<point_t, pixel_t>> cloud; 
 };
+
+//interleaved vertex layout for the hardware vertex buffer: [float3 position | ABGR colour]
+struct packed_vertex
+{
+  float x, y, z;
+  uint32_t colour;
+};
+
+//render-ready form of a point cloud. Built on the generation side so that the render 
+//thread only has to copy the vertices into a hardware buffer
+struct vertex_data
+{
+  vertex_data()
+    : centroid{0, 0, 0}, bounds_min{0, 0, 0}, bounds_max{0, 0, 0}, radius(0)
+  {}
+
+  std::vector<packed_vertex> vertices;
+
+  float centroid[3];
+  //extent of the (offset) vertex positions
+  float bounds_min[3];
+  float bounds_max[3];
+  float radius;
+};
+
+//the per-point colours of a point cloud, plus where its vertices get placed. This is the halfway
+//point between a point cloud and its vertex_data
+struct point_shading
+{
+  point_shading()
+    : centroid{0, 0, 0}, offset{0, 0, 0}, bounds_min{0, 0, 0}, bounds_max{0, 0, 0}
+  {}
+
+  //packed as in packed_vertex, one per point
+  std::vector<uint32_t> colours;
+
+  float centroid[3];
+  //subtracted from the point coordinates to get the vertex positions
+  float offset[3];
+  //extent of the (offset) vertex positions
+  float bounds_min[3];
+  float bounds_max[3];
+};
 } //namespace fractal_types
 
 struct fractal_params
 {
+  fractal_params()
+    : imheight(0), imwidth(0), imdepth(0), MIN_LIMIT(0), MAX_LIMIT(0), BOUNDARY_VAL(0), collect_stats(false)
+  {}
+
   int imheight;
   int imwidth;
   int imdepth;
@@ -75,30 +127,99 @@ struct fractal_params
   float BOUNDARY_VAL;
 
   std::string fractal_name;
+
+  //have the backend fill in a fractal_stats for the run. Doesn't change the fractal itself (i.e. not hashed)
+  bool collect_stats;
+
+  //polled by the backends between slices, and carries the progress of pre-empted requests.
+  //Not part of the fractal description (i.e. not hashed)
+  generation_token cancel_token;
+};
+
+//a plane through the fractal, sampled on a width x height grid: pixel (row, col) is the point
+//origin + col * (u_axis / width) + row * (v_axis / height). The coordinates are {x, y, z}, i.e. along
+//the {column, row, slice} axes of the stack, so the plane of a stack slice (see for_stack_slice) gets
+//exactly the voxels of that slice, and any other origin + axes give an oblique cut through the fractal
+struct slice_plane
+{
+  slice_plane()
+    : origin{-1.2f, -1.2f, 0}, u_axis{2.4f, 0, 0}, v_axis{0, 2.4f, 0}, width(0), height(0)
+  {}
+
+  slice_plane(const float plane_origin[3], const float plane_u[3], const float plane_v[3], const int plane_width, const int plane_height)
+    : origin{plane_origin[0], plane_origin[1], plane_origin[2]}, u_axis{plane_u[0], plane_u[1], plane_u[2]}, v_axis{plane_v[0], plane_v[1], plane_v[2]},
+      width(plane_width), height(plane_height)
+  {}
+
+  //slice depth_idx of the stack the params describe
+  static slice_plane for_stack_slice(const fractal_params& params, const int depth_idx)
+  {
+    const float limit_diff = params.MAX_LIMIT - params.MIN_LIMIT;
+    const float plane_origin [3] = {params.MIN_LIMIT, params.MIN_LIMIT, params.MIN_LIMIT + depth_idx * (limit_diff / params.imdepth)};
+    const float plane_u [3] = {limit_diff, 0, 0};
+    const float plane_v [3] = {0, limit_diff, 0};
+    return slice_plane(plane_origin, plane_u, plane_v, params.imwidth, params.imheight);
+  }
+
+  inline size_t num_pixels() const
+  {
+    return static_cast<size_t>(width) * height;
+  }
+
+  float origin [3];
+  //the extent of the plane along its columns and rows; they needn't be orthogonal (or the same length)
+  float u_axis [3];
+  float v_axis [3];
+  int width;
+  int height;
 };
 
 //holds the user input for fractal generation
 struct fractal_genevent
 {
   fractal_genevent()
+    : request_id(0), target_id(0)
   {}
 
-  fractal_genevent(fractal_params fparams, float x, float y, float z)
-    : params(fparams), target_coord{x, y, z}
+  fractal_genevent(fractal_params fparams, float x, float y, float z, uint64_t id = 0, uint64_t target = 0)
+    : params(fparams), target_coord{x, y, z}, request_id(id), target_id(target)
   {}
 
   fractal_params params;
   std::vector<float> target_coord;
+  //assigned by the requester; the results come back tagged with it (in completion order)
+  uint64_t request_id;
+  //what the request is for. A newer request for the same target supersedes the older ones (0 --> no target)
+  uint64_t target_id;
 };
 
 //holds the generated fractal data
 template <typename point_t, typename pixel_t>
 struct fractal_data
 {
-  fractal_types::pointcloud<point_t, pixel_t> point_cloud;
+  fractal_data()
+    : cache_key(0), request_id(0), cancelled(false), preempted(false), failed(false)
+  {}
+
+  //NOTE: these are shared so that repeated requests for the same fractal all point at one copy
+  std::shared_ptr<const fractal_types::pointcloud<point_t, pixel_t>> point_cloud;
+  std::shared_ptr<const fractal_types::vertex_data> vertices;
+  //only if the request asked for them (fractal_params::collect_stats)
+  std::shared_ptr<const fractal_stats> stats;
 	fractal_params params;
 
   std::vector<float> target_coord;
+  //identifies the fractal contents (i.e. fractal_cache_helpers::hash_params), same key --> same data
+  uint64_t cache_key;
+  //the fractal_genevent::request_id this was generated for
+  uint64_t request_id;
+  //the generation was cancelled part-way, so there's no cloud or vertices
+  bool cancelled;
+  //the generation was paused part-way to make room for more important work. The progress is kept
+  //with the request's token, so it can be resumed later
+  bool preempted;
+  //the backend couldn't generate it (see generation_token::fail), so there's no cloud or vertices
+  bool failed;
 };
 
 #endif
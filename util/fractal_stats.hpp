@@ -0,0 +1,163 @@
+/* fractal_stats.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_FRACTAL_STATS_HPP
+#define UTIL_FRACTAL_STATS_HPP
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+
+/* Where the iterations of one generation run went. Only collected when fractal_params::collect_stats
+ * is set, as it costs the backends a bit extra per voxel.
+ *
+ * The iteration counts are the number of fractal iterations evaluated for a voxel, so interior
+ * (i.e. never escaped) voxels come out at MAX_ITER. The bounding box is of the interior voxels, in
+ * the point cloud convention: x is the column, y the row and z the slice.
+ */
+struct fractal_stats
+{
+  enum { num_bins = 256 };
+
+  explicit fractal_stats(const int num_slices = 0)
+    : iteration_histogram(num_bins, 0), slice_iterations(num_slices, 0), slice_ms(num_slices, 0), total_iterations(0),
+      num_escaped(0), num_interior(0), bounds_min{std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), std::numeric_limits<int>::max()},
+      bounds_max{-1, -1, -1}
+  {}
+
+  //one voxel at a time, for the CPU backends
+  inline void add_voxel(const int x, const int y, const int z, const int num_iterations, const bool is_interior)
+  {
+    ++iteration_histogram[std::min<int>(num_iterations, num_bins-1)];
+    slice_iterations[z] += num_iterations;
+    total_iterations += num_iterations;
+    if(is_interior)
+    {
+      ++num_interior;
+      add_bounds(x, y, z, x, y, z);
+    }
+    else {
+      ++num_escaped;
+    }
+  }
+
+  inline void add_bounds(const int min_x, const int min_y, const int min_z, const int max_x, const int max_y, const int max_z)
+  {
+    bounds_min[0] = std::min(bounds_min[0], min_x);
+    bounds_min[1] = std::min(bounds_min[1], min_y);
+    bounds_min[2] = std::min(bounds_min[2], min_z);
+    bounds_max[0] = std::max(bounds_max[0], max_x);
+    bounds_max[1] = std::max(bounds_max[1], max_y);
+    bounds_max[2] = std::max(bounds_max[2], max_z);
+  }
+
+  //adds in the stats of another run over the same stack (e.g. another device's share of the slices)
+  void merge(const fractal_stats& other)
+  {
+    for (size_t bin_idx = 0; bin_idx < iteration_histogram.size(); ++bin_idx) {
+      iteration_histogram[bin_idx] += other.iteration_histogram[bin_idx];
+    }
+    for (size_t slice_idx = 0; slice_idx < std::min(slice_iterations.size(), other.slice_iterations.size()); ++slice_idx)
+    {
+      slice_iterations[slice_idx] += other.slice_iterations[slice_idx];
+      slice_ms[slice_idx] += other.slice_ms[slice_idx];
+    }
+    total_iterations += other.total_iterations;
+    num_escaped += other.num_escaped;
+    num_interior += other.num_interior;
+    if(other.has_bounds()) {
+      add_bounds(other.bounds_min[0], other.bounds_min[1], other.bounds_min[2], other.bounds_max[0], other.bounds_max[1], other.bounds_max[2]);
+    }
+  }
+
+  inline bool has_bounds() const
+  {
+    return num_interior > 0;
+  }
+
+  inline uint64_t get_num_voxels() const
+  {
+    return num_escaped + num_interior;
+  }
+
+  inline double get_mean_iterations() const
+  {
+    return (get_num_voxels() > 0) ? static_cast<double>(total_iterations) / get_num_voxels() : 0;
+  }
+
+  //the highest iteration count any voxel needed
+  int get_max_iterations() const
+  {
+    for (int bin_idx = num_bins-1; bin_idx >= 0; --bin_idx)
+    {
+      if(iteration_histogram[bin_idx] > 0) {
+        return bin_idx;
+      }
+    }
+    return 0;
+  }
+
+  void print_stats() const
+  {
+    std::cout << "Fractal stats: " << get_num_voxels() << " voxels (" << num_interior << " interior, " << num_escaped << " escaped), "
+              << total_iterations << " iterations (mean " << get_mean_iterations() << ", max " << get_max_iterations() << ")";
+    if(has_bounds()) {
+      std::cout << " -- bounds [" << bounds_min[0] << ", " << bounds_min[1] << ", " << bounds_min[2] << "] to ["
+                << bounds_max[0] << ", " << bounds_max[1] << ", " << bounds_max[2] << "]";
+    }
+    std::cout << std::endl;
+  }
+
+  void write_json(std::ostream& json_out) const
+  {
+    json_out << "{\"num_voxels\":" << get_num_voxels() << ",\"num_interior\":" << num_interior << ",\"num_escaped\":" << num_escaped
+             << ",\"total_iterations\":" << total_iterations << ",\"mean_iterations\":" << get_mean_iterations();
+    if(has_bounds()) {
+      json_out << ",\"bounds_min\":[" << bounds_min[0] << "," << bounds_min[1] << "," << bounds_min[2] << "],\"bounds_max\":["
+               << bounds_max[0] << "," << bounds_max[1] << "," << bounds_max[2] << "]";
+    }
+    //the histogram stops at the last non-empty bin
+    json_out << ",\"iteration_histogram\":";
+    write_json_array(json_out, iteration_histogram.begin(), iteration_histogram.begin() + get_max_iterations() + 1);
+    json_out << ",\"slice_iterations\":";
+    write_json_array(json_out, slice_iterations.begin(), slice_iterations.end());
+    json_out << ",\"slice_ms\":";
+    write_json_array(json_out, slice_ms.begin(), slice_ms.end());
+    json_out << "}";
+  }
+
+  //how many voxels needed each iteration count
+  std::vector<uint64_t> iteration_histogram;
+  //the per-slice cost, in iterations and in wall-clock time
+  std::vector<uint64_t> slice_iterations;
+  std::vector<double> slice_ms;
+
+  uint64_t total_iterations;
+  uint64_t num_escaped;
+  uint64_t num_interior;
+
+  //only meaningful if there are interior voxels
+  int bounds_min[3];
+  int bounds_max[3];
+
+private:
+  template <typename iter_t>
+  static void write_json_array(std::ostream& json_out, iter_t first, iter_t last)
+  {
+    json_out << "[";
+    for (auto elem_it = first; elem_it != last; ++elem_it) {
+      json_out << ((elem_it != first) ? "," : "") << *elem_it;
+    }
+    json_out << "]";
+  }
+};
+
+#endif
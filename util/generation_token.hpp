@@ -0,0 +1,205 @@
+/* generation_token.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_GENERATION_TOKEN_HPP
+#define UTIL_GENERATION_TOKEN_HPP
+
+#include <atomic>
+#include <memory>
+#include <functional>
+
+/* Shared control state for one generation request. Copies of a token all refer to the same state,
+ * so the scheduler can hold on to one copy while the backend polls another between work units
+ * (slices). A request can be cancelled (for good), or pre-empted: then the backend stops at a slice
+ * boundary and records where, and the partially filled stack is kept with the token so that
+ * whichever worker picks the request up again can resume from there. A backend that can't generate
+ * the request at all (e.g. the kernels don't build) marks it as failed, which is as final as a
+ * cancellation -- retrying it would only fail the same way. A default-constructed token can never be
+ * stopped, and can't record a failure either.
+ *
+ * The backends also report the slices as they land, which counts towards the request's progress and
+ * goes to the slice callback, if the requester set one.
+ */
+class generation_token
+{
+public:
+    //the slices [z_begin, z_end) are done; slice_data is their pixels in the stack (z_begin's first),
+    //or nullptr if the backend doesn't fill in a stack (e.g. it makes the points itself)
+    using slice_callback = std::function<void(int z_begin, int z_end, const void* slice_data)>;
+
+    generation_token()
+    {}
+
+    static generation_token make_token()
+    {
+        generation_token token;
+        token.token_state = std::make_shared<shared_state>();
+        return token;
+    }
+
+    inline void cancel()
+    {
+        if(token_state) {
+            token_state->cancelled.store(true);
+        }
+    }
+
+    inline bool is_cancelled() const
+    {
+        return token_state && token_state->cancelled.load(std::memory_order_relaxed);
+    }
+
+    inline void preempt()
+    {
+        if(token_state) {
+            token_state->preempted.store(true);
+        }
+    }
+
+    inline void clear_preempt()
+    {
+        if(token_state) {
+            token_state->preempted.store(false);
+        }
+    }
+
+    inline bool is_preempted() const
+    {
+        return token_state && token_state->preempted.load(std::memory_order_relaxed);
+    }
+
+    //the backend couldn't generate the request. Unlike a stop, nothing of it is kept to resume from
+    inline void fail() const
+    {
+        if(token_state) {
+            token_state->failed.store(true);
+        }
+    }
+
+    inline bool has_failed() const
+    {
+        return token_state && token_state->failed.load(std::memory_order_relaxed);
+    }
+
+    //whether this is more than a default-constructed token
+    inline bool has_state() const
+    {
+        return static_cast<bool>(token_state);
+    }
+
+    //polled by the backends between slices
+    inline bool should_stop() const
+    {
+        return is_cancelled() || is_preempted();
+    }
+
+    //NOTE: has to be set before the token goes to the backend. The callback gets called on the
+    //backend's threads, possibly several at once (e.g. one per device), so it has to be thread-safe
+    inline void set_slice_callback(slice_callback on_slices)
+    {
+        if(token_state) {
+            token_state->on_slices = std::move(on_slices);
+        }
+    }
+
+    //called by the backends as the slices land
+    inline void report_slices(const int z_begin, const int z_end, const void* slice_data) const
+    {
+        if(!token_state || z_end <= z_begin) {
+            return;
+        }
+        token_state->slices_done.fetch_add(z_end - z_begin);
+        if(token_state->on_slices) {
+            token_state->on_slices(z_begin, z_end, slice_data);
+        }
+    }
+
+    //how many slices are done, including the ones from before a pre-emption
+    inline int get_slices_done() const
+    {
+        return token_state ? token_state->slices_done.load(std::memory_order_relaxed) : 0;
+    }
+
+    //NOTE: the progress methods are const as they only touch the shared state. They're only called
+    //by whoever is running the request, and the hand-off to the next worker goes through the
+    //scheduler's lock, so they don't need to be atomic
+
+    //the backend stopped before generating this slice
+    inline void stop_at(const int slice_idx) const
+    {
+        if(token_state) {
+            token_state->resume_slice = slice_idx;
+            token_state->stopped_early = true;
+        }
+    }
+
+    inline bool stopped_early() const
+    {
+        return token_state && token_state->stopped_early;
+    }
+
+    //the first slice the backend has to generate
+    inline int get_resume_slice() const
+    {
+        return token_state ? token_state->resume_slice : 0;
+    }
+
+    //keeps the partial results around until the request is resumed. The type is erased, as it
+    //depends on which generator is running the request
+    inline void keep_partial(std::shared_ptr<void> partial_results) const
+    {
+        if(token_state) {
+            token_state->partial_results = std::move(partial_results);
+        }
+    }
+
+    //hands back the partial results, if there are any (otherwise the request starts over from
+    //the first slice). Either way, the request starts out as not stopped
+    template <typename T>
+    std::shared_ptr<T> take_partial() const
+    {
+        if(!token_state) {
+            return nullptr;
+        }
+        token_state->stopped_early = false;
+        if(!token_state->partial_results)
+        {
+            token_state->resume_slice = 0;
+            token_state->slices_done.store(0);
+            return nullptr;
+        }
+        //anything past the resume slice gets generated (and reported) again
+        token_state->slices_done.store(token_state->resume_slice);
+        auto partial_results = std::static_pointer_cast<T>(token_state->partial_results);
+        token_state->partial_results.reset();
+        return partial_results;
+    }
+
+private:
+    struct shared_state
+    {
+        shared_state()
+          : cancelled(false), preempted(false), failed(false), slices_done(0), stopped_early(false), resume_slice(0)
+        {}
+
+        std::atomic<bool> cancelled;
+        std::atomic<bool> preempted;
+        std::atomic<bool> failed;
+        std::atomic<int> slices_done;
+        slice_callback on_slices;
+
+        bool stopped_early;
+        int resume_slice;
+        std::shared_ptr<void> partial_results;
+    };
+
+    std::shared_ptr<shared_state> token_state;
+};
+
+#endif
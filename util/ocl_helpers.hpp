@@ -16,54 +16,232 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <iterator>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
 
 namespace ocl_helpers
 {
 
-std::tuple<cl_uint, cl_platform_id, bool> get_platform_id(const std::string& target_platform)
+inline std::string get_platform_string(const cl_platform_id platform_id, const cl_platform_info platform_param)
 {
-    //get the number of available platforms
-    cl_uint num_platforms;
-    clGetPlatformIDs (0, nullptr, &num_platforms);
-    
-    //get the platform IDs
+    size_t param_size = 0;
+    clGetPlatformInfo(platform_id, platform_param, 0, nullptr, &param_size);
+    std::vector<char> param_value (param_size + 1, 0);
+    clGetPlatformInfo(platform_id, platform_param, param_size, param_value.data(), nullptr);
+    return std::string(param_value.data());
+}
+
+inline std::string get_device_string(const cl_device_id device_id, const cl_device_info device_param)
+{
+    size_t param_size = 0;
+    clGetDeviceInfo(device_id, device_param, 0, nullptr, &param_size);
+    std::vector<char> param_value (param_size + 1, 0);
+    clGetDeviceInfo(device_id, device_param, param_size, param_value.data(), nullptr);
+    return std::string(param_value.data());
+}
+
+template <typename T>
+inline T get_device_value(const cl_device_id device_id, const cl_device_info device_param)
+{
+    T param_value = T();
+    clGetDeviceInfo(device_id, device_param, sizeof(T), &param_value, nullptr);
+    return param_value;
+}
+
+inline std::vector<cl_platform_id> get_platforms()
+{
+    cl_uint num_platforms = 0;
+    if(clGetPlatformIDs(0, nullptr, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        return std::vector<cl_platform_id>();
+    }
+
     std::vector<cl_platform_id> platform_IDs (num_platforms);
-    clGetPlatformIDs(num_platforms, &platform_IDs[0], nullptr);
+    clGetPlatformIDs(num_platforms, platform_IDs.data(), nullptr);
+    return platform_IDs;
+}
+
+//the index + ID of the first platform with target_platform in its name. The bool is false (and the
+//ID nullptr) if there's no such platform
+inline std::tuple<cl_uint, cl_platform_id, bool> get_platform_id(const std::string& target_platform)
+{
+    const std::vector<cl_platform_id> platform_IDs = get_platforms();
+    for(cl_uint i = 0; i < platform_IDs.size(); ++i)
+    {
+        if (get_platform_string(platform_IDs[i], CL_PLATFORM_NAME).find(target_platform) != std::string::npos) {
+            return std::make_tuple(i, platform_IDs[i], true);
+        }
+    }
+    return std::make_tuple(cl_uint(0), static_cast<cl_platform_id>(nullptr), false);
+}
+
+//what's worth knowing about a device when picking which ones to generate on
+struct ocl_device_info
+{
+    ocl_device_info()
+      : platform_id(nullptr), device_id(nullptr), device_type(0), compute_units(0), clock_mhz(0), global_mem_bytes(0), has_fp64(false)
+    {}
+
+    inline bool is_gpu() const
+    {
+        return (device_type & CL_DEVICE_TYPE_GPU) != 0;
+    }
+
+    inline bool is_cpu() const
+    {
+        return (device_type & CL_DEVICE_TYPE_CPU) != 0;
+    }
+
+    //a rough guess at the relative speed, for before there's been a measured run. A GPU compute unit
+    //has many more lanes than a CPU core has SIMD lanes
+    inline double get_speed_estimate() const
+    {
+        return compute_units * std::max<cl_uint>(clock_mhz, 1) * (is_gpu() ? 32.0 : 4.0);
+    }
 
-    //look for the target platform 
-    cl_uint target_platform_ID;
-    bool found_target = false;
-    for(cl_uint i = 0; i < num_platforms; ++i)
+    std::string get_description() const
     {
-        size_t platform_size;
-        clGetPlatformInfo(platform_IDs[i], CL_PLATFORM_PROFILE, 0, nullptr, &platform_size);
-        
-        std::vector<char> curr_platform(platform_size);       
-        clGetPlatformInfo (platform_IDs[i], CL_PLATFORM_NAME, platform_size, &curr_platform[0], nullptr);
-        
-        auto platform_profile = std::string(curr_platform.begin(), curr_platform.end());
-        if (platform_profile.find(target_platform) != std::string::npos) 
+        return device_name + " (" + (is_gpu() ? "GPU" : (is_cpu() ? "CPU" : "other")) + ", " + std::to_string(compute_units) + " CUs @ " + 
+               std::to_string(clock_mhz) + " MHz) on " + platform_name;
+    }
+
+    cl_platform_id platform_id;
+    cl_device_id device_id;
+    std::string platform_name;
+    std::string device_name;
+    std::string device_version;
+    std::string driver_version;
+    cl_device_type device_type;
+    cl_uint compute_units;
+    cl_uint clock_mhz;
+    cl_ulong global_mem_bytes;
+    bool has_fp64;
+};
+
+//every available device of every platform
+inline std::vector<ocl_device_info> get_devices()
+{
+    std::vector<ocl_device_info> devices;
+    for (const cl_platform_id platform_id : get_platforms())
+    {
+        cl_uint num_devices = 0;
+        if(clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 0, nullptr, &num_devices) != CL_SUCCESS || num_devices == 0) {
+            continue;
+        }
+        std::vector<cl_device_id> device_IDs (num_devices);
+        clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, num_devices, device_IDs.data(), nullptr);
+
+        const std::string platform_name = get_platform_string(platform_id, CL_PLATFORM_NAME);
+        for (const cl_device_id device_id : device_IDs)
         {
-            target_platform_ID = i;
-            found_target = true;
-            break;
+            if(!get_device_value<cl_bool>(device_id, CL_DEVICE_AVAILABLE)) {
+                continue;
+            }
+
+            ocl_device_info device_info;
+            device_info.platform_id = platform_id;
+            device_info.device_id = device_id;
+            device_info.platform_name = platform_name;
+            device_info.device_name = get_device_string(device_id, CL_DEVICE_NAME);
+            device_info.device_version = get_device_string(device_id, CL_DEVICE_VERSION);
+            device_info.driver_version = get_device_string(device_id, CL_DRIVER_VERSION);
+            device_info.device_type = get_device_value<cl_device_type>(device_id, CL_DEVICE_TYPE);
+            device_info.compute_units = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_COMPUTE_UNITS);
+            device_info.clock_mhz = get_device_value<cl_uint>(device_id, CL_DEVICE_MAX_CLOCK_FREQUENCY);
+            device_info.global_mem_bytes = get_device_value<cl_ulong>(device_id, CL_DEVICE_GLOBAL_MEM_SIZE);
+            device_info.has_fp64 = get_device_string(device_id, CL_DEVICE_EXTENSIONS).find("cl_khr_fp64") != std::string::npos;
+            devices.push_back(device_info);
         }
     }
-    return std::make_tuple(target_platform_ID, platform_IDs[target_platform_ID], found_target);
+    return devices;
 }
 
-bool load_kernel_file(const std::string& file_name, std::string& kernel_source)
+//which of the devices to generate on
+struct ocl_device_selection
 {
-    std::ifstream kernel_source_file(file_name);
-    std::string str; 
+    enum device_policy
+    {
+        //the fastest GPU, or the fastest device of any kind if there's no GPU
+        prefer_gpu,
+        //every GPU / every CPU device / every device, splitting the work between them
+        all_gpus,
+        all_cpus,
+        all_devices
+    };
 
-    int i = 0;
-    while (std::getline(kernel_source_file, str))
+    ocl_device_selection()
+      : policy(prefer_gpu), platform_filter(""), max_devices(0)
+    {}
+
+    //accepts the enum names; false if there's no such policy
+    static bool parse_policy(const std::string& policy_name, device_policy& device_pol)
     {
-        std::cout << "@ " << i++ << "  " << str << std::endl;
-        kernel_source += str; 
+        static const std::map<std::string, device_policy> policy_names
+        {
+            {"prefer_gpu", prefer_gpu},
+            {"all_gpus", all_gpus},
+            {"all_cpus", all_cpus},
+            {"all_devices", all_devices}
+        };
+        auto policy_it = policy_names.find(policy_name);
+        if(policy_it == policy_names.end()) {
+            return false;
+        }
+        device_pol = policy_it->second;
+        return true;
+    }
+
+    device_policy policy;
+    //only devices of platforms with this in their name; empty string --> any platform
+    std::string platform_filter;
+    //0 --> no limit
+    int max_devices;
+};
+
+//the devices picked by the selection, fastest (by estimate) first
+inline std::vector<ocl_device_info> select_devices(std::vector<ocl_device_info> devices, const ocl_device_selection& selection)
+{
+    typedef ocl_device_selection selection_t;
+    devices.erase(std::remove_if(devices.begin(), devices.end(), [&selection](const ocl_device_info& device_info)
+        {
+            if(device_info.platform_name.find(selection.platform_filter) == std::string::npos) {
+                return true;
+            }
+            return (selection.policy == selection_t::all_gpus && !device_info.is_gpu()) || 
+                   (selection.policy == selection_t::all_cpus && !device_info.is_cpu());
+        }), devices.end());
+
+    std::stable_sort(devices.begin(), devices.end(), [](const ocl_device_info& lhs, const ocl_device_info& rhs)
+        {
+            return lhs.get_speed_estimate() > rhs.get_speed_estimate();
+        });
+
+    if(selection.policy == selection_t::prefer_gpu)
+    {
+        auto gpu_it = std::find_if(devices.begin(), devices.end(), [](const ocl_device_info& device_info) { return device_info.is_gpu(); });
+        if(gpu_it != devices.end()) {
+            std::rotate(devices.begin(), gpu_it, std::next(gpu_it));
+        }
+        devices.resize(std::min<size_t>(devices.size(), 1));
+    }
+    if(selection.max_devices > 0 && devices.size() > static_cast<size_t>(selection.max_devices)) {
+        devices.resize(selection.max_devices);
+    }
+    return devices;
+}
+
+//reads the whole kernel file; false if it couldn't be read
+inline bool load_kernel_file(const std::string& file_name, std::string& kernel_source)
+{
+    std::ifstream kernel_source_file(file_name);
+    if(!kernel_source_file) {
+        return false;
     }
 
+    //NOTE: keep the line breaks, otherwise the first // comment swallows the rest of the program
+    kernel_source.assign(std::istreambuf_iterator<char>(kernel_source_file), std::istreambuf_iterator<char>());
     return true;
 }
 
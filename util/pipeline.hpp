@@ -0,0 +1,205 @@
+/* pipeline.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_PIPELINE_HPP
+#define UTIL_PIPELINE_HPP
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+#include "util/trace.hpp"
+
+//what one stage has been up to. The times are summed over all of the stage's workers
+struct pipeline_stage_stats
+{
+    pipeline_stage_stats()
+      : num_workers(0), queue_depth(0), peak_queue_depth(0), num_items(0), idle_ms(0), busy_ms(0), stall_ms(0), elapsed_ms(0)
+    {}
+
+    //items per second of wall-clock time
+    inline double get_throughput() const
+    {
+        return (elapsed_ms > 0) ? 1000.0 * num_items / elapsed_ms : 0;
+    }
+
+    std::string name;
+    int num_workers;
+    //of the stage's input
+    size_t queue_depth;
+    size_t peak_queue_depth;
+
+    size_t num_items;
+    //waiting for input
+    double idle_ms;
+    //doing the work
+    double busy_ms;
+    //waiting for room downstream (i.e. backpressure)
+    double stall_ms;
+    //since the stage was started
+    double elapsed_ms;
+};
+
+/* One stage of a processing pipeline: a handful of worker threads that take items from a source,
+ * work on them and hand them on to a sink. Both ends block -- the source until there's an item,
+ * the sink until there's room for it downstream -- so a slow stage holds back the ones before it
+ * instead of anything getting dropped. The source and sink return false once the pipeline is
+ * shutting down, which ends the workers.
+ *
+ * The work function gets the worker's index (for any per-worker state) and returns false if the
+ * item shouldn't go any further (e.g. a cancelled request).
+ */
+template <typename item_t>
+class pipeline_stage
+{
+public:
+    typedef std::function<bool(item_t&)> source_fn;
+    typedef std::function<bool(int, item_t&)> work_fn;
+    typedef std::function<bool(item_t&)> sink_fn;
+    typedef std::function<size_t()> depth_fn;
+
+    pipeline_stage(const std::string& stage_name, const int num_workers, source_fn source, work_fn work, sink_fn sink, depth_fn input_depth = depth_fn())
+      : stage_name(stage_name), wait_name(stage_name + "_wait"), stall_name(stage_name + "_stall"), num_workers(num_workers), 
+        source(source), work(work), sink(sink), input_depth(input_depth), peak_depth(0), num_items(0), idle_time_us(0), busy_time_us(0), stall_time_us(0)
+    {}
+
+    ~pipeline_stage()
+    {
+        join();
+    }
+
+    void start()
+    {
+        start_time = clock_type::now();
+        for (int worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+            stage_workers.emplace_back(&pipeline_stage<item_t>::stage_loop, this, worker_idx);
+        }
+    }
+
+    //the source + sink have to have been told to shut down first
+    void join()
+    {
+        for (auto& stage_worker : stage_workers) {
+            stage_worker.join();
+        }
+        stage_workers.clear();
+    }
+
+    //can be polled from any thread while the stage is running
+    pipeline_stage_stats get_stats() const
+    {
+        pipeline_stage_stats stats;
+        stats.name = stage_name;
+        stats.num_workers = num_workers;
+        stats.queue_depth = input_depth ? input_depth() : 0;
+        //NOTE: the peak is only sampled when a worker asks for input, so include the current depth too
+        stats.peak_queue_depth = std::max(peak_depth.load(), stats.queue_depth);
+        stats.num_items = num_items.load();
+        stats.idle_ms = idle_time_us.load() / 1000.0;
+        stats.busy_ms = busy_time_us.load() / 1000.0;
+        stats.stall_ms = stall_time_us.load() / 1000.0;
+        stats.elapsed_ms = std::chrono::duration<double, std::milli>(clock_type::now() - start_time).count();
+        return stats;
+    }
+
+    static void print_stats(const pipeline_stage_stats& stats)
+    {
+        std::cout << "Stage " << stats.name << " (" << stats.num_workers << " workers): " << stats.num_items << " items ("
+                  << stats.get_throughput() << "/s), queue " << stats.queue_depth << " (peak " << stats.peak_queue_depth << ") -- busy "
+                  << stats.busy_ms << " ms, idle " << stats.idle_ms << " ms, stalled " << stats.stall_ms << " ms" << std::endl;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock_type;
+
+    static inline uint64_t elapsed_us(const clock_type::time_point& start, const clock_type::time_point& end)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    }
+
+    void stage_loop(const int worker_idx)
+    {
+        FRACTAL_TRACE_THREAD_NAME(stage_name + "_" + std::to_string(worker_idx));
+
+        item_t item;
+        while(true)
+        {
+            auto idle_start = clock_type::now();
+            if(input_depth) {
+                update_peak(input_depth());
+            }
+            bool has_item;
+            {
+                FRACTAL_TRACE_SCOPE(wait_name);
+                has_item = source(item);
+            }
+            auto busy_start = clock_type::now();
+            idle_time_us.fetch_add(elapsed_us(idle_start, busy_start));
+            if(!has_item) {
+                break;
+            }
+
+            bool pass_on;
+            {
+                FRACTAL_TRACE_SCOPE(stage_name);
+                pass_on = work(worker_idx, item);
+            }
+            auto stall_start = clock_type::now();
+            busy_time_us.fetch_add(elapsed_us(busy_start, stall_start));
+            if(!pass_on) {
+                continue;
+            }
+
+            num_items.fetch_add(1);
+            bool is_running;
+            {
+                FRACTAL_TRACE_SCOPE(stall_name);
+                is_running = sink(item);
+            }
+            stall_time_us.fetch_add(elapsed_us(stall_start, clock_type::now()));
+            if(!is_running) {
+                break;
+            }
+        }
+    }
+
+    inline void update_peak(const size_t depth)
+    {
+        size_t prev_peak = peak_depth.load();
+        while(depth > prev_peak && !peak_depth.compare_exchange_weak(prev_peak, depth))
+        {}
+    }
+
+    const std::string stage_name;
+    //span names for the trace (copied into the trace registry, so the stage can go before the export)
+    const std::string wait_name;
+    const std::string stall_name;
+    const int num_workers;
+    source_fn source;
+    work_fn work;
+    sink_fn sink;
+    depth_fn input_depth;
+
+    std::vector<std::thread> stage_workers;
+    clock_type::time_point start_time;
+
+    std::atomic<size_t> peak_depth;
+    std::atomic<size_t> num_items;
+    std::atomic<uint64_t> idle_time_us;
+    std::atomic<uint64_t> busy_time_us;
+    std::atomic<uint64_t> stall_time_us;
+};
+
+#endif
@@ -0,0 +1,306 @@
+/* request_scheduler.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_REQUEST_SCHEDULER_HPP
+#define UTIL_REQUEST_SCHEDULER_HPP
+
+#include <deque>
+#include <mutex>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+
+#include "util/event_queue.hpp"
+#include "util/camera_view.hpp"
+#include "util/fractal_helpers.hpp"
+#include "util/generation_token.hpp"
+
+/* Holds the generation requests between the request queue and the workers. Every request gets a
+ * fresh cancellation token when it's submitted; a newer request for the same target supersedes
+ * the older one, whether that one is still queued (dropped) or already being generated (cancelled).
+ *
+ * With a camera view set, the pending requests are served by priority rather than in arrival order:
+ * targets in view first, then the closest to the camera. The priorities are worked out against the
+ * latest camera snapshot whenever a request is handed out, so they follow the camera around. When
+ * all the workers are busy and something in view is waiting on work that's out of view, the
+ * out-of-view work gets pre-empted at the next slice and re-queued to resume later.
+ *
+ * The workers wait on it the same way as on an event_queue.
+ */
+class request_scheduler
+{
+public:
+    explicit request_scheduler(const int num_workers = 1)
+      : num_workers(num_workers), num_superseded(0), num_cancelled(0), num_preempted(0)
+    {}
+
+    static constexpr uint64_t no_target = 0;
+
+    //without a camera view, the requests are served in arrival order
+    void set_camera_view(std::shared_ptr<const camera_view> view)
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        fractal_view = std::move(view);
+    }
+
+    void submit(fractal_genevent fgen_evt)
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+
+        fgen_evt.params.cancel_token = generation_token::make_token();
+        const uint64_t target_id = fgen_evt.target_id;
+
+        //requests without a target never supersede anything
+        if(target_id != no_target)
+        {
+            auto superseded_it = std::remove_if(pending_requests.begin(), pending_requests.end(),
+                [target_id](const fractal_genevent& pending_evt)
+                {
+                    return pending_evt.target_id == target_id;
+                });
+            num_superseded += std::distance(superseded_it, pending_requests.end());
+            pending_requests.erase(superseded_it, pending_requests.end());
+
+            for (auto& active_request : active_requests)
+            {
+                if(active_request.target_id == target_id)
+                {
+                    active_request.params.cancel_token.cancel();
+                    ++num_superseded;
+                }
+            }
+        }
+
+        pending_requests.push_back(fgen_evt);
+        preempt_requests();
+        request_waiter.notify();
+    }
+
+    //takes the most important pending request (if any) and marks it as in-flight
+    bool next(fractal_genevent& fgen_evt)
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        if(pending_requests.empty()) {
+            return false;
+        }
+
+        const camera_snapshot snapshot = get_snapshot();
+        auto next_it = pending_requests.begin();
+        request_priority next_priority = get_priority(*next_it, snapshot);
+        for (auto pending_it = std::next(next_it); pending_it != pending_requests.end(); ++pending_it)
+        {
+            //NOTE: strictly better only, so equal priorities stay in arrival order
+            const request_priority priority = get_priority(*pending_it, snapshot);
+            if(priority.is_before(next_priority))
+            {
+                next_it = pending_it;
+                next_priority = priority;
+            }
+        }
+
+        fgen_evt = *next_it;
+        pending_requests.erase(next_it);
+        active_requests.push_back(fgen_evt);
+        return true;
+    }
+
+    //the request is done with, one way or another
+    void complete(const fractal_genevent& fgen_evt)
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        auto active_it = find_active(fgen_evt.request_id);
+        if(active_it != active_requests.end()) {
+            active_requests.erase(active_it);
+        }
+    }
+
+    //the request was pre-empted part-way; it goes back in the queue to be resumed later
+    void requeue(const fractal_genevent& fgen_evt)
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        auto active_it = find_active(fgen_evt.request_id);
+        if(active_it == active_requests.end()) {
+            return;
+        }
+
+        active_it->params.cancel_token.clear_preempt();
+        pending_requests.push_back(*active_it);
+        active_requests.erase(active_it);
+        request_waiter.notify();
+    }
+
+    //re-checks whether any in-flight work should make way, e.g. after the camera moved
+    void reprioritize()
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        preempt_requests();
+    }
+
+    //cancels the request wherever it is; returns false if it's unknown (or already done)
+    bool cancel(const uint64_t request_id)
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+
+        auto pending_it = std::find_if(pending_requests.begin(), pending_requests.end(),
+            [request_id](const fractal_genevent& pending_evt)
+            {
+                return pending_evt.request_id == request_id;
+            });
+        if(pending_it != pending_requests.end())
+        {
+            pending_requests.erase(pending_it);
+            ++num_cancelled;
+            return true;
+        }
+
+        auto active_it = find_active(request_id);
+        if(active_it != active_requests.end())
+        {
+            active_it->params.cancel_token.cancel();
+            ++num_cancelled;
+            return true;
+        }
+        return false;
+    }
+
+    //same protocol as event_queue: take the epoch, check next(), and wait if there was nothing
+    inline uint64_t get_epoch() const
+    {
+        return request_waiter.get_epoch();
+    }
+
+    inline void wait(const uint64_t last_epoch, const std::atomic<bool>& keep_running)
+    {
+        request_waiter.wait(last_epoch, keep_running);
+    }
+
+    inline void wake()
+    {
+        request_waiter.notify();
+    }
+
+    inline const event_waiter& get_waiter() const
+    {
+        return request_waiter;
+    }
+
+    void print_stats() const
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        std::cout << "Scheduler: " << pending_requests.size() << " pending, " << active_requests.size() << " in-flight -- "
+                  << num_superseded << " superseded, " << num_cancelled << " cancelled, " << num_preempted << " pre-empted" << std::endl;
+    }
+
+private:
+    struct request_priority
+    {
+        bool is_visible;
+        float distance_sq;
+
+        //in view beats out of view, then closer beats farther
+        inline bool is_before(const request_priority& other) const
+        {
+            if(is_visible != other.is_visible) {
+                return is_visible;
+            }
+            return distance_sq < other.distance_sq;
+        }
+    };
+
+    inline camera_snapshot get_snapshot() const
+    {
+        return fractal_view ? fractal_view->get_snapshot() : camera_snapshot();
+    }
+
+    static request_priority get_priority(const fractal_genevent& fgen_evt, const camera_snapshot& snapshot)
+    {
+        float target_centre [3] = {0, 0, 0};
+        std::copy_n(fgen_evt.target_coord.begin(), std::min<size_t>(fgen_evt.target_coord.size(), 3), target_centre);
+        const float target_radius = 0.5f * snapshot.world_scale * std::sqrt(static_cast<float>(fgen_evt.params.imheight * fgen_evt.params.imheight +
+                                                                                                fgen_evt.params.imwidth * fgen_evt.params.imwidth +
+                                                                                                fgen_evt.params.imdepth * fgen_evt.params.imdepth));
+        request_priority priority;
+        priority.is_visible = snapshot.is_visible(target_centre, target_radius);
+        priority.distance_sq = snapshot.distance_sq(target_centre);
+        return priority;
+    }
+
+    std::vector<fractal_genevent>::iterator find_active(const uint64_t request_id)
+    {
+        return std::find_if(active_requests.begin(), active_requests.end(),
+            [request_id](const fractal_genevent& active_evt)
+            {
+                return active_evt.request_id == request_id;
+            });
+    }
+
+    //pre-empts out-of-view work for as many in-view requests as there aren't idle workers for.
+    //Only visibility counts here -- pre-empting over distance alone would thrash as the camera moves
+    void preempt_requests()
+    {
+        if(!fractal_view) {
+            return;
+        }
+
+        const int num_idle = num_workers - static_cast<int>(active_requests.size());
+        const camera_snapshot snapshot = get_snapshot();
+        int num_waiting = -num_idle;
+        for (const auto& pending_request : pending_requests)
+        {
+            if(get_priority(pending_request, snapshot).is_visible) {
+                ++num_waiting;
+            }
+        }
+
+        while(num_waiting > 0)
+        {
+            //the farthest out-of-view request that isn't already on its way out
+            auto preempt_it = active_requests.end();
+            request_priority preempt_priority {false, 0};
+            for (auto active_it = active_requests.begin(); active_it != active_requests.end(); ++active_it)
+            {
+                const auto& active_token = active_it->params.cancel_token;
+                if(active_token.is_preempted() || active_token.is_cancelled()) {
+                    continue;
+                }
+                const request_priority priority = get_priority(*active_it, snapshot);
+                if(!priority.is_visible && (preempt_it == active_requests.end() || preempt_priority.is_before(priority)))
+                {
+                    preempt_it = active_it;
+                    preempt_priority = priority;
+                }
+            }
+            if(preempt_it == active_requests.end()) {
+                break;
+            }
+
+            preempt_it->params.cancel_token.preempt();
+            ++num_preempted;
+            --num_waiting;
+        }
+    }
+
+    const int num_workers;
+    std::shared_ptr<const camera_view> fractal_view;
+
+    mutable std::mutex scheduler_mutex;
+    std::deque<fractal_genevent> pending_requests;
+    //one per busy worker, so there's only ever a handful
+    std::vector<fractal_genevent> active_requests;
+    event_waiter request_waiter;
+
+    size_t num_superseded;
+    size_t num_cancelled;
+    size_t num_preempted;
+};
+
+#endif
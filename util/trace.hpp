@@ -0,0 +1,224 @@
+/* trace.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_TRACE_HPP
+#define UTIL_TRACE_HPP
+
+/* Span tracing, exported in the Chrome trace event format (load it in chrome://tracing or Perfetto).
+ * Only compiled in with FRACTAL_ENABLE_TRACING defined (the FRACTAL_ENABLE_TRACING cmake option);
+ * otherwise all the macros expand to nothing.
+ *
+ *   FRACTAL_TRACE_SCOPE("name")              -- span from here to the end of the scope
+ *   FRACTAL_TRACE_SCOPE_ARG("name", value)   -- same, tagged with an integer (slice index, request ID...)
+ *   FRACTAL_TRACE_THREAD_NAME(name)          -- labels the calling thread in the trace
+ *   FRACTAL_TRACE_EXPORT(filename)           -- writes out everything recorded so far
+ *
+ * A const char* name has to outlive the trace (i.e. a string literal), as only the pointer is recorded.
+ * A std::string name gets copied into the registry the first time it's seen, which takes a lock, so
+ * keep those to the coarser spans. Every thread writes into its own fixed-size ring buffer without
+ * any locking, so the oldest events get overwritten once a thread has recorded more than fits.
+ */
+
+#ifdef FRACTAL_ENABLE_TRACING
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+
+namespace fractal_trace
+{
+
+struct trace_event
+{
+    const char* name;
+    uint64_t start_us;
+    uint64_t duration_us;
+    int64_t arg;
+    bool has_arg;
+};
+
+class thread_ring
+{
+public:
+    explicit thread_ring(const int thread_id)
+      : thread_id(thread_id), events(ring_capacity), write_idx(0)
+    {}
+
+    inline void record(const trace_event& evt)
+    {
+        const uint64_t idx = write_idx.load(std::memory_order_relaxed);
+        events[idx % ring_capacity] = evt;
+        write_idx.store(idx + 1, std::memory_order_release);
+    }
+
+    enum { ring_capacity = 1 << 16 };
+
+    const int thread_id;
+    std::string thread_name;
+    std::vector<trace_event> events;
+    std::atomic<uint64_t> write_idx;
+};
+
+class trace_registry
+{
+public:
+    static trace_registry& get()
+    {
+        static trace_registry registry;
+        return registry;
+    }
+
+    //the ring of the calling thread. It's shared with the registry, so the events outlive the thread
+    thread_ring& get_ring()
+    {
+        thread_local std::shared_ptr<thread_ring> local_ring;
+        if(!local_ring)
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            local_ring = std::make_shared<thread_ring>(static_cast<int>(thread_rings.size()));
+            thread_rings.push_back(local_ring);
+        }
+        return *local_ring;
+    }
+
+    //a copy of the name that lives as long as the registry
+    const char* intern_name(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        return span_names.insert(name).first->c_str();
+    }
+
+    inline uint64_t now_us() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace_start).count();
+    }
+
+    //NOTE: meant to be called once the traced threads have gone quiet; events written during the
+    //export might come out torn
+    bool export_chrome_trace(const std::string& trace_filename)
+    {
+        std::ofstream trace_file(trace_filename);
+        if(!trace_file) {
+            std::cout << "WARNING: couldn't write the trace file " << trace_filename << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        trace_file << "{\"traceEvents\":[";
+        bool is_first = true;
+        auto separator = [&is_first]() { const char* sep = is_first ? "\n" : ",\n"; is_first = false; return sep; };
+
+        for (const auto& ring : thread_rings)
+        {
+            if(!ring->thread_name.empty())
+            {
+                trace_file << separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->thread_id
+                           << ",\"args\":{\"name\":\"" << ring->thread_name << "\"}}";
+            }
+
+            const uint64_t num_written = ring->write_idx.load(std::memory_order_acquire);
+            const uint64_t first_idx = (num_written > thread_ring::ring_capacity) ? num_written - thread_ring::ring_capacity : 0;
+            for (uint64_t idx = first_idx; idx < num_written; ++idx)
+            {
+                const trace_event& evt = ring->events[idx % thread_ring::ring_capacity];
+                trace_file << separator() << "{\"name\":\"" << evt.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->thread_id
+                           << ",\"ts\":" << evt.start_us << ",\"dur\":" << evt.duration_us;
+                if(evt.has_arg) {
+                    trace_file << ",\"args\":{\"value\":" << evt.arg << "}";
+                }
+                trace_file << "}";
+            }
+        }
+        trace_file << "\n]}\n";
+        std::cout << "Wrote the trace to " << trace_filename << std::endl;
+        return true;
+    }
+
+private:
+    trace_registry()
+      : trace_start(std::chrono::steady_clock::now())
+    {}
+
+    const std::chrono::steady_clock::time_point trace_start;
+    std::mutex registry_mutex;
+    std::vector<std::shared_ptr<thread_ring>> thread_rings;
+    //NOTE: the elements of an unordered_set stay put as it grows, so the pointers handed out stay valid
+    std::unordered_set<std::string> span_names;
+};
+
+class trace_scope
+{
+public:
+    explicit trace_scope(const char* name)
+      : ring(trace_registry::get().get_ring())
+    {
+        evt.name = name;
+        evt.arg = 0;
+        evt.has_arg = false;
+        evt.start_us = trace_registry::get().now_us();
+    }
+
+    trace_scope(const char* name, const int64_t arg)
+      : trace_scope(name)
+    {
+        evt.arg = arg;
+        evt.has_arg = true;
+    }
+
+    explicit trace_scope(const std::string& name)
+      : trace_scope(trace_registry::get().intern_name(name))
+    {}
+
+    trace_scope(const std::string& name, const int64_t arg)
+      : trace_scope(trace_registry::get().intern_name(name), arg)
+    {}
+
+    ~trace_scope()
+    {
+        evt.duration_us = trace_registry::get().now_us() - evt.start_us;
+        ring.record(evt);
+    }
+
+private:
+    thread_ring& ring;
+    trace_event evt;
+};
+
+inline void set_thread_name(const std::string& thread_name)
+{
+    trace_registry::get().get_ring().thread_name = thread_name;
+}
+
+} //namespace fractal_trace
+
+#define FRACTAL_TRACE_CONCAT_IMPL(a, b) a##b
+#define FRACTAL_TRACE_CONCAT(a, b) FRACTAL_TRACE_CONCAT_IMPL(a, b)
+
+#define FRACTAL_TRACE_SCOPE(name) fractal_trace::trace_scope FRACTAL_TRACE_CONCAT(fractal_trace_scope_, __LINE__) (name)
+#define FRACTAL_TRACE_SCOPE_ARG(name, arg) fractal_trace::trace_scope FRACTAL_TRACE_CONCAT(fractal_trace_scope_, __LINE__) (name, static_cast<int64_t>(arg))
+#define FRACTAL_TRACE_THREAD_NAME(name) fractal_trace::set_thread_name(name)
+#define FRACTAL_TRACE_EXPORT(filename) fractal_trace::trace_registry::get().export_chrome_trace(filename)
+
+#else
+
+#define FRACTAL_TRACE_SCOPE(name)
+#define FRACTAL_TRACE_SCOPE_ARG(name, arg)
+#define FRACTAL_TRACE_THREAD_NAME(name)
+#define FRACTAL_TRACE_EXPORT(filename)
+
+#endif
+
+#endif
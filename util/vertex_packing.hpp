@@ -0,0 +1,163 @@
+/* vertex_packing.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#ifndef UTIL_VERTEX_PACKING_HPP
+#define UTIL_VERTEX_PACKING_HPP
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+
+#include "util/fractal_helpers.hpp"
+#include "util/trace.hpp"
+
+namespace vertex_packing
+{
+
+//packs a [0,1] RGBA colour as VET_COLOUR_ABGR (i.e. R,G,B,A byte order in memory on little-endian)
+inline uint32_t pack_colour(const float r, const float g, const float b, const float a)
+{
+    auto to_byte = [](const float c) -> uint32_t
+    {
+        return static_cast<uint32_t>(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+    };
+    return (to_byte(a) << 24) | (to_byte(b) << 16) | (to_byte(g) << 8) | to_byte(r);
+}
+
+/* Works out the colour of every point, along with the centroid, bounding box and placement offset
+ * of the cloud.
+ *
+ * Both loops are plain scalar loops: the first is a reduction for the centroid and the bounding
+ * box, the second does the distance and colouring for every point in a single sweep. The colour ramp is
+ * normalized by the distance to the farthest bounding box corner rather than the farthest point,
+ * so that we don't need a separate max-distance pass.
+ */
+template <typename point_t, typename pixel_t>
+void shade_points(const fractal_types::pointcloud<point_t, pixel_t>& pt_cloud, const fractal_params& params, fractal_types::point_shading& shading)
+{
+    FRACTAL_TRACE_SCOPE("shade_points");
+    const auto& fractal_pts = pt_cloud.cloud;
+    const size_t num_pts = fractal_pts.size();
+
+    shading.colours.resize(num_pts);
+    if(num_pts == 0) {
+        return;
+    }
+
+    //NOTE: the coordinates are voxel indices, so the sums comfortably fit in an int64
+    int64_t sum_x = 0, sum_y = 0, sum_z = 0;
+    int min_x = std::numeric_limits<int>::max(), min_y = min_x, min_z = min_x;
+    int max_x = std::numeric_limits<int>::min(), max_y = max_x, max_z = max_x;
+    for (size_t i = 0; i < num_pts; ++i)
+    {
+        const auto& pt = fractal_pts[i];
+        sum_x += pt.x;
+        sum_y += pt.y;
+        sum_z += pt.z;
+        min_x = std::min(min_x, pt.x);
+        min_y = std::min(min_y, pt.y);
+        min_z = std::min(min_z, pt.z);
+        max_x = std::max(max_x, pt.x);
+        max_y = std::max(max_y, pt.y);
+        max_z = std::max(max_z, pt.z);
+    }
+
+    const float cx = static_cast<float>(sum_x) / num_pts;
+    const float cy = static_cast<float>(sum_y) / num_pts;
+    const float cz = static_cast<float>(sum_z) / num_pts;
+    shading.centroid[0] = cx;
+    shading.centroid[1] = cy;
+    shading.centroid[2] = cz;
+
+    //place the fractal at an offset above the ground plane so it is all visible
+    shading.offset[0] = cx;
+    shading.offset[1] = cy;
+    shading.offset[2] = cz - std::max(std::max(cx, cy), cz);
+
+    shading.bounds_min[0] = min_x - shading.offset[0];
+    shading.bounds_min[1] = min_y - shading.offset[1];
+    shading.bounds_min[2] = min_z - shading.offset[2];
+    shading.bounds_max[0] = max_x - shading.offset[0];
+    shading.bounds_max[1] = max_y - shading.offset[1];
+    shading.bounds_max[2] = max_z - shading.offset[2];
+
+    //farthest box corner from the centroid -- an upper bound on the farthest point
+    const float far_x = std::max(cx - min_x, max_x - cx);
+    const float far_y = std::max(cy - min_y, max_y - cy);
+    const float far_z = std::max(cz - min_z, max_z - cz);
+    const float max_dist = std::sqrt(far_x*far_x + far_y*far_y + far_z*far_z);
+    const float inv_max_dist = (max_dist > 0) ? 1.0f / max_dist : 0.0f;
+
+    for (size_t i = 0; i < num_pts; ++i)
+    {
+        const auto& pt = fractal_pts[i];
+        const float dx_dist = cx - pt.x;
+        const float dy_dist = cy - pt.y;
+        const float dz_dist = cz - pt.z;
+        const float dist = std::sqrt(dx_dist*dx_dist + dy_dist*dy_dist + dz_dist*dz_dist);
+
+        //we have to have the points that converged be solid, and the rest be semi-transparent.
+        //The converged points are darker towards the centroid and get progressively lighter outwards
+        if(pt.value >= params.MAX_ITER-1) {
+            shading.colours[i] = pack_colour(0.0f, dist * inv_max_dist, 0.0f, 1.0f);
+        } else {
+            const float color_coeff = 1.0f / params.MAX_ITER;
+            const float alpha_coeff = 0.01f;
+            shading.colours[i] = pack_colour(0.0f, color_coeff * pt.value, 0.0f, alpha_coeff * pt.value);
+        }
+    }
+}
+
+//interleaves the (offset) point positions with their colours into the array the frontend uploads as-is
+template <typename point_t, typename pixel_t>
+void pack_shaded(const fractal_types::pointcloud<point_t, pixel_t>& pt_cloud, const fractal_types::point_shading& shading, fractal_types::vertex_data& vdata)
+{
+    FRACTAL_TRACE_SCOPE("pack_shaded");
+    const auto& fractal_pts = pt_cloud.cloud;
+    const size_t num_pts = fractal_pts.size();
+
+    vdata.vertices.resize(num_pts);
+    for (int i = 0; i < 3; ++i)
+    {
+        vdata.centroid[i] = shading.centroid[i];
+        vdata.bounds_min[i] = shading.bounds_min[i];
+        vdata.bounds_max[i] = shading.bounds_max[i];
+    }
+
+    float radius_sq = 0;
+    for (size_t i = 0; i < num_pts; ++i)
+    {
+        const auto& pt = fractal_pts[i];
+        auto& vtx = vdata.vertices[i];
+        vtx.x = pt.x - shading.offset[0];
+        vtx.y = pt.y - shading.offset[1];
+        vtx.z = pt.z - shading.offset[2];
+        vtx.colour = shading.colours[i];
+        radius_sq = std::max(radius_sq, vtx.x*vtx.x + vtx.y*vtx.y + vtx.z*vtx.z);
+    }
+    vdata.radius = std::sqrt(radius_sq);
+}
+
+/* Converts the point cloud into the interleaved vertex array that the frontend uploads as-is.
+ * This is meant to run on the generation side -- the render thread should only have to copy
+ * the finished array into a hardware buffer.
+ */
+template <typename point_t, typename pixel_t>
+void pack_vertices(const fractal_types::pointcloud<point_t, pixel_t>& pt_cloud, const fractal_params& params, fractal_types::vertex_data& vdata)
+{
+    fractal_types::point_shading shading;
+    shade_points(pt_cloud, params, shading);
+    pack_shaded(pt_cloud, shading, vdata);
+}
+
+} //namespace vertex_packing
+
+#endif
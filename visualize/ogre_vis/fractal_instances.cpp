@@ -0,0 +1,94 @@
+/* fractal_instances.cpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+
+#include "fractal_instances.hpp"
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+
+
+FractalInstanceManager::FractalInstanceManager(Ogre::SceneManager* scene_mgmt, const size_t memory_budget)
+    : scene_mgmt(scene_mgmt), memory_budget(memory_budget), current_usage(0), peak_usage(0)
+{}
+
+FractalInstanceManager::~FractalInstanceManager()
+{
+    //NOTE: the scene manager owns the nodes + entities, so it'll clean them up on shutdown anyways
+}
+
+void FractalInstanceManager::add_instance(Ogre::SceneNode* fractal_node, Ogre::Entity* fractal_entity, const size_t mesh_bytes)
+{
+    fractal_instances.push_front(FractalInstance{fractal_node, fractal_entity});
+
+    //only the first instance of a mesh adds to the usage
+    auto usage_it = mesh_usage.find(fractal_entity->getMesh()->getName());
+    if(usage_it != mesh_usage.end()) {
+        usage_it->second.num_instances++;
+    } else {
+        mesh_usage[fractal_entity->getMesh()->getName()] = MeshUsage{1, mesh_bytes};
+        current_usage += mesh_bytes;
+        peak_usage = std::max(peak_usage, current_usage);
+    }
+
+    evict_instances();
+    print_usage();
+}
+
+void FractalInstanceManager::update_visibility(const Ogre::Camera* camera)
+{
+    //walk the list once, pulling anything in view to the front. The spliced nodes end up in the
+    //reverse of their previous order, which doesn't matter as they were all seen this frame
+    auto instance_it = fractal_instances.begin();
+    while(instance_it != fractal_instances.end())
+    {
+        auto next_it = std::next(instance_it);
+        if(camera->isVisible(instance_it->node->_getWorldAABB())) {
+            fractal_instances.splice(fractal_instances.begin(), fractal_instances, instance_it);
+        }
+        instance_it = next_it;
+    }
+}
+
+void FractalInstanceManager::print_usage() const
+{
+    const double MiB = 1024.0 * 1024.0;
+    std::cout << "Fractal Memory: " << current_usage / MiB << " MiB (peak " << peak_usage / MiB << " MiB, budget "
+              << memory_budget / MiB << " MiB) -- " << fractal_instances.size() << " instances" << std::endl;
+}
+
+void FractalInstanceManager::evict_instances()
+{
+    //always keep the most recent fractal around, even if it's over budget by itself
+    while(current_usage > memory_budget && fractal_instances.size() > 1)
+    {
+        const FractalInstance& lru_instance = fractal_instances.back();
+        std::cout << "Evicting fractal " << lru_instance.entity->getName() << std::endl;
+
+        destroy_instance(lru_instance);
+        fractal_instances.pop_back();
+    }
+}
+
+void FractalInstanceManager::destroy_instance(const FractalInstance& instance)
+{
+    const std::string mesh_name = instance.entity->getMesh()->getName();
+
+    instance.node->detachAllObjects();
+    scene_mgmt->destroyEntity(instance.entity);
+    scene_mgmt->destroySceneNode(instance.node);
+
+    //drops the vertex buffer along with the mesh, once nothing else is using it
+    auto usage_it = mesh_usage.find(mesh_name);
+    if(--usage_it->second.num_instances == 0)
+    {
+        current_usage -= usage_it->second.num_bytes;
+        mesh_usage.erase(usage_it);
+        Ogre::MeshManager::getSingleton().remove(mesh_name);
+    }
+}
@@ -0,0 +1,69 @@
+/* fractal_instances.hpp -- part of the fractal3d implementation
+ *
+ * Copyright (C) 2015 Alrik Firl
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef OGRE_VIS_FRACTAL_INSTANCES_HPP
+#define OGRE_VIS_FRACTAL_INSTANCES_HPP
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include <OGRE/Ogre.h>
+
+/* Keeps track of the fractals placed in the scene, and evicts the least-recently-viewed ones
+ * once the combined vertex buffer size goes over the memory budget. Instances are considered
+ * 'viewed' on every frame where they are inside the camera frustum. Several instances can share 
+ * one mesh; its vertex buffer is counted once, and destroyed along with its last instance.
+ */
+class FractalInstanceManager
+{
+public:
+    FractalInstanceManager(Ogre::SceneManager* scene_mgmt, const size_t memory_budget);
+    ~FractalInstanceManager();
+
+    //takes ownership of the scene node, its entity, and (shared) ownership of the entity's manual mesh
+    void add_instance(Ogre::SceneNode* fractal_node, Ogre::Entity* fractal_entity, const size_t mesh_bytes);
+
+    //moves the instances currently in view to the front of the LRU order. Call once per frame
+    void update_visibility(const Ogre::Camera* camera);
+
+    inline size_t get_current_usage() const { return current_usage; }
+    inline size_t get_peak_usage() const { return peak_usage; }
+    inline size_t get_memory_budget() const { return memory_budget; }
+    inline size_t get_num_instances() const { return fractal_instances.size(); }
+
+    void print_usage() const;
+
+private:
+    struct FractalInstance
+    {
+        Ogre::SceneNode* node;
+        Ogre::Entity* entity;
+    };
+    struct MeshUsage
+    {
+        int num_instances;
+        size_t num_bytes;
+    };
+    typedef std::list<FractalInstance> InstanceListType;
+
+    void evict_instances();
+    void destroy_instance(const FractalInstance& instance);
+
+    Ogre::SceneManager* scene_mgmt;
+    const size_t memory_budget;
+
+    //ordered by most recently viewed first
+    InstanceListType fractal_instances;
+    std::unordered_map<std::string, MeshUsage> mesh_usage;
+
+    size_t current_usage;
+    size_t peak_usage;
+};
+
+#endif
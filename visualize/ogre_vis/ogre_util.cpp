@@ -97,4 +97,27 @@ std::tuple<bool, float> check_point(Ogre::SceneManager* scene_mgmt, Ogre::Viewpo
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 }
 
+//copies out what the generator side needs to prioritize the requests
+camera_snapshot snapshot_camera(const Ogre::Camera* camera, const float world_scale)
+{
+    camera_snapshot snapshot;
+    const Ogre::Vector3 cam_position = camera->getDerivedPosition();
+    for (int i = 0; i < 3; ++i) {
+        snapshot.position[i] = cam_position[i];
+    }
+
+    //NOTE: Ogre's frustum planes face inwards, which matches the snapshot
+    for (int plane_idx = 0; plane_idx < camera_snapshot::num_planes; ++plane_idx)
+    {
+        const Ogre::Plane& frustum_plane = camera->getFrustumPlane(static_cast<unsigned short>(plane_idx));
+        snapshot.frustum_planes[plane_idx][0] = frustum_plane.normal.x;
+        snapshot.frustum_planes[plane_idx][1] = frustum_plane.normal.y;
+        snapshot.frustum_planes[plane_idx][2] = frustum_plane.normal.z;
+        snapshot.frustum_planes[plane_idx][3] = frustum_plane.d;
+    }
+    snapshot.world_scale = world_scale;
+    snapshot.is_valid = true;
+    return snapshot;
+}
+
 }
@@ -13,16 +13,20 @@
 #include <string>
 #include <tuple>
 #include <memory>
+#include <cmath>
+#include <cstdint>
 
 #include <OGRE/Ogre.h>
 #include "controller/Controller.hpp"
 #include "util/fractal_helpers.hpp"
+#include "util/camera_view.hpp"
 
 namespace ogre_util
 {
 
 	void load_resources(const std::string& resource_cfg_filename);
   std::tuple<bool, float> check_point(Ogre::SceneManager* scene_mgmt, Ogre::Viewport* view_port, const float x, const float y);
+  camera_snapshot snapshot_camera(const Ogre::Camera* camera, const float world_scale);
 
 } //namespace ogre_util
 
@@ -236,7 +240,21 @@ struct HandleUserInput
         params.fractal_name = "mandelbrot";
 
         //what to do about the Z-coord? We would want to have it be the map-plane's z-val
-        fractal_genevent fractal_gevt (params, world_click[0], world_click[1], 0);
+        //clicks that land in the same fractal-sized cell are for the same spot, so the newest one supersedes the rest
+        const double cell_x = std::floor(world_click[0] / params.imwidth);
+        const double cell_y = std::floor(world_click[1] / params.imheight);
+        //the cells are biased into 31 bits each, with the top bit set to mark the id as valid (target 0
+        //means 'no target'). A click too far out for that is sent without a target, i.e. isn't coalesced
+        const double cell_bias = 1 << 30;
+        uint64_t target_id = 0;
+        if(std::abs(cell_x) < cell_bias && std::abs(cell_y) < cell_bias)
+        {
+            const uint64_t biased_x = static_cast<uint64_t>(cell_x + cell_bias);
+            const uint64_t biased_y = static_cast<uint64_t>(cell_y + cell_bias);
+            target_id = (uint64_t(1) << 63) | (biased_x << 31) | biased_y;
+        }
+
+        fractal_genevent fractal_gevt (params, world_click[0], world_click[1], 0, fractal_count, target_id);
         ++fractal_count;
         return fractal_gevt;
     }
@@ -13,12 +13,16 @@
 #include <iostream>
 #include <string>
 #include <stdexcept>
+#include <cassert>
 
 #include <OGRE/Ogre.h>
-#include <boost/lockfree/spsc_queue.hpp>
 
 #include "util/fractal_helpers.hpp"
+#include "util/event_queue.hpp"
+#include "util/camera_view.hpp"
+#include "util/trace.hpp"
 #include "ogre_util.hpp"
+#include "fractal_instances.hpp"
 
 #include "controller/Controller.hpp"
 #include "controller/ControllerUtil.hpp"
@@ -28,14 +32,21 @@ template <typename pixel_t>
 class FractalOgre
 {
 public:
-  typedef boost::lockfree::spsc_queue<fractal_genevent, boost::lockfree::capacity<128>> FractalBufferType;
-  typedef boost::lockfree::spsc_queue<fractal_data<fractal_types::point_type, pixel_t>, boost::lockfree::capacity<128>> FractalDisplayBufferType;
+  //NOTE: the generator side blocks on this one, so it has to be able to wake it up
+  typedef event_queue<fractal_genevent, 128> FractalBufferType;
+  //NOTE: there can be several generator threads pushing results
+  typedef event_queue<fractal_data<fractal_types::point_type, pixel_t>, 128> FractalDisplayBufferType;
 
-  FractalOgre(const float rotate_factor, const float pan_factor)
-    : ogre_data(plugins_cfg_filename, resource_cfg_filename, rotate_factor, pan_factor), current_fractal_node(nullptr)
+  //the default budget for the vertex buffers of all the placed fractals
+  static constexpr size_t default_memory_budget = 256 * 1024 * 1024;
+
+  FractalOgre(const float rotate_factor, const float pan_factor, const size_t fractal_memory_budget = default_memory_budget)
+    : ogre_data(plugins_cfg_filename, resource_cfg_filename, rotate_factor, pan_factor), 
+      fractal_instances(ogre_data.scene_mgmt, fractal_memory_budget), current_fractal_node(nullptr)
   {
     fractal_evtbuffer = std::make_shared<FractalBufferType>();
     fractal_displayevtbuffer = std::make_shared<FractalDisplayBufferType>();
+    fractal_camera = std::make_shared<camera_view>();
 
     fractal_idx = 0;
   }
@@ -50,6 +61,12 @@ public:
     return fractal_displayevtbuffer;
   }
 
+  //updated every frame, for prioritizing the generation requests
+  inline std::shared_ptr<const camera_view> get_camera_view()
+  {
+    return fractal_camera;
+  }
+
   void start_display()
   {
     const std::string map_materialname {"GameMap"}; 
@@ -62,7 +79,7 @@ public:
   }
 
   template <typename point_t = fractal_types::point_type>
-  void display_fractal (fractal_data<point_t, pixel_t> fractal);
+  void display_fractal (const fractal_data<point_t, pixel_t>& fractal);
 
 private:
   struct OgreData : public Ogre::FrameListener, public Ogre::WindowEventListener
@@ -114,124 +131,57 @@ private:
   };
   
   void display_loop();
+  Ogre::MeshPtr make_fractal_mesh (const std::string& mesh_name, const fractal_types::vertex_data& vdata);
   
   static const std::string resource_cfg_filename; 
   static const std::string plugins_cfg_filename; 
   static const std::string fractal_name;
+  //the placed fractals are shrunk by this much (i.e. the points are this far apart, in world units)
+  static constexpr float fractal_scale = 0.5f;
 
   //keep track of the number of generated fractals to use in the point cloud IDs
   int fractal_idx;
   std::shared_ptr<FractalBufferType> fractal_evtbuffer;
   std::shared_ptr<FractalDisplayBufferType> fractal_displayevtbuffer;
+  std::shared_ptr<camera_view> fractal_camera;
 
   OgreData ogre_data;
+  //owns the placed fractals, evicts the least-recently-viewed ones when over budget
+  FractalInstanceManager fractal_instances;
   Ogre::SceneNode* current_fractal_node;
 };
 
 
-//draw the input fractal to the display
+//draw the input fractal to the display. The vertices were already packed on the generation 
+//side, so all that's left to do here is to copy them into a hardware vertex buffer (once per distinct fractal)
 template <typename pixel_t>
 template <typename point_t>
-void FractalOgre<pixel_t>::display_fractal (fractal_data<point_t, pixel_t> fractal)
+void FractalOgre<pixel_t>::display_fractal (const fractal_data<point_t, pixel_t>& fractal)
 {
+  FRACTAL_TRACE_SCOPE_ARG("display_fractal", fractal.request_id);
   const std::vector<float> target_coord = fractal.target_coord;
-  const float pt_factor = 2.0f;
-
-  auto fractal_pts = fractal.point_cloud.cloud;
-  std::vector<float> dim_avgs (3, 0);
-  std::for_each(fractal_pts.begin(), fractal_pts.end(), [&dim_avgs]
-        (const point_t& pt)
-        {
-            dim_avgs[0] += pt.x;
-            dim_avgs[1] += pt.y;
-            dim_avgs[2] += pt.z;
-        });
-  //get the average coordinate
-  dim_avgs[0] /= fractal_pts.size();
-  dim_avgs[1] /= fractal_pts.size();
-  dim_avgs[2] /= fractal_pts.size();
-
-  std::cout << "Fractal Centroid: [" << dim_avgs[0] << ", " << dim_avgs[1] << ", " << dim_avgs[2] << "]" << std::endl; 
- 
-  //TODO: you should just compute this and store it, as you end up computing the distance again later
-  //when making the point color
-  //assanged as: [x-coord, y-coord, z-coord, distance]
-  std::vector<float> dim_max (4, 0);
-  //find the point with the greatest euclidean distance from the centroid. Used in the point coloring
-  std::for_each(fractal_pts.begin(), fractal_pts.end(), [dim_avgs, &dim_max]
-        (const point_t& pt)
-        {
-            //compute euclidean distance
-            float dx_dist = dim_avgs[0] - pt.x;
-            float dy_dist = dim_avgs[1] - pt.y;
-            float dz_dist = dim_avgs[2] - pt.z;
-            float dist = std::sqrt(dx_dist*dx_dist + dy_dist*dy_dist + dz_dist*dz_dist); 
-
-            //see if it's the max, if so store it
-            if(dist > dim_max[3]) {
-                dim_max[0] = pt.x;
-                dim_max[1] = pt.y;
-                dim_max[2] = pt.z;
-                dim_max[3] = dist;
-            }
-        });
-  
-  float color_coeff = 1.0f / fractal.params.MAX_ITER;
-  float alpha_coeff = 0.01f;    
+  const float pt_factor = 1.0f / fractal_scale;
 
-  //get the coordinates to place the fractal at
-  const float height_offset = dim_avgs[0];
-  const float width_offset = dim_avgs[1];
-  //place the fractal at an offset above the ground plane so it is all visible
-  const float z_offset = *std::max_element(dim_avgs.begin(), dim_avgs.end());
-  const float depth_offset = dim_avgs[2] - z_offset;
+  if(!fractal.vertices || fractal.vertices->vertices.empty()) {
+    std::cout << "NOTE: fractal has no points, nothing to display" << std::endl;
+    return;
+  }
+  const auto& vdata = *fractal.vertices;
 
-  std::cout << "Fractal Centroid: [" << height_offset << ", " << width_offset << ", " << depth_offset << "]" << std::endl;
+  std::cout << "Fractal " << fractal.request_id << " Centroid: [" << vdata.centroid[0] << ", " << vdata.centroid[1] << ", " << vdata.centroid[2] << "]" << std::endl; 
 
   const std::string cloud_name = fractal_name + "_" + std::to_string(fractal_idx);
- 
-  //auto fractal_obj = ogre_data.scene_mgmt->createEntity(cloud_name, Ogre::SceneManager::PT_SPHERE);
-  //fractal_obj->setMaterialName("pointmaterial");
- 
-  Ogre::ManualObject* fractal_obj = ogre_data.scene_mgmt->createManualObject(cloud_name);
-  fractal_obj->begin("pointmaterial", Ogre::RenderOperation::OT_POINT_LIST);
+  const size_t num_vertices = vdata.vertices.size();
+
+  //fractals with the same cache key have identical vertices, so they all share one mesh (and vertex buffer)
+  const std::string mesh_name = fractal_name + "_mesh_" + std::to_string(fractal.cache_key);
+  Ogre::MeshPtr fractal_mesh = Ogre::MeshManager::getSingleton().getByName(mesh_name);
+  if(fractal_mesh.isNull())
   {
-      for (auto pt : fractal_pts)
-      {   
-          if(pt.x < 0 || pt.y < 0 || pt.z < 0) {
-		      std::cout << "NOTE: pt is bad -- [" << pt.x << ", " << pt.y << ", " << pt.z << "]" << std::endl; 
-          }
-
-          fractal_obj->position(pt.x - height_offset, pt.y - width_offset, pt.z - depth_offset);
-
-          /* TODO: change the generation stage to keep the non-converging pixels, so we can use them as the 
-           * semi-transparent outer layer
-           *
-           * change the point color based on its proximity to the fractal centroid? Or would this
-           * make any difference?
-           * 
-           */
-
-          //we have to have the points that converged be solid, and the rest be semi-transparent
-          if(pt.value >= fractal.params.MAX_ITER-1) {
-              float dx_dist = dim_avgs[0] - pt.x;
-              float dy_dist = dim_avgs[1] - pt.y;
-              float dz_dist = dim_avgs[2] - pt.z;
-              float dist = std::sqrt(dx_dist*dx_dist + dy_dist*dy_dist + dz_dist*dz_dist); 
-              float color_scale = 1.0f - (dim_max [3] / dist);
-
-              //we want the center pixel to be all-black, and the outer pixels from there to get 
-              //progressivly lighter. Just have it be green for now... green is a nice color 
-              fractal_obj->colour(Ogre::ColourValue(0.f, color_scale, 0.f, 1.0f));
-          } else {
-              fractal_obj->colour(Ogre::ColourValue(0.0f, color_coeff * pt.value, 0.0f, alpha_coeff * pt.value));
-          }
-      }
+    fractal_mesh = make_fractal_mesh(mesh_name, vdata);
   }
-  fractal_obj->end();
-  
 
-  //TODO: need to remove the old fractal's scenenode to cleanup -- look into how best to do this
+  Ogre::Entity* fractal_obj = ogre_data.scene_mgmt->createEntity(cloud_name, fractal_mesh);
 
   auto new_fractal_node = ogre_data.map_node->createChildSceneNode();
   new_fractal_node->attachObject(fractal_obj);
@@ -243,11 +193,47 @@ void FractalOgre<pixel_t>::display_fractal (fractal_data<point_t, pixel_t> fract
   new_fractal_node->showBoundingBox(true);
   fractal_idx++;
 
+  //NOTE: the newest fractal is never evicted, so current_fractal_node always stays valid
+  fractal_instances.add_instance(new_fractal_node, fractal_obj, num_vertices * sizeof(fractal_types::packed_vertex));
+
   //out with the old, in with the new...
   current_fractal_node = new_fractal_node;
 }
 
 
+//copies the packed vertices into a static hardware vertex buffer, wrapped in a (manual) mesh
+template <typename pixel_t>
+Ogre::MeshPtr FractalOgre<pixel_t>::make_fractal_mesh (const std::string& mesh_name, const fractal_types::vertex_data& vdata)
+{
+  Ogre::MeshPtr fractal_mesh = Ogre::MeshManager::getSingleton().createManual(mesh_name, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+  Ogre::SubMesh* fractal_submesh = fractal_mesh->createSubMesh();
+  fractal_submesh->useSharedVertices = false;
+  fractal_submesh->operationType = Ogre::RenderOperation::OT_POINT_LIST;
+  fractal_submesh->vertexData = new Ogre::VertexData();
+  fractal_submesh->vertexData->vertexStart = 0;
+  fractal_submesh->vertexData->vertexCount = vdata.vertices.size();
+
+  //has to match the fractal_types::packed_vertex layout
+  Ogre::VertexDeclaration* vertex_decl = fractal_submesh->vertexData->vertexDeclaration;
+  size_t vertex_offset = 0;
+  vertex_offset += vertex_decl->addElement(0, vertex_offset, Ogre::VET_FLOAT3, Ogre::VES_POSITION).getSize();
+  vertex_decl->addElement(0, vertex_offset, Ogre::VET_COLOUR_ABGR, Ogre::VES_DIFFUSE);
+  assert(vertex_decl->getVertexSize(0) == sizeof(fractal_types::packed_vertex));
+
+  Ogre::HardwareVertexBufferSharedPtr vertex_buffer = Ogre::HardwareBufferManager::getSingleton().createVertexBuffer(
+      sizeof(fractal_types::packed_vertex), vdata.vertices.size(), Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+  vertex_buffer->writeData(0, vertex_buffer->getSizeInBytes(), vdata.vertices.data(), true);
+  fractal_submesh->vertexData->vertexBufferBinding->setBinding(0, vertex_buffer);
+  fractal_submesh->setMaterialName("pointmaterial");
+
+  fractal_mesh->_setBounds(Ogre::AxisAlignedBox(vdata.bounds_min[0], vdata.bounds_min[1], vdata.bounds_min[2], 
+                                                vdata.bounds_max[0], vdata.bounds_max[1], vdata.bounds_max[2]));
+  fractal_mesh->_setBoundingSphereRadius(vdata.radius);
+  fractal_mesh->load();
+  return fractal_mesh;
+}
+
+
 template <typename pixel_t>
 const std::string FractalOgre<pixel_t>::resource_cfg_filename {"resources.cfg"}; 
 
@@ -268,13 +254,27 @@ void FractalOgre<pixel_t>::display_loop()
   double time_elapsed = 0;   
   const double TOTAL_TIME = 60 * 1000;
   auto start_time = std::chrono::high_resolution_clock::now();
+  FRACTAL_TRACE_THREAD_NAME("render");
   do
   {
-      ogre_data.root->renderOneFrame();
+      FRACTAL_TRACE_SCOPE("frame");
+      {
+        FRACTAL_TRACE_SCOPE("render_frame");
+        ogre_data.root->renderOneFrame();
+      }
       Ogre::WindowEventUtilities::messagePump();
+
+      //keep the LRU order of the placed fractals up to date with what's on screen
+      fractal_instances.update_visibility(ogre_data.camera);
     
       //handle any user inputs
-      input_handler(ogre_data.scene_mgmt, ogre_data.view_port, fractal_evtbuffer);            
+      {
+        FRACTAL_TRACE_SCOPE("handle_input");
+        input_handler(ogre_data.scene_mgmt, ogre_data.view_port, fractal_evtbuffer);            
+      }
+
+      //let the generator side know where the camera ended up (a no-op if it hasn't moved)
+      fractal_camera->publish(ogre_util::snapshot_camera(ogre_data.camera, fractal_scale));
 
 //---------------------------------------------------------------------------------------        
 
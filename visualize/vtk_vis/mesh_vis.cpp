@@ -7,6 +7,7 @@
  */
 
 #include "mesh_vis.h"
+#include "util/trace.hpp"
 
 #include <pcl/io/pcd_io.h>
 #include <pcl/io/vtk_io.h>
@@ -36,7 +37,7 @@ void show_pointcloud(pcl::PointCloud<pcl::PointXYZ>::Ptr pt_cloud, const std::st
 
 void show_model_mesh(pcl::PointCloud<pcl::PointXYZ>::Ptr pt_cloud, const std::string& mesh_fname)
 {
-    auto  start = std::chrono::high_resolution_clock::now();
+    FRACTAL_TRACE_SCOPE("show_model_mesh");
 
     pcl::NormalEstimation<pcl::PointXYZ, pcl::Normal> ne;
     ne.setInputCloud(pt_cloud);
@@ -68,9 +69,6 @@ void show_model_mesh(pcl::PointCloud<pcl::PointXYZ>::Ptr pt_cloud, const std::st
     pcl::PolygonMesh mesh;
     poisson.reconstruct(mesh);
   
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration<double, std::milli>(end - start);
-    std::cout << "Mesh Generation Time: " << duration.count() << " ms" << std::endl;
 
     pcl::io::saveVTKFile (mesh_fname, mesh);
   